@@ -53,14 +53,27 @@ def do_insertipaddr():
     pyt.insert(ip4, 'abc')
     pyt.insert(ip6, 'abc')
 
+def do_get():
+    pyt.get('10.0.1.2')
+    pyt.get('fe80:beef::1')
+
+def do_getkey():
+    pyt.get_key('10.0.1.2')
+    pyt.get_key('fe80:beef::1')
+
+def do_haskey():
+    pyt.has_key('10.0.1.2/16')
+    pyt.has_key('fe80:beef::/64')
+
 def main():
     from timeit import Timer
-    iterations = 10000000
+    iterations = int(sys.argv[1]) if len(sys.argv) > 1 else 10000000
 
     expts = ['do_insert', 'do_indexassign', 'do_insertstr', 'do_insertstr_separate_prefix']
     if sys.version_info.major == 3:
         expts.append('do_insertbytes')
         expts.append('do_insertipaddr')
+    expts += ['do_get', 'do_getkey', 'do_haskey']
 
     for fn in expts:
         t = Timer("{}()".format(fn), "from __main__ import {}".format(fn))
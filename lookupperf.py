@@ -0,0 +1,85 @@
+#
+# This file is part of Pytricia.
+# Joel Sommers <jsommers@colgate.edu>
+#
+# Pytricia is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Pytricia is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+#
+# Lookup rate of trees built from the routeviews snapshots in the repo:
+# first for the number of lookups lookup_array keeps in flight at once
+# (interleave=1 is one address at a time), on the tree as built, then
+# for each node layout accepted by freeze().  Half of the addresses fall
+# inside a random table prefix, the rest are uniformly random.
+#
+
+from __future__ import print_function
+import array
+import random
+import socket
+import sys
+import time
+import pytricia
+
+LAYOUTS = ('preorder', 'bfs', 'veb')
+
+def make_addrs(pyt, maxbits, n):
+    family = socket.AF_INET if maxbits == 32 else socket.AF_INET6
+    rng = random.Random(42)
+    prefixes = list(pyt)
+    addrs = []
+    for i in range(n):
+        if i % 2:
+            addrs.append(rng.getrandbits(maxbits))
+            continue
+        net, plen = rng.choice(prefixes).split('/')
+        host = maxbits - int(plen)
+        base = int.from_bytes(socket.inet_pton(family, net), 'big')
+        addrs.append(base | (rng.getrandbits(host) if host else 0))
+    nbytes = maxbits // 8
+    return bytearray(b''.join(a.to_bytes(nbytes, 'big') for a in addrs))
+
+INTERLEAVE = (1, 4, 8, 16, 32)
+
+def rate(pyt, addrs, out, n, repeat, **kwargs):
+    best = None
+    for i in range(repeat):
+        start = time.time()
+        pyt.lookup_array(addrs, out, **kwargs)
+        elapsed = time.time() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return n / best
+
+def run(fname, maxbits, n, repeat=5):
+    pyt = pytricia.PyTricia(maxbits)
+    pyt.load_pfx2as(fname)
+    addrs = make_addrs(pyt, maxbits, n)
+    out = array.array('q', [0] * n)
+    print("{}: {} prefixes, {} addresses".format(fname, len(pyt), n))
+    single = None
+    for interleave in INTERLEAVE:
+        r = rate(pyt, addrs, out, n, repeat, interleave=interleave)
+        single = single or r
+        print("    interleave={:<3d} {:12.0f} lookups/s ({:.2f}x)".format(interleave, r, r / single))
+    for layout in LAYOUTS:
+        pyt.freeze(layout=layout)
+        print("    {:14s} {:12.0f} lookups/s".format(layout, rate(pyt, addrs, out, n, repeat)))
+
+def main():
+    n = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+    run('routeviews-rv2-20160202-1200.pfx2as.gz', 32, n)
+    run('routeviews-rv6-20160202-1200.pfx2as.gz', 128, n)
+
+if __name__ == '__main__':
+    main()
@@ -105,18 +105,72 @@ prefix_tochar (prefix_t * prefix)
 	return ((u_char *) & prefix->add.sin);
 }
 
-int 
-comp_with_mask (void *addr, void *dest, u_int mask)
+/* addresses stay in network byte order, but are compared a 64-bit word
+ * at a time.  the shifts below compile to a single load and byte swap. */
+static inline uint64_t
+addr_word (const u_char *a)
 {
+	return (((uint64_t)a[0] << 56) | ((uint64_t)a[1] << 48) |
+		((uint64_t)a[2] << 40) | ((uint64_t)a[3] << 32) |
+		((uint64_t)a[4] << 24) | ((uint64_t)a[5] << 16) |
+		((uint64_t)a[6] << 8) | (uint64_t)a[7]);
+}
 
-	if ( /* mask/8 == 0 || */ memcmp (addr, dest, mask / 8) == 0) {
-	   	int n = mask / 8;
-	   	int m = ((-1) << (8 - (mask % 8)));
+#if defined(__GNUC__) || defined(__clang__)
+#define CLZ64(x) ((u_int)__builtin_clzll (x))
+#elif defined(_MSC_VER) && defined(_WIN64)
+#include <intrin.h>
+static inline u_int
+CLZ64 (uint64_t x)
+{
+	unsigned long bit;
+	_BitScanReverse64 (&bit, x);
+	return (63 - (u_int)bit);
+}
+#else
+static inline u_int
+CLZ64 (uint64_t x)
+{
+	u_int n = 0;
+	while (!(x & 0x8000000000000000ULL)) {
+		x <<= 1;
+		n++;
+	}
+	return (n);
+}
+#endif
 
-	   	if (mask % 8 == 0 || (((u_char *)addr)[n] & m) == (((u_char *)dest)[n] & m))
-			return (1);
+/* first bit where the addresses differ, or limit if the first limit
+ * bits are all the same.  both must be full 16-byte addresses. */
+static inline u_int
+addr_differ_bit (const u_char *a, const u_char *b, u_int limit)
+{
+	uint64_t x = addr_word (a) ^ addr_word (b);
+	u_int bit;
+
+	if (x)
+		bit = CLZ64 (x);
+	else if (limit <= 64)
+		bit = 64;
+	else {
+		x = addr_word (a + 8) ^ addr_word (b + 8);
+		bit = x ? 64 + CLZ64 (x): 128;
 	}
-	return (0);
+	return (bit < limit ? bit: limit);
+}
+
+/* addr and dest must point at full (16-byte) prefix_t addresses */
+int 
+comp_with_mask (void *addr, void *dest, u_int mask)
+{
+	return (mask == 0 || addr_differ_bit (addr, dest, mask) >= mask);
+}
+
+/* exported form of addr_differ_bit, for ordered walks outside this file */
+u_int
+patricia_differ_bit (const u_char *a, const u_char *b, u_int limit)
+{
+	return (addr_differ_bit (a, b, limit));
 }
 
 /* inet_pton substitute implementation
@@ -351,6 +405,19 @@ void
 Clear_Patricia (patricia_tree_t *patricia, void_fn1_t func)
 {
 	assert (patricia);
+	patricia_engine_free (patricia);
+	if (patricia->block) {
+		patricia_frozen_t *block = patricia->block;
+		u_int i;
+
+		for (i = 0; i < block->num_entries; i++) {
+			if (func)
+				func (block->entries[i].data);
+		}
+		patricia->num_active_node -= block->num_nodes;
+		patricia->block = NULL;
+		Delete (block);
+	}
 	if (patricia->head) {
 		patricia_node_t *Xstack[PATRICIA_MAXBITS+1];
 		patricia_node_t **Xsp = Xstack;
@@ -367,9 +434,7 @@ Clear_Patricia (patricia_tree_t *patricia, void_fn1_t func)
 			else {
 				assert (Xrn->data == NULL);
 			}
-			if(!patricia->frozen) {
-				Delete (Xrn);
-			}
+			Delete (Xrn);
 			patricia->num_active_node--;
 
 			if (l) {
@@ -387,9 +452,7 @@ Clear_Patricia (patricia_tree_t *patricia, void_fn1_t func)
 		}
 	}
 	assert (patricia->num_active_node == 0);
-	if(patricia->frozen && patricia->head) {
-		Delete (patricia->head);
-	}
+	patricia->head = NULL;
 		/* Delete (patricia); */
 }
 
@@ -413,12 +476,741 @@ patricia_process (patricia_tree_t *patricia, void_fn2_t func)
 	patricia_node_t *node;
 	assert (func);
 
-	PATRICIA_WALK (patricia->head, node) {
+	PATRICIA_WALK_TREE (patricia, node) {
 		func (&node->prefix, node->data);
-	} PATRICIA_WALK_END;
+	} PATRICIA_WALK_TREE_END;
 }
 
 
+/*
+ * a frozen block for num_nodes nodes and num_entries entries, zeroed, in
+ * a single allocation (freed with free), or NULL when out of memory
+ */
+patricia_frozen_t *
+patricia_frozen_new (u_int num_nodes, u_int num_entries)
+{
+	patricia_frozen_t *block;
+
+	block = calloc (1, sizeof *block + (size_t)num_nodes * sizeof (patricia_hot_t) + 
+			(size_t)num_entries * sizeof (patricia_entry_t));
+	if (block == NULL)
+		return (NULL);
+	block->nodes = (patricia_hot_t *)(block + 1);
+	block->entries = (patricia_entry_t *)(block->nodes + num_nodes);
+	block->num_nodes = num_nodes;
+	block->num_entries = num_entries;
+	return (block);
+}
+
+
+/* { lookup engines for frozen trees */
+
+/* GCC and clang can compile single functions for newer x86 CPUs; the
+ * engines pick those versions at runtime */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PATRICIA_X86_TARGETS 1
+#include <immintrin.h>
+#endif
+
+/* patricia_search_exact over the hot nodes of a frozen block */
+static patricia_node_t *
+frozen_search_exact (const patricia_frozen_t *block, prefix_t *prefix)
+{
+	const patricia_hot_t *hot = block->nodes;
+	const u_char *addr = prefix_touchar (prefix);
+	u_int bitlen = prefix->bitlen;
+	uint32_t i = 0, next;
+	patricia_entry_t *entry;
+
+	while (hot[i].bit < bitlen) {
+		if (BIT_TEST (addr[hot[i].bit >> 3], 0x80 >> (hot[i].bit & 0x07)))
+			next = hot[i].r;
+		else
+			next = hot[i].l;
+		if (next == 0)
+			return (NULL);
+		i = next - 1;
+	}
+	if (hot[i].bit > bitlen || hot[i].entry == 0)
+		return (NULL);
+	entry = &block->entries[hot[i].entry - 1];
+	if (comp_with_mask (prefix_tochar (&entry->prefix), prefix_tochar (prefix), bitlen))
+		return (PATRICIA_ENTRY_NODE (entry));
+	return (NULL);
+}
+
+/* the walk in patricia_search_best2 over the hot nodes of a frozen
+ * block, which leaves the entries of the candidates on the path (most
+ * specific last) in stack and returns their number */
+static int
+frozen_search_path (const patricia_frozen_t *block, prefix_t *prefix, int inclusive, 
+		    uint32_t *stack)
+{
+	const patricia_hot_t *hot = block->nodes;
+	const u_char *addr = prefix_touchar (prefix);
+	u_int bitlen = prefix->bitlen;
+	uint32_t i = 0, next;
+	int cnt = 0;
+
+	for (;;) {
+		if (hot[i].bit >= bitlen) {
+			if (inclusive && hot[i].entry && hot[i].bit == bitlen)
+				stack[cnt++] = hot[i].entry - 1;
+			break;
+		}
+		if (hot[i].entry)
+			stack[cnt++] = hot[i].entry - 1;
+		if (BIT_TEST (addr[hot[i].bit >> 3], 0x80 >> (hot[i].bit & 0x07)))
+			next = hot[i].r;
+		else
+			next = hot[i].l;
+		if (next == 0)
+			break;
+		i = next - 1;
+	}
+	return (cnt);
+}
+
+/* only the candidates on the path touch their entries */
+static patricia_node_t *
+frozen_search_best (const patricia_frozen_t *block, prefix_t *prefix, int inclusive)
+{
+	uint32_t stack[PATRICIA_MAXBITS + 1];
+	int cnt = frozen_search_path (block, prefix, inclusive, stack);
+	patricia_entry_t *entry;
+
+	while (--cnt >= 0) {
+		entry = &block->entries[stack[cnt]];
+		if (comp_with_mask (prefix_tochar (&entry->prefix), prefix_tochar (prefix),
+				    entry->prefix.bitlen))
+			return (PATRICIA_ENTRY_NODE (entry));
+	}
+	return (NULL);
+}
+
+static uint32_t
+dir24_addr (prefix_t *prefix)
+{
+	u_char *a = prefix_touchar (prefix);
+	return (((uint32_t)a[0] << 24) | ((uint32_t)a[1] << 16) |
+		((uint32_t)a[2] << 8) | (uint32_t)a[3]);
+}
+
+/* the more specific prefix wins; leaves refer to entries by index + 1 */
+static void
+engine_leaf_set (patricia_tree_t *patricia, uint32_t *entry, uint32_t value)
+{
+	patricia_entry_t *entries = patricia->block->entries;
+
+	if (*entry == 0 || 
+		entries[*entry - 1].prefix.bitlen < entries[value - 1].prefix.bitlen)
+		*entry = value;
+}
+
+static int
+dir24_insert (patricia_tree_t *patricia, patricia_dir24_t *dir, uint32_t value)
+{
+	prefix_t *prefix = &patricia->block->entries[value - 1].prefix;
+	uint32_t addr = dir24_addr (prefix);
+	u_int bitlen = prefix->bitlen > 32 ? 32: prefix->bitlen;
+	uint32_t i, j, start, count, *entry;
+
+	if (bitlen <= 24) {
+		count = 1U << (24 - bitlen);
+		start = (addr >> 8) & ~(count - 1);
+		for (i = start; i < start + count; i++) {
+			entry = &dir->tbl24[i];
+			if (*entry & DIR24_CHUNK) {
+				uint32_t *chunk = &dir->tbl8[(*entry & ~DIR24_CHUNK) << 8];
+				for (j = 0; j < 256; j++)
+					engine_leaf_set (patricia, &chunk[j], value);
+			}
+			else {
+				engine_leaf_set (patricia, entry, value);
+			}
+		}
+		return (1);
+	}
+
+	entry = &dir->tbl24[addr >> 8];
+	if (!(*entry & DIR24_CHUNK)) {
+		if (dir->ntbl8 == dir->captbl8) {
+			u_int newcap = dir->captbl8 ? dir->captbl8 * 2: 64;
+			uint32_t *tbl8 = realloc (dir->tbl8, (size_t)newcap * 256 * sizeof (uint32_t));
+			if (tbl8 == NULL)
+				return (0);
+			dir->tbl8 = tbl8;
+			dir->captbl8 = newcap;
+		}
+		/* new chunk inherits whatever covered the whole /24 */
+		for (j = 0; j < 256; j++)
+			dir->tbl8[((size_t)dir->ntbl8 << 8) + j] = *entry;
+		*entry = DIR24_CHUNK | dir->ntbl8++;
+	}
+	count = 1U << (32 - bitlen);
+	start = addr & 0xff & ~(count - 1);
+	for (i = start; i < start + count; i++)
+		engine_leaf_set (patricia, &dir->tbl8[((size_t)(*entry & ~DIR24_CHUNK) << 8) + i], value);
+	return (1);
+}
+
+static patricia_dir24_t *
+dir24_build (patricia_tree_t *patricia)
+{
+	patricia_dir24_t *dir;
+	uint32_t i;
+	int ok = 1;
+
+	if (patricia->maxbits != 32)
+		return (NULL);
+	dir = calloc (1, sizeof *dir);
+	if (dir == NULL)
+		return (NULL);
+	dir->tbl24 = calloc ((size_t)1 << 24, sizeof (uint32_t));
+	if (dir->tbl24 == NULL) {
+		Delete (dir);
+		return (NULL);
+	}
+
+	for (i = 0; i < patricia->block->num_entries && ok; i++)
+		ok = dir24_insert (patricia, dir, i + 1);
+
+	if (!ok) {
+		Delete (dir->tbl8);
+		Delete (dir->tbl24);
+		Delete (dir);
+		return (NULL);
+	}
+	return (dir);
+}
+
+static patricia_node_t *
+dir24_search (patricia_tree_t *patricia, prefix_t *prefix)
+{
+	patricia_dir24_t *dir = patricia->engine_data;
+	uint32_t addr = dir24_addr (prefix);
+	uint32_t entry = dir->tbl24[addr >> 8];
+
+	if (entry & DIR24_CHUNK)
+		entry = dir->tbl8[((size_t)(entry & ~DIR24_CHUNK) << 8) | (addr & 0xff)];
+	return (entry ? PATRICIA_ENTRY (patricia->block, entry - 1): NULL);
+}
+
+/* table entries for n host-order addresses.  the vector versions below
+ * resolve 8 or 16 addresses per step with gathers, and
+ * patricia_simd_init() picks one for dir24_entries */
+static void
+dir24_entries_scalar (const patricia_dir24_t *dir, const uint32_t *addrs, 
+		      size_t n, uint32_t *entries)
+{
+	size_t i;
+	uint32_t entry;
+
+	for (i = 0; i < n; i++) {
+		entry = dir->tbl24[addrs[i] >> 8];
+		if (entry & DIR24_CHUNK)
+			entry = dir->tbl8[((size_t)(entry & ~DIR24_CHUNK) << 8) | (addrs[i] & 0xff)];
+		entries[i] = entry;
+	}
+}
+
+#ifdef PATRICIA_X86_TARGETS
+__attribute__((target ("avx2"))) static void
+dir24_entries_avx2 (const patricia_dir24_t *dir, const uint32_t *addrs, 
+		    size_t n, uint32_t *entries)
+{
+	const __m256i chunk = _mm256_set1_epi32 ((int)DIR24_CHUNK);
+	const __m256i low = _mm256_set1_epi32 (0xff);
+	__m256i addr, entry, more, idx;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		addr = _mm256_loadu_si256 ((const __m256i *)(addrs + i));
+		entry = _mm256_i32gather_epi32 ((const int *)dir->tbl24, _mm256_srli_epi32 (addr, 8), 4);
+		if (!_mm256_testz_si256 (entry, chunk)) {
+			more = _mm256_cmpeq_epi32 (_mm256_and_si256 (entry, chunk), chunk);
+			idx = _mm256_or_si256 (_mm256_slli_epi32 (_mm256_andnot_si256 (chunk, entry), 8),
+					       _mm256_and_si256 (addr, low));
+			entry = _mm256_mask_i32gather_epi32 (entry, (const int *)dir->tbl8, idx, more, 4);
+		}
+		_mm256_storeu_si256 ((__m256i *)(entries + i), entry);
+	}
+	dir24_entries_scalar (dir, addrs + i, n - i, entries + i);
+}
+
+__attribute__((target ("avx512f"))) static void
+dir24_entries_avx512 (const patricia_dir24_t *dir, const uint32_t *addrs, 
+		      size_t n, uint32_t *entries)
+{
+	const __m512i chunk = _mm512_set1_epi32 ((int)DIR24_CHUNK);
+	const __m512i low = _mm512_set1_epi32 (0xff);
+	__m512i addr, entry, idx;
+	__mmask16 more;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		addr = _mm512_loadu_si512 ((const void *)(addrs + i));
+		entry = _mm512_i32gather_epi32 (_mm512_srli_epi32 (addr, 8), (const void *)dir->tbl24, 4);
+		more = _mm512_test_epi32_mask (entry, chunk);
+		if (more) {
+			idx = _mm512_or_si512 (_mm512_slli_epi32 (_mm512_andnot_si512 (chunk, entry), 8),
+					       _mm512_and_si512 (addr, low));
+			entry = _mm512_mask_i32gather_epi32 (entry, more, idx, (const void *)dir->tbl8, 4);
+		}
+		_mm512_storeu_si512 ((void *)(entries + i), entry);
+	}
+	dir24_entries_scalar (dir, addrs + i, n - i, entries + i);
+}
+#endif /* PATRICIA_X86_TARGETS */
+
+static void (*dir24_entries) (const patricia_dir24_t *, const uint32_t *, size_t, uint32_t *) = 
+	dir24_entries_scalar;
+
+/*
+ * choose the vector kernels for this CPU, up to maxlevel
+ * (PATRICIA_SIMD_*).  returns the level chosen.
+ */
+int
+patricia_simd_init (int maxlevel)
+{
+	int level = PATRICIA_SIMD_SCALAR;
+
+#ifdef PATRICIA_X86_TARGETS
+	__builtin_cpu_init ();
+	if (maxlevel >= PATRICIA_SIMD_AVX512 && __builtin_cpu_supports ("avx512f"))
+		level = PATRICIA_SIMD_AVX512;
+	else if (maxlevel >= PATRICIA_SIMD_AVX2 && __builtin_cpu_supports ("avx2"))
+		level = PATRICIA_SIMD_AVX2;
+#endif
+
+	switch (level) {
+#ifdef PATRICIA_X86_TARGETS
+	case PATRICIA_SIMD_AVX512:
+		dir24_entries = dir24_entries_avx512;
+		break;
+	case PATRICIA_SIMD_AVX2:
+		dir24_entries = dir24_entries_avx2;
+		break;
+#endif
+	default:
+		dir24_entries = dir24_entries_scalar;
+		break;
+	}
+	return (level);
+}
+
+/* best matches for a batch of prefixes; shorter than full-length
+ * prefixes go through the trie as usual */
+static void
+dir24_search_many (patricia_tree_t *patricia, prefix_t *prefixes, size_t n, 
+		   patricia_node_t **out)
+{
+	uint32_t addrs[64], entries[64];
+	size_t base, i, m;
+
+	for (base = 0; base < n; base += m) {
+		m = n - base < 64 ? n - base: 64;
+		for (i = 0; i < m; i++)
+			addrs[i] = dir24_addr (&prefixes[base + i]);
+		dir24_entries (patricia->engine_data, addrs, m, entries);
+		for (i = 0; i < m; i++) {
+			if (prefixes[base + i].bitlen < patricia->maxbits)
+				out[base + i] = patricia_search_best (patricia, &prefixes[base + i]);
+			else
+				out[base + i] = entries[i] ? PATRICIA_ENTRY (patricia->block, entries[i] - 1): NULL;
+		}
+	}
+}
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define POPCOUNT64(x) ((u_int)__popcnt64 (x))
+#else
+#define POPCOUNT64(x) ((u_int)__builtin_popcountll (x))
+#endif
+
+/* without -mpopcnt the popcount builtin is a library call on x86, so
+ * the search is also compiled for CPUs with the instruction, and
+ * poptrie_build checks for it */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define POPTRIE_HW_POPCNT 1
+#endif
+
+/* the POPTRIE_STRIDE bits of addr starting at bit off; bytes past
+ * nbytes read as zero */
+static inline u_int
+poptrie_chunk (const u_char *addr, u_int off, u_int nbytes)
+{
+	u_int i = off >> 3;
+	u_int w = (i < nbytes ? (u_int)addr[i] << 8: 0) | (i + 1 < nbytes ? addr[i + 1]: 0);
+	return (w >> (16 - POPTRIE_STRIDE - (off & 0x07))) & ((1U << POPTRIE_STRIDE) - 1);
+}
+
+/* number of bits set in x at or below bit v */
+#define POPTRIE_RANK(x, v) POPCOUNT64 ((x) << (63 - (v)))
+
+static int
+poptrie_grow (void **array, u_int *cap, u_int need, size_t size)
+{
+	void *p;
+	u_int newcap;
+
+	if (need <= *cap)
+		return (1);
+	newcap = *cap ? *cap: 1024;
+	while (newcap < need)
+		newcap *= 2;
+	p = realloc (*array, (size_t)newcap * size);
+	if (p == NULL)
+		return (0);
+	*array = p;
+	*cap = newcap;
+	return (1);
+}
+
+/*
+ * fill in pt->nodes[idx] for the n entries (by index) in list, all of
+ * which are longer than off bits and lie under this node.  def is the
+ * leaf for whatever covers the node as a whole.
+ */
+static int
+poptrie_build_node (patricia_tree_t *patricia, patricia_poptrie_t *pt, u_int idx,
+		    uint32_t *list, size_t n, u_int off, uint32_t def)
+{
+	patricia_entry_t *entries = patricia->block->entries;
+	uint32_t slots[64], prev = 0;
+	size_t count[64], start[64], i;
+	uint32_t *sub = NULL;
+	uint64_t vector = 0, leafvec = 0;
+	u_int v, j, k, span, base0, base1, nchild;
+	int ok = 1;
+
+	for (v = 0; v < 64; v++) {
+		slots[v] = def;
+		count[v] = 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		prefix_t *prefix = &entries[list[i]].prefix;
+		u_int bitlen = prefix->bitlen;
+
+		v = poptrie_chunk (prefix_touchar (prefix), off, pt->addrbytes);
+		if (bitlen > off + POPTRIE_STRIDE) {
+			vector |= 1ULL << v;
+			count[v]++;
+			continue;
+		}
+		/* shorter prefixes cover a run of slots; the longest one wins */
+		span = 1U << (off + POPTRIE_STRIDE - bitlen);
+		v &= ~(span - 1);
+		for (j = v; j < v + span; j++)
+			engine_leaf_set (patricia, &slots[j], list[i] + 1);
+	}
+
+	base0 = pt->nleaves;
+	for (v = 0; v < 64; v++) {
+		if (vector & (1ULL << v))
+			continue;
+		if (leafvec == 0 || slots[v] != prev) {
+			if (!poptrie_grow ((void **)&pt->leaves, &pt->capleaves, 
+					   pt->nleaves + 1, sizeof (uint32_t)))
+				return (0);
+			leafvec |= 1ULL << v;
+			pt->leaves[pt->nleaves++] = slots[v];
+		}
+		prev = slots[v];
+	}
+
+	/* children of a node are allocated together, then filled in */
+	nchild = POPCOUNT64 (vector);
+	base1 = pt->nnodes;
+	if (!poptrie_grow ((void **)&pt->nodes, &pt->capnodes, 
+			   pt->nnodes + nchild, sizeof (poptrie_node_t)))
+		return (0);
+	pt->nnodes += nchild;
+	pt->nodes[idx].vector = vector;
+	pt->nodes[idx].leafvec = leafvec;
+	pt->nodes[idx].base0 = base0;
+	pt->nodes[idx].base1 = base1;
+	if (nchild == 0)
+		return (1);
+
+	/* bucket the longer prefixes by slot, keeping their order */
+	sub = malloc (n * sizeof (uint32_t));
+	if (sub == NULL)
+		return (0);
+	for (v = 0, i = 0; v < 64; v++) {
+		start[v] = i;
+		i += count[v];
+		count[v] = 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (entries[list[i]].prefix.bitlen <= off + POPTRIE_STRIDE)
+			continue;
+		v = poptrie_chunk (prefix_touchar (&entries[list[i]].prefix), off, pt->addrbytes);
+		sub[start[v] + count[v]++] = list[i];
+	}
+	for (v = 0, k = 0; v < 64 && ok; v++) {
+		if (!(vector & (1ULL << v)))
+			continue;
+		ok = poptrie_build_node (patricia, pt, base1 + k++, sub + start[v], count[v], 
+					 off + POPTRIE_STRIDE, slots[v]);
+	}
+	Delete (sub);
+	return (ok);
+}
+
+static void
+poptrie_free (patricia_poptrie_t *pt)
+{
+	Delete (pt->nodes);
+	Delete (pt->leaves);
+	Delete (pt);
+}
+
+static patricia_poptrie_t *
+poptrie_build (patricia_tree_t *patricia)
+{
+	patricia_poptrie_t *pt;
+	uint32_t *list;
+	size_t n = patricia->block->num_entries, i;
+	int ok;
+
+	pt = calloc (1, sizeof *pt);
+	if (pt == NULL)
+		return (NULL);
+	pt->addrbytes = (patricia->maxbits + 7) / 8;
+#ifdef POPTRIE_HW_POPCNT
+	pt->hwpopcnt = __builtin_cpu_supports ("popcnt");
+#endif
+
+	list = malloc ((n ? n: 1) * sizeof (uint32_t));
+	if (list == NULL) {
+		Delete (pt);
+		return (NULL);
+	}
+	for (i = 0; i < n; i++)
+		list[i] = (uint32_t)i;
+
+	ok = poptrie_grow ((void **)&pt->nodes, &pt->capnodes, 1, sizeof (poptrie_node_t));
+	if (ok) {
+		pt->nnodes = 1;
+		ok = poptrie_build_node (patricia, pt, 0, list, n, 0, 0);
+	}
+	Delete (list);
+	if (!ok) {
+		poptrie_free (pt);
+		return (NULL);
+	}
+	return (pt);
+}
+
+static inline patricia_node_t *
+poptrie_search_generic (patricia_tree_t *patricia, prefix_t *prefix)
+{
+	patricia_poptrie_t *pt = patricia->engine_data;
+	const u_char *addr = prefix_touchar (prefix);
+	const poptrie_node_t *node = pt->nodes;
+	u_int off = 0, v;
+	uint32_t leaf;
+
+	for (;;) {
+		v = poptrie_chunk (addr, off, pt->addrbytes);
+		if (!(node->vector & (1ULL << v)))
+			break;
+		node = &pt->nodes[node->base1 + POPTRIE_RANK (node->vector, v) - 1];
+		off += POPTRIE_STRIDE;
+	}
+	leaf = pt->leaves[node->base0 + POPTRIE_RANK (node->leafvec, v) - 1];
+	return (leaf ? PATRICIA_ENTRY (patricia->block, leaf - 1): NULL);
+}
+
+#ifdef POPTRIE_HW_POPCNT
+__attribute__((target ("popcnt"))) static patricia_node_t *
+poptrie_search_popcnt (patricia_tree_t *patricia, prefix_t *prefix)
+{
+	return (poptrie_search_generic (patricia, prefix));
+}
+#endif
+
+static patricia_node_t *
+poptrie_search (patricia_tree_t *patricia, prefix_t *prefix)
+{
+#ifdef POPTRIE_HW_POPCNT
+	if (((patricia_poptrie_t *)patricia->engine_data)->hwpopcnt)
+		return (poptrie_search_popcnt (patricia, prefix));
+#endif
+	return (poptrie_search_generic (patricia, prefix));
+}
+
+/*
+ * compile a lookup engine for a frozen tree.  returns 1 on success, or
+ * 0 if the engine doesn't apply to this tree or memory ran out (in which
+ * case lookups keep using the trie).
+ */
+/* the engine only changes while engine_data is NULL; see patricia_snapshot */
+#if defined(PATRICIA_ATOMIC) && (defined(__GNUC__) || defined(__clang__))
+#define ENGINE_LOAD(e)		__atomic_load_n (&(e), __ATOMIC_ACQUIRE)
+#define ENGINE_STORE(e, v)	__atomic_store_n (&(e), (v), __ATOMIC_RELEASE)
+#elif defined(PATRICIA_ATOMIC)
+#define ENGINE_LOAD(e)		(*(volatile u_short *)&(e))
+#define ENGINE_STORE(e, v)	(*(volatile u_short *)&(e) = (v))
+#else
+#define ENGINE_LOAD(e)		(e)
+#define ENGINE_STORE(e, v)	((e) = (v))
+#endif
+
+/*
+ * compile engine from the block of patricia without attaching it, so that
+ * a caller can have it ready before changing the tree.  returns NULL for
+ * the trie engine, which searches the block itself, and when out of
+ * memory.
+ */
+void *
+patricia_engine_compile (patricia_tree_t *patricia, int engine)
+{
+	assert (patricia);
+	if (patricia->block == NULL)
+		return (NULL);
+	switch (engine) {
+	case PATRICIA_ENGINE_DIR24:
+		return (dir24_build (patricia));
+	case PATRICIA_ENGINE_POPTRIE:
+		return (poptrie_build (patricia));
+	}
+	return (NULL);
+}
+
+int
+patricia_engine_build (patricia_tree_t *patricia, int engine)
+{
+	void *data;
+
+	assert (patricia);
+	patricia_engine_free (patricia);
+	if (!patricia->frozen)
+		return (engine == PATRICIA_ENGINE_TRIE);
+	ENGINE_STORE (patricia->engine, engine);
+	if (patricia->block == NULL || engine == PATRICIA_ENGINE_TRIE)
+		return (1);
+
+	data = patricia_engine_compile (patricia, engine);
+	if (data == NULL) {
+		ENGINE_STORE (patricia->engine, PATRICIA_ENGINE_TRIE);
+		return (0);
+	}
+	PATRICIA_STORE (patricia->engine_data, data);
+	return (1);
+}
+
+/*
+ * take the compiled engine off the tree, returning it (or NULL) and its
+ * kind in *engine, to be freed with patricia_engine_release once no
+ * search can be using it any more.
+ */
+void *
+patricia_engine_detach (patricia_tree_t *patricia, int *engine)
+{
+	void *data;
+
+	assert (patricia);
+	data = patricia->engine_data;
+	*engine = patricia->engine;
+	PATRICIA_STORE (patricia->engine_data, NULL);
+	ENGINE_STORE (patricia->engine, PATRICIA_ENGINE_TRIE);
+	return (data);
+}
+
+/*
+ * put back an engine taken off with patricia_engine_detach, on this tree
+ * or another one holding the same block.
+ */
+void
+patricia_engine_attach (patricia_tree_t *patricia, int engine, void *engine_data)
+{
+	assert (patricia);
+	ENGINE_STORE (patricia->engine, engine);
+	PATRICIA_STORE (patricia->engine_data, engine_data);
+}
+
+void
+patricia_engine_release (int engine, void *engine_data)
+{
+	if (engine_data == NULL)
+		return;
+	switch (engine) {
+	case PATRICIA_ENGINE_DIR24: {
+		patricia_dir24_t *dir = engine_data;
+		Delete (dir->tbl8);
+		Delete (dir->tbl24);
+		Delete (dir);
+		break;
+	}
+	case PATRICIA_ENGINE_POPTRIE:
+		poptrie_free (engine_data);
+		break;
+	}
+}
+
+void
+patricia_engine_free (patricia_tree_t *patricia)
+{
+	int engine;
+	void *data;
+
+	assert (patricia);
+	data = patricia_engine_detach (patricia, &engine);
+	patricia_engine_release (engine, data);
+}
+
+#ifdef PATRICIA_ATOMIC
+/*
+ * searches running alongside a writer use a copy of the tree's head (or
+ * block) and engine that belong together.  the engine is detached before
+ * the nodes move (freezing and thawing) and set again only afterwards,
+ * and the caller doesn't free a detached engine while searches may be
+ * using it, so finding the same engine_data again means nothing changed
+ * between.
+ */
+static patricia_tree_t *
+patricia_snapshot (patricia_tree_t *patricia, patricia_tree_t *snap)
+{
+	void *data;
+
+	do {
+		data = PATRICIA_LOAD (patricia->engine_data);
+		snap->engine = ENGINE_LOAD (patricia->engine);
+		PATRICIA_ROOT (patricia, snap->head, snap->block);
+	} while (data != NULL && PATRICIA_LOAD (patricia->engine_data) != data);
+	snap->engine_data = data;
+	snap->maxbits = patricia->maxbits;
+	snap->num_active_node = 0;	/* searches use neither of these */
+	snap->frozen = 0;
+	return (snap);
+}
+#define PATRICIA_SNAPSHOT(patricia) \
+	patricia_tree_t snapshot; \
+	patricia = patricia_snapshot (patricia, &snapshot)
+#else
+#define PATRICIA_SNAPSHOT(patricia)
+#endif
+
+/* full-length (prefix->bitlen >= maxbits) lookup through the engine */
+static patricia_node_t *
+patricia_engine_search (patricia_tree_t *patricia, prefix_t *prefix)
+{
+	switch (patricia->engine) {
+	case PATRICIA_ENGINE_DIR24:
+		return (dir24_search (patricia, prefix));
+	case PATRICIA_ENGINE_POPTRIE:
+		return (poptrie_search (patricia, prefix));
+	}
+	return (NULL);
+}
+
+/* } */
+
+
 patricia_node_t *
 patricia_search_exact (patricia_tree_t *patricia, prefix_t *prefix)
 {
@@ -429,7 +1221,10 @@ patricia_search_exact (patricia_tree_t *patricia, prefix_t *prefix)
 	assert (patricia);
 	assert (prefix);
 	assert (prefix->bitlen <= patricia->maxbits);
+	PATRICIA_SNAPSHOT (patricia);
 
+	if (patricia->block)
+		return (frozen_search_exact (patricia->block, prefix));
 	if (patricia->head == NULL)
 	return (NULL);
 
@@ -448,7 +1243,7 @@ patricia_search_exact (patricia_tree_t *patricia, prefix_t *prefix)
 				fprintf (stderr, "patricia_search_exact: take right at %d\n", 
 			 node->bit);
 #endif /* PATRICIA_DEBUG */
-		node = node->r;
+		node = PATRICIA_LOAD (node->r);
 	}
 	else {
 #ifdef PATRICIA_DEBUG
@@ -459,7 +1254,7 @@ patricia_search_exact (patricia_tree_t *patricia, prefix_t *prefix)
 				fprintf (stderr, "patricia_search_exact: take left at %d\n", 
 			 node->bit);
 #endif /* PATRICIA_DEBUG */
-		node = node->l;
+		node = PATRICIA_LOAD (node->l);
 	}
 
 	if (node == NULL)
@@ -473,7 +1268,7 @@ patricia_search_exact (patricia_tree_t *patricia, prefix_t *prefix)
 	else
 		fprintf (stderr, "patricia_search_exact: stop at %d\n", node->bit);
 #endif /* PATRICIA_DEBUG */
-	if (node->bit > bitlen || node->data == NULL)
+	if (node->bit > bitlen || PATRICIA_LOAD (node->data) == NULL)
 		return (NULL);
 	assert (node->bit == bitlen);
 	assert (node->bit == node->prefix.bitlen);
@@ -502,7 +1297,14 @@ patricia_search_best2 (patricia_tree_t *patricia, prefix_t *prefix, int inclusiv
 	assert (patricia);
 	assert (prefix);
 	assert (prefix->bitlen <= patricia->maxbits);
+	PATRICIA_SNAPSHOT (patricia);
 
+	if (patricia->block) {
+		/* a compiled engine can answer full-length address lookups */
+		if (patricia->engine_data && inclusive && prefix->bitlen >= patricia->maxbits)
+			return (patricia_engine_search (patricia, prefix));
+		return (frozen_search_best (patricia->block, prefix, inclusive));
+	}
 	if (patricia->head == NULL)
 	return (NULL);
 
@@ -512,7 +1314,7 @@ patricia_search_best2 (patricia_tree_t *patricia, prefix_t *prefix, int inclusiv
 
 	while (node->bit < bitlen) {
 
-		if (node->data) {
+		if (PATRICIA_LOAD (node->data)) {
 #ifdef PATRICIA_DEBUG
 			fprintf (stderr, "patricia_search_best: push %s/%d\n", 
 				 prefix_toa (&node->prefix), node->prefix.bitlen);
@@ -529,7 +1331,7 @@ patricia_search_best2 (patricia_tree_t *patricia, prefix_t *prefix, int inclusiv
 				fprintf (stderr, "patricia_search_best: take right at %d\n", 
 					 node->bit);
 #endif /* PATRICIA_DEBUG */
-			node = node->r;
+			node = PATRICIA_LOAD (node->r);
 		}
 		else {
 #ifdef PATRICIA_DEBUG
@@ -540,14 +1342,14 @@ patricia_search_best2 (patricia_tree_t *patricia, prefix_t *prefix, int inclusiv
 				fprintf (stderr, "patricia_search_best: take left at %d\n", 
 					 node->bit);
 #endif /* PATRICIA_DEBUG */
-			node = node->l;
+			node = PATRICIA_LOAD (node->l);
 		}
 
 		if (node == NULL)
 			break;
 	}
 
-	if (inclusive && node && node->data && node->bit <= bitlen)
+	if (inclusive && node && PATRICIA_LOAD (node->data) && node->bit <= bitlen)
 		stack[cnt++] = node;
 
 #ifdef PATRICIA_DEBUG
@@ -583,21 +1385,319 @@ patricia_search_best2 (patricia_tree_t *patricia, prefix_t *prefix, int inclusiv
 }
 
 
+/*
+ * collect every node with data whose prefix covers prefix (including an
+ * exact match if inclusive) into out, which has room for maxbits + 1
+ * nodes, least specific first.  returns the number of nodes.
+ */
+int
+patricia_search_all (patricia_tree_t *patricia, prefix_t *prefix, int inclusive,
+		     patricia_node_t **out)
+{
+	patricia_node_t *node;
+	u_char *addr;
+	u_int bitlen;
+	int cnt = 0, i, n;
+
+	assert (patricia);
+	assert (prefix);
+	assert (out);
+	assert (prefix->bitlen <= patricia->maxbits);
+	PATRICIA_SNAPSHOT (patricia);
+
+	if (patricia->block) {
+		uint32_t stack[PATRICIA_MAXBITS + 1];
+
+		n = frozen_search_path (patricia->block, prefix, inclusive, stack);
+		for (i = 0; i < n; i++)
+			out[cnt++] = PATRICIA_ENTRY (patricia->block, stack[i]);
+	}
+	node = patricia->head;
+	addr = prefix_touchar (prefix);
+	bitlen = prefix->bitlen;
+
+	while (node && node->bit < bitlen) {
+		if (PATRICIA_LOAD (node->data))
+			out[cnt++] = node;
+		if (BIT_TEST (addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+			node = PATRICIA_LOAD (node->r);
+		else
+			node = PATRICIA_LOAD (node->l);
+	}
+	if (inclusive && node && PATRICIA_LOAD (node->data) && node->bit <= bitlen)
+		out[cnt++] = node;
+
+	/* the walk skips bits, so keep only the real matches */
+	for (i = n = 0; i < cnt; i++) {
+		if (comp_with_mask (prefix_tochar (&out[i]->prefix), 
+				prefix_tochar (prefix), out[i]->prefix.bitlen))
+			out[n++] = out[i];
+	}
+	return (n);
+}
+
+
 patricia_node_t *
 patricia_search_best (patricia_tree_t *patricia, prefix_t *prefix)
 {
 	return (patricia_search_best2 (patricia, prefix, 1));
 }
 
+#if defined(__GNUC__) || defined(__clang__)
+#define PATRICIA_PREFETCH(p) __builtin_prefetch (p)
+#else
+#define PATRICIA_PREFETCH(p)
+#endif
+
+/* the interleaved walk of patricia_search_best_many over the hot nodes
+ * of a frozen block; lanes hold node and entry indexes + 1.  the keys
+ * under an entry all start with its prefix, so once one fails to match
+ * so do the ones below it: each entry on the path is prefetched when the
+ * walk reaches it, and only checked at the next entry or the end. */
+static void
+frozen_search_best_many (const patricia_frozen_t *block, prefix_t *prefixes, 
+			 size_t n, patricia_node_t **out, int width)
+{
+	struct {
+		size_t i;
+		uint32_t node;	/* 0 for an idle lane */
+		uint32_t best;
+		uint32_t pending;	/* the last entry on the path, unchecked */
+	} lane[PATRICIA_MAX_INTERLEAVE];
+	const patricia_hot_t *hot = block->nodes, *node;
+	patricia_entry_t *entry;
+	prefix_t *prefix;
+	size_t next = 0;
+	uint32_t step;
+	int k, active = 0;
+
+	for (k = 0; k < width; k++) {
+		lane[k].node = 0;
+		if (next < n) {
+			lane[k].i = next++;
+			lane[k].node = 1;
+			lane[k].best = lane[k].pending = 0;
+			active++;
+		}
+	}
+
+	while (active > 0) {
+		for (k = 0; k < width; k++) {
+			if (lane[k].node == 0)
+				continue;
+			node = &hot[lane[k].node - 1];
+			prefix = &prefixes[lane[k].i];
+			step = 0;
+
+			if (node->entry && node->bit <= prefix->bitlen) {
+				if (lane[k].pending) {
+					entry = &block->entries[lane[k].pending - 1];
+					if (comp_with_mask (prefix_tochar (&entry->prefix), 
+							    prefix_tochar (prefix), entry->prefix.bitlen))
+						lane[k].best = lane[k].pending;
+					else
+						node = NULL;
+				}
+				lane[k].pending = node ? node->entry: 0;
+				if (node)
+					PATRICIA_PREFETCH (&block->entries[node->entry - 1]);
+			}
+			if (node && node->bit < prefix->bitlen) {
+				if (BIT_TEST (prefix_touchar (prefix)[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+					step = node->r;
+				else
+					step = node->l;
+			}
+			if (step) {
+				PATRICIA_PREFETCH (&hot[step - 1]);
+				lane[k].node = step;
+				continue;
+			}
+
+			/* this lookup is done; start the next one in its lane */
+			if (lane[k].pending) {
+				entry = &block->entries[lane[k].pending - 1];
+				if (comp_with_mask (prefix_tochar (&entry->prefix), 
+						    prefix_tochar (prefix), entry->prefix.bitlen))
+					lane[k].best = lane[k].pending;
+			}
+			out[lane[k].i] = lane[k].best ? PATRICIA_ENTRY (block, lane[k].best - 1): NULL;
+			if (next < n) {
+				lane[k].i = next++;
+				lane[k].node = 1;
+				lane[k].best = lane[k].pending = 0;
+			}
+			else {
+				lane[k].node = 0;
+				active--;
+			}
+		}
+	}
+}
+
+/*
+ * patricia_search_best for n prefixes, with up to width of the lookups
+ * in flight at once.  each lookup takes one step down the tree per round
+ * and prefetches its next node, so the cache misses of independent
+ * lookups overlap instead of being paid one after another.  a data node
+ * that doesn't match ends a lookup early, since everything below it
+ * shares the same leading bits.
+ */
+void
+patricia_search_best_many (patricia_tree_t *patricia, prefix_t *prefixes, 
+			   size_t n, patricia_node_t **out, int width)
+{
+	struct {
+		size_t i;
+		patricia_node_t *node;	/* NULL for an idle lane */
+		patricia_node_t *best;
+	} lane[PATRICIA_MAX_INTERLEAVE];
+	patricia_node_t *node;
+	prefix_t *prefix;
+	size_t next = 0, i;
+	int k, active = 0;
+
+	assert (patricia);
+	PATRICIA_SNAPSHOT (patricia);
+	if (width > PATRICIA_MAX_INTERLEAVE)
+		width = PATRICIA_MAX_INTERLEAVE;
+
+	if (patricia->engine == PATRICIA_ENGINE_DIR24 && patricia->engine_data && 
+	    patricia->block != NULL) {
+		dir24_search_many (patricia, prefixes, n, out);
+		return;
+	}
+	/* the other compiled engines are only a few loads per lookup already */
+	if (width <= 1 || (patricia->head == NULL && patricia->block == NULL) || 
+	    patricia->engine_data) {
+		for (i = 0; i < n; i++)
+			out[i] = patricia_search_best (patricia, &prefixes[i]);
+		return;
+	}
+	if (patricia->block) {
+		frozen_search_best_many (patricia->block, prefixes, n, out, width);
+		return;
+	}
+
+	for (k = 0; k < width; k++) {
+		lane[k].node = NULL;
+		if (next < n) {
+			lane[k].i = next++;
+			lane[k].node = patricia->head;
+			lane[k].best = NULL;
+			active++;
+		}
+	}
+
+	while (active > 0) {
+		for (k = 0; k < width; k++) {
+			node = lane[k].node;
+			if (node == NULL)
+				continue;
+			prefix = &prefixes[lane[k].i];
+
+			if (node->bit < prefix->bitlen) {
+				void *data = PATRICIA_LOAD (node->data);
+				if (data && !comp_with_mask (prefix_tochar (&node->prefix), 
+							     prefix_tochar (prefix), node->prefix.bitlen)) {
+					node = NULL;
+				}
+				else {
+					if (data)
+						lane[k].best = node;
+					if (BIT_TEST (prefix_touchar (prefix)[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+						node = PATRICIA_LOAD (node->r);
+					else
+						node = PATRICIA_LOAD (node->l);
+				}
+				if (node) {
+					PATRICIA_PREFETCH (node);
+					PATRICIA_PREFETCH (&node->data);
+					lane[k].node = node;
+					continue;
+				}
+			}
+			else if (PATRICIA_LOAD (node->data) && node->bit == prefix->bitlen && 
+				 comp_with_mask (prefix_tochar (&node->prefix), 
+						 prefix_tochar (prefix), node->prefix.bitlen)) {
+				lane[k].best = node;
+			}
+
+			/* this lookup is done; start the next one in its lane */
+			out[lane[k].i] = lane[k].best;
+			if (next < n) {
+				lane[k].i = next++;
+				lane[k].node = patricia->head;
+				lane[k].best = NULL;
+			}
+			else {
+				lane[k].node = NULL;
+				active--;
+			}
+		}
+	}
+}
+
 
+/*
+ * snapshots share the nodes of the tree they were taken from.  a node
+ * whose version is below shared_version may be seen by a snapshot, so it
+ * must not change (bar its parent pointer, which snapshots don't follow);
+ * patricia_unshare replaces it, and every such node above it, by a copy
+ * stamped with the current version (path copying).  unshare_fn is told
+ * about each node replaced, whose data the copy now shares (user1 is left
+ * to the node replaced).
+ * returns the node to change in place of node, or NULL if out of memory.
+ */
+patricia_node_t *
+patricia_unshare (patricia_tree_t *patricia, patricia_node_t *node)
+{
+	patricia_node_t *path[PATRICIA_MAXBITS+1];
+	patricia_node_t *copy = node, *parent;
+	int n = 0;
+
+	while (node && node->version < patricia->shared_version) {
+		path[n++] = node;
+		node = node->parent;
+	}
+	/* from the top down, so that each copy is linked to one of our own */
+	while (n > 0) {
+		node = path[--n];
+		copy = malloc (sizeof *copy);
+		if (copy == NULL)
+			return (NULL);
+		*copy = *node;
+		copy->version = patricia->version;
+		copy->user1 = NULL;
+		if (copy->l)
+			PATRICIA_STORE (copy->l->parent, copy);
+		if (copy->r)
+			PATRICIA_STORE (copy->r->parent, copy);
+		parent = node->parent;
+		if (parent == NULL) {
+			assert (patricia->head == node);
+			PATRICIA_STORE (patricia->head, copy);
+		}
+		else if (parent->r == node) {
+			PATRICIA_STORE (parent->r, copy);
+		}
+		else {
+			PATRICIA_STORE (parent->l, copy);
+		}
+		if (patricia->unshare_fn)
+			patricia->unshare_fn (patricia->unshare_arg, node, copy);
+	}
+	return (copy);
+}
+
+
+/* the node returned may be changed by the caller */
 patricia_node_t *
 patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 {
 	patricia_node_t *node, *new_node, *parent, *glue;
 	u_char *addr, *test_addr;
 	u_int bitlen, check_bit, differ_bit;
-        u_int i;
-	int j, r;
 
 	assert (patricia);
 	assert (prefix);
@@ -606,11 +1706,12 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	if (patricia->head == NULL) {
 		node = calloc(1, sizeof *node);
 		node->bit = prefix->bitlen;
+		node->version = patricia->version;
 		node->prefix = *prefix;
 		node->parent = NULL;
 		node->l = node->r = NULL;
 		node->data = NULL;
-		patricia->head = node;
+		PATRICIA_STORE (patricia->head, node);
 #ifdef PATRICIA_DEBUG
 		fprintf (stderr, "patricia_lookup: new_node #0 %s/%d (head)\n", 
 			prefix_toa (prefix), prefix->bitlen);
@@ -663,24 +1764,7 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	test_addr = prefix_touchar (&(node->prefix));
 	/* find the first bit different */
 	check_bit = (node->bit < bitlen)? node->bit: bitlen;
-	differ_bit = 0;
-	for (i = 0; i*8 < check_bit; i++) {
-		if ((r = (addr[i] ^ test_addr[i])) == 0) {
-			differ_bit = (i + 1) * 8;
-			continue;
-		}
-		/* I know the better way, but for now */
-		for (j = 0; j < 8; j++) {
-			if (BIT_TEST (r, (0x80 >> j)))
-				break;
-		}
-		/* must be found */
-		assert (j < 8);
-		differ_bit = i * 8 + j;
-		break;
-	}
-	if (differ_bit > check_bit)
-		differ_bit = check_bit;
+	differ_bit = addr_differ_bit (addr, test_addr, check_bit);
 #ifdef PATRICIA_DEBUG
 	fprintf (stderr, "patricia_lookup: differ_bit %d\n", differ_bit);
 #endif /* PATRICIA_DEBUG */
@@ -699,6 +1783,8 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	}
 
 	if (differ_bit == bitlen && node->bit == bitlen) {
+		if ((node = patricia_unshare (patricia, node)) == NULL)
+			return (NULL);
 		if (node->data) {
 #ifdef PATRICIA_DEBUG 
 			fprintf (stderr, "patricia_lookup: found %s/%d\n", 
@@ -715,8 +1801,18 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 		return (node);
 	}
 
+	/* the node whose child changes has to be our own */
+	if (node->bit == differ_bit) {
+		if ((node = patricia_unshare (patricia, node)) == NULL)
+			return (NULL);
+	}
+	else if (node->parent && patricia_unshare (patricia, node->parent) == NULL) {
+		return (NULL);
+	}
+
 	new_node = calloc(1, sizeof *new_node);
 	new_node->bit = prefix->bitlen;
+	new_node->version = patricia->version;
 	new_node->prefix = *prefix;
 	new_node->parent = NULL;
 	new_node->l = new_node->r = NULL;
@@ -728,11 +1824,11 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 		if (node->bit < patricia->maxbits &&
 			BIT_TEST (addr[node->bit >> 3], 0x80 >> (node->bit & 0x07))) {
 			assert (node->r == NULL);
-			node->r = new_node;
+			PATRICIA_STORE (node->r, new_node);
 		}
 		else {
 			assert (node->l == NULL);
-			node->l = new_node;
+			PATRICIA_STORE (node->l, new_node);
 		}
 #ifdef PATRICIA_DEBUG
 		fprintf (stderr, "patricia_lookup: new_node #2 %s/%d (child)\n", 
@@ -752,15 +1848,15 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 		new_node->parent = node->parent;
 		if (node->parent == NULL) {
 			assert (patricia->head == node);
-			patricia->head = new_node;
+			PATRICIA_STORE (patricia->head, new_node);
 		}
 		else if (node->parent->r == node) {
-			node->parent->r = new_node;
+			PATRICIA_STORE (node->parent->r, new_node);
 		}
 		else {
-			node->parent->l = new_node;
+			PATRICIA_STORE (node->parent->l, new_node);
 		}
-		node->parent = new_node;
+		PATRICIA_STORE (node->parent, new_node);
 #ifdef PATRICIA_DEBUG
 		fprintf (stderr, "patricia_lookup: new_node #3 %s/%d (parent)\n", 
 			 prefix_toa (prefix), prefix->bitlen);
@@ -769,6 +1865,7 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	else {
 		glue = calloc(1, sizeof *glue);
 		glue->bit = differ_bit;
+		glue->version = patricia->version;
 		memset(&glue->prefix, 0, sizeof(prefix_t));
 		glue->parent = node->parent;
 		glue->data = NULL;
@@ -786,15 +1883,15 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 
 		if (node->parent == NULL) {
 			assert (patricia->head == node);
-			patricia->head = glue;
+			PATRICIA_STORE (patricia->head, glue);
 		}
 		else if (node->parent->r == node) {
-			node->parent->r = glue;
+			PATRICIA_STORE (node->parent->r, glue);
 		}
 		else {
-			node->parent->l = glue;
+			PATRICIA_STORE (node->parent->l, glue);
 		}
-		node->parent = glue;
+		PATRICIA_STORE (node->parent, glue);
 #ifdef PATRICIA_DEBUG
 		fprintf (stderr, "patricia_lookup: new_node #4 %s/%d (glue+node)\n", 
 			 prefix_toa (prefix), prefix->bitlen);
@@ -806,11 +1903,31 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 
 void
 patricia_remove (patricia_tree_t *patricia, patricia_node_t *node)
+{
+	patricia_node_t *removed[2];
+	int i, n;
+
+	n = patricia_unlink (patricia, node, removed);
+	for (i = 0; i < n; i++)
+		Delete (removed[i]);
+}
+
+
+/*
+ * patricia_remove without freeing anything: the nodes taken out of the
+ * tree (none, node itself, or node and its glue parent) are stored in
+ * removed, and their number returned.  the caller frees them, which
+ * lets it wait until no search can still be visiting them.
+ */
+int
+patricia_unlink (patricia_tree_t *patricia, patricia_node_t *node, 
+		 patricia_node_t **removed)
 {
 	patricia_node_t *parent, *child;
 
 	assert (patricia);
 	assert (node);
+	assert (removed);
 
 	if (node->r && node->l) {
 #ifdef PATRICIA_DEBUG
@@ -819,8 +1936,8 @@ patricia_remove (patricia_tree_t *patricia, patricia_node_t *node)
 #endif /* PATRICIA_DEBUG */
 	
 		/* Also I needed to clear data pointer -- masaki */
-		node->data = NULL;
-		return;
+		PATRICIA_STORE (node->data, NULL);
+		return (0);
 	}
 
 	if (node->r == NULL && node->l == NULL) {
@@ -829,45 +1946,45 @@ patricia_remove (patricia_tree_t *patricia, patricia_node_t *node)
 			 prefix_toa (&node->prefix), node->prefix.bitlen);
 #endif /* PATRICIA_DEBUG */
 		parent = node->parent;
-		Delete (node);
+		removed[0] = node;
 		patricia->num_active_node--;
 
 		if (parent == NULL) {
 			assert (patricia->head == node);
-			patricia->head = NULL;
-			return;
+			PATRICIA_STORE (patricia->head, NULL);
+			return (1);
 		}
 
 		if (parent->r == node) {
-			parent->r = NULL;
+			PATRICIA_STORE (parent->r, NULL);
 			child = parent->l;
 		}
 		else {
 			assert (parent->l == node);
-			parent->l = NULL;
+			PATRICIA_STORE (parent->l, NULL);
 			child = parent->r;
 		}
 
 		if (parent->data)
-			return;
+			return (1);
 
 		/* we need to remove parent too */
 
 		if (parent->parent == NULL) {
 			assert (patricia->head == parent);
-			patricia->head = child;
+			PATRICIA_STORE (patricia->head, child);
 		}
 		else if (parent->parent->r == parent) {
-			parent->parent->r = child;
+			PATRICIA_STORE (parent->parent->r, child);
 		}
 		else {
 			assert (parent->parent->l == parent);
-			parent->parent->l = child;
+			PATRICIA_STORE (parent->parent->l, child);
 		}
-		child->parent = parent->parent;
-		Delete (parent);
+		PATRICIA_STORE (child->parent, parent->parent);
+		removed[1] = parent;
 		patricia->num_active_node--;
-		return;
+		return (2);
 	}
 
 #ifdef PATRICIA_DEBUG
@@ -882,22 +1999,23 @@ patricia_remove (patricia_tree_t *patricia, patricia_node_t *node)
 		child = node->l;
 	}
 	parent = node->parent;
-	child->parent = parent;
+	PATRICIA_STORE (child->parent, parent);
 
-	Delete (node);
+	removed[0] = node;
 	patricia->num_active_node--;
 
 	if (parent == NULL) {
 		assert (patricia->head == node);
-		patricia->head = child;
-		return;
+		PATRICIA_STORE (patricia->head, child);
+		return (1);
 	}
 
 	if (parent->r == node) {
-		parent->r = child;
+		PATRICIA_STORE (parent->r, child);
 	}
 	else {
 		assert (parent->l == node);
-		parent->l = child;
+		PATRICIA_STORE (parent->l, child);
 	}
+	return (1);
 }
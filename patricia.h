@@ -71,6 +71,7 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdint.h>
 
 
 #define HAVE_IPV6 1 // JS: force use of ip6
@@ -125,13 +126,41 @@ typedef struct _prefix_t {
 typedef void (*void_fn1_t)(void *);
 typedef void (*void_fn2_t)(struct _prefix_t *, void *);
 
+/*
+ * with PATRICIA_ATOMIC (defined for free-threaded Python builds),
+ * searches may run in other threads while the tree is changed.  writers
+ * still have to be serialized by the caller.  pointers that a search
+ * follows (head, children, parents, data and engine_data) are published
+ * with PATRICIA_STORE once what they point to is complete, and read with
+ * PATRICIA_LOAD.  memory that searches may still be using, such as
+ * removed nodes, has to be freed only once they have finished.
+ */
+#if defined(PATRICIA_ATOMIC) && (defined(__GNUC__) || defined(__clang__))
+#define PATRICIA_LOAD(p)	__atomic_load_n (&(p), __ATOMIC_ACQUIRE)
+#define PATRICIA_STORE(p, v)	__atomic_store_n (&(p), (v), __ATOMIC_RELEASE)
+#elif defined(PATRICIA_ATOMIC) && defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+/* volatile accesses are acquire and release on x86 (/volatile:ms) */
+#define PATRICIA_LOAD(p)	(*(void * volatile *)&(p))
+#define PATRICIA_STORE(p, v)	(*(void * volatile *)&(p) = (v))
+#elif defined(PATRICIA_ATOMIC) && defined(_MSC_VER)
+#define PATRICIA_LOAD(p)	InterlockedCompareExchangePointer ((void * volatile *)&(p), NULL, NULL)
+#define PATRICIA_STORE(p, v)	InterlockedExchangePointer ((void * volatile *)&(p), (v))
+#else
+#define PATRICIA_LOAD(p)	(p)
+#define PATRICIA_STORE(p, v)	((p) = (v))
+#endif
+
+/* prefix, data and user1 come first so that a frozen tree's entries
+ * (patricia_entry_t) can be handed out as nodes; see patricia_frozen_t */
 typedef struct _patricia_node_t {
-   u_int bit;
    prefix_t prefix;
-   struct _patricia_node_t *l, *r;
-   struct _patricia_node_t *parent;
    void *data;
    void	*user1;
+   u_short bit;
+   u_short version;	/* tree version it was made in, see patricia_unshare */
+   u_int index;		/* position in walk order (fits in padding) */
+   struct _patricia_node_t *l, *r;
+   struct _patricia_node_t *parent;
 } patricia_node_t;
 
 typedef struct _patricia_tree_t {
@@ -139,19 +168,130 @@ typedef struct _patricia_tree_t {
    u_int		maxbits;
    int num_active_node;
    u_short frozen;
+   u_short engine;	/* PATRICIA_ENGINE_* used for lookups when frozen */
+   u_short version;	/* stamped on nodes made from now on */
+   u_short shared_version;	/* nodes stamped below this are shared */
+   void *engine_data;	/* compiled lookup structure for engine, if built */
+   /* told about each shared node patricia_unshare replaces by a copy */
+   void (*unshare_fn) (void *arg, struct _patricia_node_t *node, 
+		       struct _patricia_node_t *copy);
+   void *unshare_arg;
+   struct _patricia_frozen_t *block;	/* the nodes when frozen (head is NULL) */
 } patricia_tree_t;
 
+/* most lookups patricia_search_best_many keeps in flight at once */
+#define PATRICIA_MAX_INTERLEAVE 32
+#define PATRICIA_DEFAULT_INTERLEAVE 16
+
+/* vector kernels for batch lookups, chosen by patricia_simd_init() */
+#define PATRICIA_SIMD_SCALAR	0
+#define PATRICIA_SIMD_AVX2	1
+#define PATRICIA_SIMD_AVX512	2
+
+/* alternative lookup engines for frozen trees; these are compiled
+ * from the frozen block and refer to its entries by index, so they are
+ * only valid while frozen. */
+#define PATRICIA_ENGINE_TRIE	0	/* the hot nodes of the block */
+#define PATRICIA_ENGINE_DIR24	1	/* DIR-24-8 table, maxbits == 32 only */
+#define PATRICIA_ENGINE_POPTRIE	2	/* poptrie multibit trie, any maxbits */
+
+/*
+ * a frozen tree is a single block of nodes: hot nodes, holding only what
+ * a search reads on the way down so that several share a cache line, and
+ * one entry for each prefix, in walk (keys) order.  glue nodes have no
+ * entry.  children and entries are index + 1 into nodes and entries, or
+ * 0; nodes[0] is the root, and parents come before their children.
+ * searches return an entry as a patricia_node_t, of which only prefix,
+ * data and user1 may be used.
+ */
+typedef struct _patricia_hot_t {
+   uint16_t bit;
+   uint16_t spare;
+   uint32_t l, r;
+   uint32_t entry;
+} patricia_hot_t;
+
+typedef struct _patricia_entry_t {
+   prefix_t prefix;
+   void *data;
+   void *user1;
+} patricia_entry_t;
+
+typedef struct _patricia_frozen_t {
+   patricia_hot_t *nodes;
+   patricia_entry_t *entries;
+   u_int num_nodes;
+   u_int num_entries;
+   u_short version;	/* see patricia_node_t */
+} patricia_frozen_t;
+
+#define PATRICIA_ENTRY_NODE(entry)	((patricia_node_t *)(entry))
+#define PATRICIA_ENTRY(block, i)	PATRICIA_ENTRY_NODE (&(block)->entries[i])
+#define PATRICIA_ENTRY_INDEX(block, node) \
+	((u_int)((patricia_entry_t *)(node) - (block)->entries))
+
+/* DIR-24-8: each entry is 0 (no match), the index + 1 of the matching
+ * entry, or DIR24_CHUNK | n to continue in the n'th 256-entry chunk */
+#define DIR24_CHUNK 0x80000000U
+
+typedef struct _patricia_dir24_t {
+   uint32_t *tbl24;	/* 2^24 entries indexed by the first 24 address bits */
+   uint32_t *tbl8;	/* 256-entry chunks for prefixes longer than /24 */
+   u_int ntbl8;
+   u_int captbl8;
+} patricia_dir24_t;
+
+/* poptrie: each internal node covers POPTRIE_STRIDE address bits.  bit v
+ * of vector is set if slot v continues in a child node, and the children
+ * are stored contiguously from base1, so the child for slot v is found by
+ * counting the set bits of vector up to v.  the remaining slots map to
+ * runs of leaves (entry index + 1, or 0 for no match) from base0; bit v of
+ * leafvec is set where a new run starts. */
+#define POPTRIE_STRIDE 6
+
+typedef struct _poptrie_node_t {
+   uint64_t vector;
+   uint64_t leafvec;
+   uint32_t base0;	/* first leaf */
+   uint32_t base1;	/* first child node */
+} poptrie_node_t;
+
+typedef struct _patricia_poptrie_t {
+   poptrie_node_t *nodes;	/* nodes[0] is the root */
+   uint32_t *leaves;
+   u_int nnodes, capnodes;
+   u_int nleaves, capleaves;
+   u_int addrbytes;
+   int hwpopcnt;	/* search with the POPCNT instruction */
+} patricia_poptrie_t;
+
 
 patricia_node_t *patricia_search_exact (patricia_tree_t *patricia, prefix_t *prefix);
 patricia_node_t *patricia_search_best (patricia_tree_t *patricia, prefix_t *prefix);
 patricia_node_t * patricia_search_best2 (patricia_tree_t *patricia, prefix_t *prefix, 
 				   int inclusive);
+void patricia_search_best_many (patricia_tree_t *patricia, prefix_t *prefixes, 
+				size_t n, patricia_node_t **out, int width);
+int patricia_search_all (patricia_tree_t *patricia, prefix_t *prefix, int inclusive,
+			 patricia_node_t **out);
 patricia_node_t *patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix);
+patricia_node_t *patricia_unshare (patricia_tree_t *patricia, patricia_node_t *node);
 void patricia_remove (patricia_tree_t *patricia, patricia_node_t *node);
+int patricia_unlink (patricia_tree_t *patricia, patricia_node_t *node, 
+		     patricia_node_t **removed);
 patricia_tree_t *New_Patricia (int maxbits);
 void Clear_Patricia (patricia_tree_t *patricia, void_fn1_t func);
 void Destroy_Patricia (patricia_tree_t *patricia, void_fn1_t func);
 void patricia_process (patricia_tree_t *patricia, void_fn2_t func);
+patricia_frozen_t *patricia_frozen_new (u_int num_nodes, u_int num_entries);
+void *patricia_engine_compile (patricia_tree_t *patricia, int engine);
+int patricia_engine_build (patricia_tree_t *patricia, int engine);
+void patricia_engine_free (patricia_tree_t *patricia);
+void *patricia_engine_detach (patricia_tree_t *patricia, int *engine);
+void patricia_engine_attach (patricia_tree_t *patricia, int engine, void *engine_data);
+void patricia_engine_release (int engine, void *engine_data);
+int patricia_simd_init (int maxlevel);
+u_int patricia_differ_bit (const u_char *a, const u_char *b, u_int limit);
 
 int New_Prefix(int, void *, int, prefix_t*);
 
@@ -173,15 +313,15 @@ prefix_toa2x(prefix_t *prefix, char *buff, int with_len);
     do { \
         patricia_node_t *Xstack[PATRICIA_MAXBITS+1]; \
         patricia_node_t **Xsp = Xstack; \
-        patricia_node_t *Xrn = (Xhead); \
+        patricia_node_t *Xrn = PATRICIA_LOAD (Xhead); \
         while ((Xnode = Xrn)) { \
-            if (Xnode->data)
+            if (PATRICIA_LOAD (Xnode->data))
 
 #define PATRICIA_WALK_ALL(Xhead, Xnode) \
 do { \
         patricia_node_t *Xstack[PATRICIA_MAXBITS+1]; \
         patricia_node_t **Xsp = Xstack; \
-        patricia_node_t *Xrn = (Xhead); \
+        patricia_node_t *Xrn = PATRICIA_LOAD (Xhead); \
         while ((Xnode = Xrn)) { \
 	    if (1)
 
@@ -194,13 +334,15 @@ do { \
 	    continue; }
 
 #define PATRICIA_WALK_END \
-            if (Xrn->l) { \
-                if (Xrn->r) { \
-                    *Xsp++ = Xrn->r; \
+            patricia_node_t *Xl = PATRICIA_LOAD (Xrn->l); \
+            patricia_node_t *Xr = PATRICIA_LOAD (Xrn->r); \
+            if (Xl) { \
+                if (Xr) { \
+                    *Xsp++ = Xr; \
                 } \
-                Xrn = Xrn->l; \
-            } else if (Xrn->r) { \
-                Xrn = Xrn->r; \
+                Xrn = Xl; \
+            } else if (Xr) { \
+                Xrn = Xr; \
             } else if (Xsp != Xstack) { \
                 Xrn = *(--Xsp); \
             } else { \
@@ -209,4 +351,40 @@ do { \
         } \
     } while (0)
 
+/*
+ * the head or, for a frozen tree, the block.  freezing publishes the
+ * block before clearing head, and thawing head before clearing block, so
+ * a search that finds neither reads head again to be sure the tree is
+ * empty.
+ */
+#define PATRICIA_ROOT(Xtree, Xhead, Xblock) \
+    do { \
+        (Xhead) = PATRICIA_LOAD ((Xtree)->head); \
+        (Xblock) = (Xhead) ? NULL: PATRICIA_LOAD ((Xtree)->block); \
+        if ((Xhead) == NULL && (Xblock) == NULL) \
+            (Xhead) = PATRICIA_LOAD ((Xtree)->head); \
+    } while (0)
+
+/* PATRICIA_WALK over a tree, frozen or not: the entries of a frozen
+ * tree come in the same order as its nodes holding data */
+#define PATRICIA_WALK_TREE(Xtree, Xnode) \
+    do { \
+        patricia_node_t *Xstack[PATRICIA_MAXBITS+1]; \
+        patricia_node_t **Xsp = Xstack; \
+        patricia_node_t *Xrn; \
+        patricia_frozen_t *Xblock; \
+        u_int Xi = 0; \
+        PATRICIA_ROOT (Xtree, Xrn, Xblock); \
+        if (Xblock && Xblock->num_entries) \
+            Xrn = PATRICIA_ENTRY (Xblock, 0); \
+        while ((Xnode = Xrn)) { \
+            if (PATRICIA_LOAD (Xnode->data))
+
+#define PATRICIA_WALK_TREE_END \
+            if (Xblock) { \
+                Xrn = ++Xi < Xblock->num_entries ? PATRICIA_ENTRY (Xblock, Xi): NULL; \
+                continue; \
+            } \
+            PATRICIA_WALK_END
+
 #endif /* _PATRICIA_H */
@@ -18,6 +18,18 @@
 
 #include <Python.h>
 #include "patricia.h"
+#include <stddef.h>
+// setup.py defines PYTRICIA_HAVE_ZLIB when zlib is found; load_pfx2as()
+// then decompresses in C rather than through Python's gzip module
+#ifdef PYTRICIA_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// free-threaded builds need the tree's atomic pointer accesses, in both
+// source files; setup.py defines PATRICIA_ATOMIC for them
+#if defined(Py_GIL_DISABLED) && !defined(PATRICIA_ATOMIC)
+#error "free-threaded builds need PATRICIA_ATOMIC defined"
+#endif
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <winsock2.h>
@@ -27,13 +39,98 @@
 #include <arpa/inet.h>
 #endif
 
+#if defined(_WIN32) || defined(_WIN64)
+#include <process.h>
+typedef HANDLE pytricia_thread_t;
+#else
+#include <pthread.h>
+#include <time.h>
+typedef pthread_t pytricia_thread_t;
+#endif
+
 typedef struct {
     PyObject_HEAD
     patricia_tree_t *m_tree;
     int m_family;
     u_short m_raw_output;
+    unsigned long m_generation;       // bumped on every modification
+    unsigned long m_index_generation; // generation at which node indexes were assigned
+    long m_readers;                   // lookups in progress without the GIL
+    long m_iterators;                 // iterators not yet exhausted, see swap_contents
+    struct key_cache_entry *m_key_cache; // parsed keys, see enable_key_cache()
+    Py_ssize_t m_key_cache_size;      // a power of two, or 0 when disabled
+    unsigned long long m_key_cache_hits;
+    unsigned long long m_key_cache_misses;
+    struct result_cache_entry *m_result_cache; // see enable_result_cache()
+    Py_ssize_t m_result_cache_size;   // a power of two, or 0 when disabled
+    unsigned long long m_result_cache_hits;
+    unsigned long long m_result_cache_misses;
+    int m_node_keys;                  // keep key objects on nodes, see enable_node_keys()
+    struct pytricia_ebr *m_ebr;       // deferred frees, with PATRICIA_ATOMIC
+    struct pytricia_shared *m_shared; // nodes shared with snapshots, see snapshot()
+    Py_ssize_t m_pin;                 // a snapshot's entry in m_shared->pins
+    int m_snapshot;                   // PYTRICIA_SNAPSHOT_*, or 0 for a tree
 } PyTricia;
 
+#define PYTRICIA_SNAPSHOT_SHARED 1    // a snapshot reading its tree's nodes
+#define PYTRICIA_SNAPSHOT_OWN 2       // one given its own copy of them
+
+// one slot of the two-way set associative key cache.  string keys are
+// found by hash and value, anything else by identity; the cache holds a
+// reference to each key.
+typedef struct key_cache_entry {
+    PyObject *key;
+    Py_ssize_t hash;
+    prefix_t prefix;
+} key_cache_entry_t;
+
+// one slot of the direct-mapped result cache: the best match for a
+// prefix (NULL for none), valid only while generation is current
+typedef struct result_cache_entry {
+    unsigned long generation;
+    u_short family;             // 0 for an empty slot
+    u_short bitlen;
+    unsigned char addr[16];
+    patricia_node_t *node;
+} result_cache_entry_t;
+
+// methods taking only positional arguments use METH_FASTCALL where it is
+// available (3.7), which passes them as a C array rather than a tuple.
+// elsewhere, PYTRICIA_UNPACK_ARGS gives the tuple's items the same form.
+#if PY_MAJOR_VERSION == 3 && PY_VERSION_HEX >= 0x03070000
+#define PYTRICIA_METH_FASTCALL METH_FASTCALL
+#define PYTRICIA_ARGS PyObject *const *args, Py_ssize_t nargs
+#define PYTRICIA_UNPACK_ARGS
+#else
+#define PYTRICIA_METH_FASTCALL METH_VARARGS
+#define PYTRICIA_ARGS PyObject *argtuple
+#define PYTRICIA_UNPACK_ARGS \
+    PyObject *const *args = &PyTuple_GET_ITEM(argtuple, 0); \
+    Py_ssize_t nargs = PyTuple_GET_SIZE(argtuple);
+#endif
+
+// like PyArg_UnpackTuple, for a method's argument array: check that there
+// are between min and max arguments, and store them through the trailing
+// PyObject ** arguments (borrowed references; the rest are left alone).
+static int
+_pytricia_unpack(const char *name, PyObject *const *args, Py_ssize_t nargs, Py_ssize_t min, Py_ssize_t max, ...) {
+    if (nargs < min || nargs > max) {
+        Py_ssize_t n = nargs < min ? min : max;
+        PyErr_Format(PyExc_TypeError, "%s() takes %s %zd argument%s (%zd given)", name, 
+                     min == max ? "exactly" : (nargs < min ? "at least" : "at most"), 
+                     n, n == 1 ? "" : "s", nargs);
+        return 0;
+    }
+    va_list vargs;
+    va_start(vargs, max);
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        PyObject **p = va_arg(vargs, PyObject **);
+        *p = args[i];
+    }
+    va_end(vargs);
+    return 1;
+}
+
 typedef struct {
     PyObject_HEAD
     patricia_tree_t *m_tree;
@@ -42,942 +139,4987 @@ typedef struct {
     patricia_node_t **m_Xstack;
     patricia_node_t **m_Xsp;
     patricia_node_t *m_Xrn;
+    patricia_frozen_t *m_block;       // a frozen tree's block, walked instead of the nodes
+    u_int m_pos;                      // the next entry (iter_range: the next hot node + 1)
+    u_int m_end;                      // the last entry + 1 (iter_range: depth of m_Xstack)
     PyTricia *m_parent;
+    int m_mode;                       // PYTRICIA_ITER_*: what each step yields
+    patricia_node_t *m_skip;          // a node not to yield (the base of iter_children)
+    int m_range;                      // iter_range: prune subtrees outside the range
+    u_char m_lo[16];                  // first and last address of the range
+    u_char m_hi[16];
+    prefix_t m_after;                 // resume after this prefix, if m_has_after
+    int m_has_after;
+    long *m_reader;                   // see _pytricia_read_begin
+    int m_holding;                    // counted in its parent's m_iterators
 } PyTriciaIter;
 
-#if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 4
-static PyObject *ipaddr_module = NULL;
-static PyObject *ipaddr_base = NULL;
-static PyObject *ipnet_base = NULL;
-static int _ipaddr_isset = 0;
+#define PYTRICIA_ITER_KEYS 0
+#define PYTRICIA_ITER_VALUES 1
+#define PYTRICIA_ITER_ITEMS 2
+
+// anything that changes a tree (or an iterator's position) runs in a
+// critical section on the object.  this only matters without the GIL;
+// elsewhere the GIL already serializes them.
+#if PY_VERSION_HEX >= 0x030D0000
+#define PYTRICIA_BEGIN_LOCKED(op) Py_BEGIN_CRITICAL_SECTION(op)
+#define PYTRICIA_END_LOCKED Py_END_CRITICAL_SECTION()
+#define PYTRICIA_BEGIN_LOCKED2(a, b) Py_BEGIN_CRITICAL_SECTION2(a, b)
+#define PYTRICIA_END_LOCKED2 Py_END_CRITICAL_SECTION2()
+#else
+#define PYTRICIA_BEGIN_LOCKED(op) {
+#define PYTRICIA_END_LOCKED }
+#define PYTRICIA_BEGIN_LOCKED2(a, b) {
+#define PYTRICIA_END_LOCKED2 }
 #endif
 
-#if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 4
-static void _set_ipaddr_refs(void) {
-    ipaddr_module = ipaddr_base = ipnet_base = NULL;
-    if (_ipaddr_isset) {
-        return;
-    }
-    _ipaddr_isset = 1;
-    // 3.4 introduced ipaddress module.  get some static
-    // references to the module and a base class for type
-    // checking arguments to various methods.
-    ipaddr_module = PyImport_ImportModule("ipaddress");
-    if (ipaddr_module != NULL) {
-        ipaddr_base = PyObject_GetAttrString(ipaddr_module, "_BaseAddress");
-        ipnet_base = PyObject_GetAttrString(ipaddr_module, "_BaseNetwork");
-        if (ipaddr_base == NULL && ipnet_base == NULL) {
-            Py_DECREF(ipaddr_module);
-            ipaddr_module = NULL;
+// counters shared between threads
+#if !defined(PATRICIA_ATOMIC)
+#define PYTRICIA_ATOMIC_ADD(v, n) ((v) += (n))
+#define PYTRICIA_ATOMIC_GET(v) (v)
+#define PYTRICIA_ATOMIC_SET(v, n) ((v) = (n))
+#define PYTRICIA_ATOMIC_FENCE() ((void)0)
+#elif defined(__GNUC__) || defined(__clang__)
+#define PYTRICIA_ATOMIC_ADD(v, n) __atomic_add_fetch(&(v), (n), __ATOMIC_SEQ_CST)
+#define PYTRICIA_ATOMIC_GET(v) __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define PYTRICIA_ATOMIC_SET(v, n) __atomic_store_n(&(v), (n), __ATOMIC_SEQ_CST)
+#define PYTRICIA_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define PYTRICIA_ATOMIC_ADD(v, n) (_InterlockedExchangeAdd(&(v), (n)) + (n))
+#define PYTRICIA_ATOMIC_GET(v) _InterlockedOr(&(v), 0)
+#define PYTRICIA_ATOMIC_SET(v, n) _InterlockedExchange(&(v), (n))
+#define PYTRICIA_ATOMIC_FENCE() MemoryBarrier()
+#endif
+
+// a lock for what a tree and its snapshots share, which the critical
+// section of no one object covers
+#if defined(PATRICIA_ATOMIC) && PY_VERSION_HEX >= 0x030D0000
+#define PYTRICIA_MUTEX PyMutex
+#define PYTRICIA_LOCK(m) PyMutex_Lock(&(m))
+#define PYTRICIA_UNLOCK(m) PyMutex_Unlock(&(m))
+#else
+#define PYTRICIA_MUTEX char
+#define PYTRICIA_LOCK(m) ((void)(m))
+#define PYTRICIA_UNLOCK(m) ((void)(m))
+#endif
+
+// called with a retired pointer and its argument once it is safe to free
+typedef void (*pytricia_release_fn)(void *ptr, intptr_t arg);
+
+struct pytricia_ebr;
+static int _pytricia_reap_later(patricia_tree_t *tree, struct pytricia_ebr *ebr);
+
+#ifdef PATRICIA_ATOMIC
+// without the GIL, lookups take no lock at all and run alongside the one
+// writer allowed at a time, so whatever a writer takes out of the tree
+// (nodes, replaced values, a compiled engine, the old node block after
+// freeze or thaw) may still be in use by a lookup that started earlier.
+// it is retired instead of freed, and freed by epoch-based reclamation:
+// each lookup is counted against the epoch, even or odd, that was current
+// when it started, and once no lookup of the previous epoch is left,
+// whatever was retired before the current epoch began is freed and the
+// epoch moves on.  lookups only touch a counter picked by thread, and
+// writers never wait for them; a writer that finds lookups still running
+// leaves the freeing to a later one.
+#define PYTRICIA_EBR_STRIPES 16
+
+typedef struct {
+    long count;
+    char pad[64 - sizeof(long)];      // a cache line each
+} pytricia_ebr_stripe_t;
+
+typedef struct {
+    pytricia_release_fn fn;
+    void *ptr;
+    intptr_t arg;
+} pytricia_retired_t;
+
+typedef struct {
+    pytricia_retired_t *items;
+    Py_ssize_t count;
+    Py_ssize_t size;
+} pytricia_limbo_t;
+
+// another tree's epochs, and the epoch they were at: see _pytricia_ebr_watch
+typedef struct {
+    struct pytricia_ebr *ebr;
+    long epoch;
+} pytricia_ebr_watch_t;
+
+typedef struct pytricia_ebr {
+    long epoch;
+    char pad[64 - sizeof(long)];
+    pytricia_ebr_stripe_t active[2][PYTRICIA_EBR_STRIPES];
+    pytricia_limbo_t limbo[2];        // retired in the current and the previous epoch
+    long users;                       // a tree and its snapshots share one
+    long refs;                        // its users, and the watches on it
+    pytricia_ebr_watch_t *watches;
+    long nwatches;
+    long sizewatches;
+    PYTRICIA_MUTEX lock;              // for the limbo lists, watches and epoch changes
+} pytricia_ebr_t;
+
+// count a lookup as running until _pytricia_read_end
+static long *
+_pytricia_read_begin(PyTricia *self) {
+    pytricia_ebr_t *ebr = self->m_ebr;
+    uint64_t h = (uint64_t)PyThread_get_thread_ident() * 0x9e3779b97f4a7c15ULL;
+    size_t stripe = (size_t)(h >> 32) % PYTRICIA_EBR_STRIPES;
+    for (;;) {
+        long epoch = PYTRICIA_ATOMIC_GET(ebr->epoch);
+        long *count = &ebr->active[epoch & 1][stripe].count;
+        PYTRICIA_ATOMIC_ADD(*count, 1);
+        // only a lookup counted in the epoch still current holds it back
+        if (PYTRICIA_ATOMIC_GET(ebr->epoch) == epoch) {
+            return count;
         }
+        PYTRICIA_ATOMIC_ADD(*count, -1);
     }
 }
-#endif
 
+static void
+_pytricia_read_end(long *count) {
+    if (count) {
+        PYTRICIA_ATOMIC_ADD(*count, -1);
+    }
+}
+
+static void
+_pytricia_release_all(pytricia_retired_t *items, Py_ssize_t count) {
+    for (Py_ssize_t i = 0; i < count; i++) {
+        items[i].fn(items[i].ptr, items[i].arg);
+    }
+    free(items);
+}
+
+// whether a lookup counted in the epoch before the current one is still
+// running; with the lock held
 static int
-_prefix_convert(int family, const char *addr, prefix_t* prefix) {
-    int prefixlen = -1;
-    char addrcopy[128];
+_pytricia_ebr_busy(pytricia_ebr_t *ebr) {
+    pytricia_ebr_stripe_t *previous = ebr->active[(ebr->epoch + 1) & 1];
+    for (int j = 0; j < PYTRICIA_EBR_STRIPES; j++) {
+        if (PYTRICIA_ATOMIC_GET(previous[j].count) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    if (strlen(addr) < 4) {
-        return 0;
-    } 
+// move the epoch on if no lookup holds it back.  what was retired stays
+// where it is, which only frees it an epoch later than it could be.
+static void
+_pytricia_ebr_advance(pytricia_ebr_t *ebr) {
+    PYTRICIA_LOCK(ebr->lock);
+    if (!_pytricia_ebr_busy(ebr)) {
+        PYTRICIA_ATOMIC_SET(ebr->epoch, ebr->epoch + 1);
+    }
+    PYTRICIA_UNLOCK(ebr->lock);
+}
 
-    strncpy(addrcopy, addr, 128);
-    char *slash = strchr(addrcopy, '/');
-    if (slash != NULL) {
-        *slash = '\0';
-        slash++;
-        if (strlen(slash) > 0) {
-            prefixlen = (int)strtol(slash, NULL, 10);
+static void
+_pytricia_ebr_unref(pytricia_ebr_t *ebr) {
+    if (PYTRICIA_ATOMIC_ADD(ebr->refs, -1) == 0) {
+        for (long i = 0; i < ebr->nwatches; i++) {
+            _pytricia_ebr_unref(ebr->watches[i].ebr);
         }
+        free(ebr->watches);
+        free(ebr);
     }
+}
 
-    // if family isn't set, infer it
-    if (family == 0) {
-        if (strchr(addrcopy, ':')) {
-            family = AF_INET6;
+// make room for one more watch, so that swap_contents can not fail halfway
+static int
+_pytricia_ebr_reserve(pytricia_ebr_t *ebr) {
+    int ok = 1;
+    PYTRICIA_LOCK(ebr->lock);
+    if (ebr->nwatches == ebr->sizewatches) {
+        long size = ebr->sizewatches ? ebr->sizewatches * 2 : 4;
+        pytricia_ebr_watch_t *watches = realloc(ebr->watches, size * sizeof(pytricia_ebr_watch_t));
+        if (watches) {
+            ebr->watches = watches;
+            ebr->sizewatches = size;
         } else {
-            family = AF_INET;
+            ok = 0;
         }
     }
+    PYTRICIA_UNLOCK(ebr->lock);
+    return ok;
+}
 
-    if (family == AF_INET) {
-        if (prefixlen == -1 || prefixlen < 0 || prefixlen > 32) {
-            prefixlen = 32;
-        }
-        struct in_addr sin;
-        if (inet_pton(AF_INET, addrcopy, &sin) != 1) {
-            return 0;
+// after swap_contents, lookups counted in the other tree's epochs may
+// still be reading the nodes this tree now holds, so nothing it retires
+// is freed until the other epochs have moved on twice from where they are
+// now.  needs room made by _pytricia_ebr_reserve.
+static void
+_pytricia_ebr_watch(pytricia_ebr_t *ebr, pytricia_ebr_t *other) {
+    PYTRICIA_ATOMIC_ADD(other->refs, 1);
+    PYTRICIA_LOCK(ebr->lock);
+    ebr->watches[ebr->nwatches].ebr = other;
+    ebr->watches[ebr->nwatches].epoch = PYTRICIA_ATOMIC_GET(other->epoch);
+    PYTRICIA_ATOMIC_SET(ebr->nwatches, ebr->nwatches + 1);
+    PYTRICIA_UNLOCK(ebr->lock);
+}
+
+// try to move the watched epochs on, and drop the watches they have
+// passed; returns whether any is left.  the watched ones are advanced
+// without this one's lock held, as two trees may be watching each other.
+static int
+_pytricia_ebr_watching(pytricia_ebr_t *ebr) {
+    if (PYTRICIA_ATOMIC_GET(ebr->nwatches) == 0) {
+        return 0;
+    }
+    PYTRICIA_LOCK(ebr->lock);
+    long n = ebr->nwatches;
+    pytricia_ebr_t **others = malloc((n ? n : 1) * sizeof(pytricia_ebr_t*));
+    for (long i = 0; others && i < n; i++) {
+        others[i] = ebr->watches[i].ebr;
+        PYTRICIA_ATOMIC_ADD(others[i]->refs, 1);
+    }
+    PYTRICIA_UNLOCK(ebr->lock);
+    if (!others) {
+        return 1;
+    }
+    for (long i = 0; i < n; i++) {
+        _pytricia_ebr_advance(others[i]);
+        _pytricia_ebr_advance(others[i]);
+    }
+
+    PYTRICIA_LOCK(ebr->lock);
+    long left = 0, ndone = 0;
+    pytricia_ebr_t **done = malloc((ebr->nwatches ? ebr->nwatches : 1) * sizeof(pytricia_ebr_t*));
+    for (long i = 0; i < ebr->nwatches; i++) {
+        pytricia_ebr_watch_t watch = ebr->watches[i];
+        if (done && PYTRICIA_ATOMIC_GET(watch.ebr->epoch) - watch.epoch >= 2) {
+            done[ndone++] = watch.ebr;
+        } else {
+            ebr->watches[left++] = watch;
         }
-        return New_Prefix(AF_INET, &sin, prefixlen, prefix);
-    } else if (family == AF_INET6) {
-        if (prefixlen == -1 || prefixlen < 0 || prefixlen > 128) {
-            prefixlen = 128;
+    }
+    PYTRICIA_ATOMIC_SET(ebr->nwatches, left);
+    PYTRICIA_UNLOCK(ebr->lock);
+    for (long i = 0; i < ndone; i++) {
+        _pytricia_ebr_unref(done[i]);
+    }
+    for (long i = 0; i < n; i++) {
+        _pytricia_ebr_unref(others[i]);
+    }
+    free(done);
+    free(others);
+    return left != 0;
+}
+
+// free what no lookup can still be using, advancing the epoch up to twice
+// (what was retired in the current epoch is freed by the second advance).
+// called by writers, and by snapshots dropping what was kept for them.
+static void
+_pytricia_reclaim(PyTricia *self) {
+    pytricia_ebr_t *ebr = self->m_ebr;
+    if (_pytricia_ebr_watching(ebr)) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        PYTRICIA_LOCK(ebr->lock);
+        long epoch = ebr->epoch;
+        int busy = (!ebr->limbo[0].count && !ebr->limbo[1].count) || _pytricia_ebr_busy(ebr);
+        if (busy) {
+            PYTRICIA_UNLOCK(ebr->lock);
+            return;
         }
+        pytricia_limbo_t done = ebr->limbo[1];
+        ebr->limbo[1] = ebr->limbo[0];
+        memset(&ebr->limbo[0], 0, sizeof(pytricia_limbo_t));
+        PYTRICIA_ATOMIC_SET(ebr->epoch, epoch + 1);
+        PYTRICIA_UNLOCK(ebr->lock);
+        // releasing values may run arbitrary code, even another write
+        _pytricia_release_all(done.items, done.count);
+    }
+}
 
-        struct in6_addr sin6;
-        if (inet_pton(AF_INET6, addrcopy, &sin6) != 1) {
-            return 0;
+// free ptr with fn(ptr, arg) once no lookup can be using it
+static void
+_pytricia_retire(PyTricia *self, pytricia_release_fn fn, void *ptr, intptr_t arg) {
+    pytricia_ebr_t *ebr = self->m_ebr;
+    PYTRICIA_LOCK(ebr->lock);
+    pytricia_limbo_t *limbo = &ebr->limbo[0];
+    if (limbo->count == limbo->size) {
+        Py_ssize_t size = limbo->size ? limbo->size * 2 : 64;
+        pytricia_retired_t *items = realloc(limbo->items, size * sizeof(pytricia_retired_t));
+        if (!items) {
+            // leaked; freeing it now could pull it from under a lookup
+            PYTRICIA_UNLOCK(ebr->lock);
+            return;
         }
-        return New_Prefix(AF_INET6, &sin6, prefixlen, prefix);
-    } else {
-        return 0;
+        limbo->items = items;
+        limbo->size = size;
     }
+    limbo->items[limbo->count].fn = fn;
+    limbo->items[limbo->count].ptr = ptr;
+    limbo->items[limbo->count].arg = arg;
+    limbo->count++;
+    PYTRICIA_UNLOCK(ebr->lock);
 }
 
 static int
-_packed_addr_to_prefix(char *addrbuf, long len, prefix_t* pfx_rv) {
-    int ret_ok = 0;
-    if (len == 4) {
-        ret_ok = New_Prefix(AF_INET, addrbuf, 32, pfx_rv);
-    } else if (len == 16) {
-        ret_ok = New_Prefix(AF_INET6, addrbuf, 128, pfx_rv);
-    } else {
-        PyErr_SetString(PyExc_ValueError, "Address bytes must be of length 4 or 16");
+_pytricia_ebr_init(PyTricia *self) {
+    self->m_ebr = calloc(1, sizeof(pytricia_ebr_t));
+    if (self->m_ebr) {
+        self->m_ebr->users = 1;
+        self->m_ebr->refs = 1;
     }
-    return ret_ok;
+    return self->m_ebr != NULL;
 }
 
-#if PY_MAJOR_VERSION == 3
-static int
-_bytes_to_prefix(PyObject *key, prefix_t* pfx_rv) {
-    char *addrbuf = NULL;
-    Py_ssize_t len = 0;
-    if (PyBytes_AsStringAndSize(key, &addrbuf, &len) < 0) {
-        PyErr_SetString(PyExc_ValueError, "Error decoding bytes");
-        return 0;
+static void
+_pytricia_ebr_release(pytricia_ebr_t *ebr) {
+    for (int i = 1; i >= 0; i--) {
+        pytricia_limbo_t limbo = ebr->limbo[i];
+        memset(&ebr->limbo[i], 0, sizeof(pytricia_limbo_t));
+        _pytricia_release_all(limbo.items, limbo.count);
     }
-    return _packed_addr_to_prefix(addrbuf, len, pfx_rv);
+}
+
+// free everything retired once the last object sharing the epochs goes.
+// no lookup on it can be running then, but one on a tree it swapped
+// contents with may be, and a background thread waits for those.
+static void
+_pytricia_ebr_free(PyTricia *self) {
+    pytricia_ebr_t *ebr = self->m_ebr;
+    self->m_ebr = NULL;
+    if (!ebr) {
+        return;
+    }
+    if (PYTRICIA_ATOMIC_ADD(ebr->users, -1) == 0) {
+        if (_pytricia_ebr_watching(ebr)) {
+            // leaked if no thread can be started to wait
+            _pytricia_reap_later(NULL, ebr);
+            return;
+        }
+        _pytricia_ebr_release(ebr);
+    }
+    _pytricia_ebr_unref(ebr);
+}
+
+// a snapshot counts its lookups in its tree's epochs: what the tree takes
+// out may still be read through the snapshot, and the other way around
+static void
+_pytricia_ebr_share(PyTricia *self, PyTricia *other) {
+    _pytricia_ebr_free(self);
+    self->m_ebr = other->m_ebr;
+    PYTRICIA_ATOMIC_ADD(self->m_ebr->users, 1);
+    PYTRICIA_ATOMIC_ADD(self->m_ebr->refs, 1);
+}
+#else
+// with the GIL, nothing runs alongside a writer (lookup_array, which
+// releases it, refuses writers) and retired memory is freed at once
+static long *
+_pytricia_read_begin(PyTricia *self) {
+    return NULL;
+}
+
+static void
+_pytricia_read_end(long *count) {
+}
+
+static void
+_pytricia_reclaim(PyTricia *self) {
+}
+
+static void
+_pytricia_retire(PyTricia *self, pytricia_release_fn fn, void *ptr, intptr_t arg) {
+    fn(ptr, arg);
+}
+
+static int
+_pytricia_ebr_init(PyTricia *self) {
+    self->m_ebr = NULL;
+    return 1;
+}
+
+static void
+_pytricia_ebr_free(PyTricia *self) {
+}
+
+static void
+_pytricia_ebr_share(PyTricia *self, PyTricia *other) {
+}
+
+static int
+_pytricia_ebr_reserve(struct pytricia_ebr *ebr) {
+    return 1;
+}
+
+static void
+_pytricia_ebr_watch(struct pytricia_ebr *ebr, struct pytricia_ebr *other) {
 }
 #endif
 
+static void
+_pytricia_release_object(void *ptr, intptr_t unused) {
+    Py_DECREF((PyObject*)ptr);
+}
+
+static void
+_pytricia_release_memory(void *ptr, intptr_t unused) {
+    free(ptr);
+}
+
+static void
+_pytricia_release_engine(void *ptr, intptr_t engine) {
+    patricia_engine_release((int)engine, ptr);
+}
+
+// an array of count separately allocated nodes, and the array itself
+static void
+_pytricia_release_nodes(void *ptr, intptr_t count) {
+    patricia_node_t **nodes = (patricia_node_t**)ptr;
+    for (intptr_t i = 0; i < count; i++) {
+        free(nodes[i]);
+    }
+    free(nodes);
+}
+
+static void
+_pytricia_retire_engine(PyTricia *self) {
+    int engine;
+    void *engine_data = patricia_engine_detach(self->m_tree, &engine);
+    if (engine_data) {
+        _pytricia_retire(self, _pytricia_release_engine, engine_data, engine);
+    }
+}
+
+// compile engine for a block of a tree of maxbits before the tree takes
+// it, so that running out of memory leaves the tree as it was.  *data is
+// NULL for the trie engine or an empty tree.
 static int
-_key_object_to_prefix(PyObject *key, prefix_t* pfx_rv) {
-    int ret_ok = 0;
-#if PY_MAJOR_VERSION == 3
-#if PY_MINOR_VERSION >= 4
-    if (!_ipaddr_isset) {
-        _set_ipaddr_refs();
+_pytricia_compile_engine(u_int maxbits, patricia_frozen_t *block, int engine, void **data) {
+    patricia_tree_t view;
+    memset(&view, 0, sizeof(view));
+    view.maxbits = maxbits;
+    view.block = block;
+    view.frozen = 1;
+    *data = NULL;
+    if (block == NULL || engine == PATRICIA_ENGINE_TRIE) {
+        return 1;
     }
-#endif
+    *data = patricia_engine_compile(&view, engine);
+    return *data != NULL;
+}
 
-    if (PyUnicode_Check(key)) {
-        int rv = PyUnicode_READY(key); 
-        if (rv < 0) { 
-            PyErr_SetString(PyExc_ValueError, "Error parsing string prefix");
-            return 0;
+// a node, or a frozen block if block is set, with the values and keys it holds
+static void
+_pytricia_release_owned(void *ptr, intptr_t block) {
+    if (block) {
+        patricia_frozen_t *frozen = (patricia_frozen_t*)ptr;
+        for (u_int i = 0; i < frozen->num_entries; i++) {
+            Py_XDECREF((PyObject*)frozen->entries[i].data);
+            Py_XDECREF((PyObject*)frozen->entries[i].user1);
         }
-        const char* temp = PyUnicode_AsUTF8(key);
-        if (temp == 0) {
-            PyErr_SetString(PyExc_ValueError, "Error parsing string prefix");
-            return 0;
+    } else {
+        patricia_node_t *node = (patricia_node_t*)ptr;
+        Py_XDECREF((PyObject*)node->data);
+        Py_XDECREF((PyObject*)node->user1);
+    }
+    free(ptr);
+}
+
+// a snapshot shares the nodes of its tree.  it pins the tree version it
+// was taken at and sees the nodes stamped with it or earlier ones; the
+// tree copies such a node before changing it (see patricia_unshare), and
+// keeps what leaves the tree here until no snapshot that could see it is
+// left.  versions are 16 bits and are renumbered when they run out.
+#define PYTRICIA_UNPINNED ((u_int)-1) // a free entry (above any version)
+
+typedef struct {
+    void *ptr;                        // a node, or a frozen block
+    int block;                        // whether ptr is a block
+    u_int born;                       // seen by snapshots of versions born .. died - 1
+    u_int died;
+} pytricia_kept_t;
+
+typedef struct pytricia_shared {
+    Py_ssize_t refs;                  // the tree and its snapshots
+    unsigned long generation;         // the tree's m_generation at the last snapshot
+    int unpinned;                     // a pin has gone since shared_version was set
+    u_int *pins;                      // the version each snapshot sees
+    Py_ssize_t npins;
+    pytricia_kept_t *kept;
+    Py_ssize_t nkept;
+    Py_ssize_t sizekept;
+    PYTRICIA_MUTEX lock;
+} pytricia_shared_t;
+
+// whether some snapshot may see what the tree had from version born until
+// version died; with the lock held
+static int
+_pytricia_pinned(pytricia_shared_t *shared, u_int born, u_int died) {
+    for (Py_ssize_t i = 0; i < shared->npins; i++) {
+        if (shared->pins[i] >= born && shared->pins[i] < died) {
+            return 1;
         }
-        if (strchr(temp, '.') || strchr(temp, ':')) {
-            ret_ok = _prefix_convert(0, temp, pfx_rv);
-        } else {
-            PyErr_SetString(PyExc_ValueError, "Invalid key type");
-            return 0;
+    }
+    return 0;
+}
+
+// ptr (a node, or a frozen block if block is set) has left the tree
+static void
+_pytricia_keep(PyTricia *self, void *ptr, int block) {
+    pytricia_shared_t *shared = self->m_shared;
+    u_int born = block ? ((patricia_frozen_t*)ptr)->version : ((patricia_node_t*)ptr)->version;
+    u_int died = self->m_tree->version;
+    int pinned;
+    PYTRICIA_LOCK(shared->lock);
+    pinned = _pytricia_pinned(shared, born, died);
+    if (pinned && shared->nkept == shared->sizekept) {
+        Py_ssize_t size = shared->sizekept ? shared->sizekept * 2 : 64;
+        pytricia_kept_t *kept = realloc(shared->kept, size * sizeof(pytricia_kept_t));
+        if (kept) {
+            shared->kept = kept;
+            shared->sizekept = size;
         }
-    } else if (PyLong_Check(key)) {
-        unsigned long packed_addr = htonl(PyLong_AsUnsignedLong(key));
-        ret_ok = New_Prefix(AF_INET, &packed_addr, 32, pfx_rv);
-    } else if (PyBytes_Check(key)) {
-        ret_ok = _bytes_to_prefix(key, pfx_rv);
-    } else if (PyTuple_Check(key)) {
-        PyObject* value = PyTuple_GetItem(key, 0);
-        PyObject* size = PyTuple_GetItem(key, 1);
-        if (!PyBytes_Check(value)) {
-            PyErr_SetString(PyExc_ValueError, "Invalid key tuple value type");
-            return 0;
+    }
+    // if that failed it is leaked, as a snapshot may be reading it
+    if (pinned && shared->nkept < shared->sizekept) {
+        pytricia_kept_t *entry = &shared->kept[shared->nkept++];
+        entry->ptr = ptr;
+        entry->block = block;
+        entry->born = born;
+        entry->died = died;
+    }
+    PYTRICIA_UNLOCK(shared->lock);
+    if (!pinned) {
+        _pytricia_retire(self, _pytricia_release_owned, ptr, block);
+    }
+}
+
+// patricia_unshare has replaced node in the tree by copy
+static void
+_pytricia_unshared(void *arg, patricia_node_t *node, patricia_node_t *copy) {
+    Py_XINCREF((PyObject*)copy->data);
+    _pytricia_keep((PyTricia*)arg, node, 0);
+}
+
+// let the tree's writers change nodes again that only the snapshots gone
+// since the last call could see
+static void
+_pytricia_shared_sync(PyTricia *self) {
+    pytricia_shared_t *shared = self->m_shared;
+    if (!shared || self->m_snapshot) {
+        return;
+    }
+    PYTRICIA_LOCK(shared->lock);
+    if (shared->unpinned) {
+        u_int top = 0;
+        for (Py_ssize_t i = 0; i < shared->npins; i++) {
+            if (shared->pins[i] != PYTRICIA_UNPINNED && shared->pins[i] + 1 > top) {
+                top = shared->pins[i] + 1;
+            }
         }
-        Py_ssize_t slen = PyBytes_Size(value);
-        if (slen != 4 && slen != 16) {
-            PyErr_SetString(PyExc_ValueError, "Invalid key tuple value");
-            return 0;
+        self->m_tree->shared_version = top;
+        shared->unpinned = 0;
+    }
+    PYTRICIA_UNLOCK(shared->lock);
+}
+
+static int
+_pytricia_compare_versions(const void *a, const void *b) {
+    u_int x = *(const u_int*)a, y = *(const u_int*)b;
+    return x < y ? -1 : x > y;
+}
+
+// the number of pins below version, in the sorted pins
+static u_int
+_pytricia_version_rank(const u_int *sorted, Py_ssize_t n, u_int version) {
+    Py_ssize_t lo = 0, hi = n;
+    while (lo < hi) {
+        Py_ssize_t mid = (lo + hi) / 2;
+        if (sorted[mid] < version) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        ret_ok = _bytes_to_prefix(value, pfx_rv);
-        if (ret_ok) {
-	        if (!PyLong_Check(size)) {
-	            PyErr_SetString(PyExc_ValueError, "Invalid key tuple size type");
-	            return 0;
-	        }
-	        unsigned long bitlen = PyLong_AsUnsignedLong(size);
-	        if (bitlen < pfx_rv->bitlen)
-	            pfx_rv->bitlen = bitlen;
-	    }
     }
-#if PY_MINOR_VERSION >= 4
-    // do we have an IPv4/6Address or IPv4/6Network object (ipaddress
-    // module added in Python 3.4
-    else if (ipnet_base && PyObject_IsInstance(key, ipnet_base)) {
-        PyObject *netaddr = PyObject_GetAttrString(key, "network_address");
-        if (netaddr) {
-            PyObject *packed = PyObject_GetAttrString(netaddr, "packed");
-            if (packed && PyBytes_Check(packed)) {
-                ret_ok = _bytes_to_prefix(packed, pfx_rv);
-                PyObject *prefixlen = PyObject_GetAttrString(key, "prefixlen");
-                if (prefixlen && PyLong_Check(prefixlen)) {
-                    long bitlen = PyLong_AsLong(prefixlen);
-                    pfx_rv->bitlen = bitlen;
-                    Py_DECREF(prefixlen);
-                }
-                Py_DECREF(packed);
-            } else {
-                PyErr_SetString(PyExc_ValueError, "Error getting raw representation of IPNetwork");
+    return (u_int)lo;
+}
+
+// versions have run out: replace each one by the number of pins below it,
+// which keeps every comparison that matters (a node's or kept entry's
+// version against a pin) the same.  with the lock held.
+static int
+_pytricia_renumber(PyTricia *self) {
+    pytricia_shared_t *shared = self->m_shared;
+    patricia_tree_t *tree = self->m_tree;
+    Py_ssize_t n = 0;
+    u_int *sorted = malloc((shared->npins ? shared->npins : 1) * sizeof(u_int));
+    if (!sorted) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    for (Py_ssize_t i = 0; i < shared->npins; i++) {
+        if (shared->pins[i] != PYTRICIA_UNPINNED) {
+            sorted[n++] = shared->pins[i];
+        }
+    }
+    if (n >= USHRT_MAX - 1) {
+        free(sorted);
+        PyErr_SetString(PyExc_RuntimeError, "too many snapshots");
+        return 0;
+    }
+    qsort(sorted, n, sizeof(u_int), _pytricia_compare_versions);
+
+    patricia_node_t *node = NULL;
+    PATRICIA_WALK_ALL (tree->head, node) {
+        node->version = _pytricia_version_rank(sorted, n, node->version);
+    } PATRICIA_WALK_END;
+    if (tree->block) {
+        tree->block->version = _pytricia_version_rank(sorted, n, tree->block->version);
+    }
+    for (Py_ssize_t i = 0; i < shared->nkept; i++) {
+        shared->kept[i].born = _pytricia_version_rank(sorted, n, shared->kept[i].born);
+        shared->kept[i].died = _pytricia_version_rank(sorted, n, shared->kept[i].died);
+    }
+    tree->shared_version = 0;
+    for (Py_ssize_t i = 0; i < shared->npins; i++) {
+        if (shared->pins[i] != PYTRICIA_UNPINNED) {
+            shared->pins[i] = _pytricia_version_rank(sorted, n, shared->pins[i]);
+            if (shared->pins[i] + 1 > tree->shared_version) {
+                tree->shared_version = shared->pins[i] + 1;
             }
-            Py_DECREF(netaddr);
-        } else {
-            PyErr_SetString(PyExc_ValueError, "Couldn't get network address from IPNetwork");
         }
-    } else if (ipaddr_base && PyObject_IsInstance(key, ipaddr_base)) {
-        PyObject *packed = PyObject_GetAttrString(key, "packed");
-        if (packed && PyBytes_Check(packed)) {
-            ret_ok = _bytes_to_prefix(packed, pfx_rv);
-            Py_DECREF(packed);
-        } else {
-            PyErr_SetString(PyExc_ValueError, "Error getting raw representation of IPAddress");
+    }
+    tree->version = (u_short)n;
+    free(sorted);
+    return 1;
+}
+
+// pin the current version of the tree for a new snapshot, returning its
+// entry in pins, or -1 with an exception set
+static Py_ssize_t
+_pytricia_pin(PyTricia *self) {
+    pytricia_shared_t *shared = self->m_shared;
+    patricia_tree_t *tree = self->m_tree;
+    Py_ssize_t pin = -1;
+    PYTRICIA_LOCK(shared->lock);
+    for (Py_ssize_t i = 0; i < shared->npins && pin < 0; i++) {
+        if (shared->pins[i] == PYTRICIA_UNPINNED) {
+            pin = i;
         }
-    } 
-#endif
-    else {
-        PyErr_SetString(PyExc_ValueError, "Invalid key type");
     }
-#else //python2
-    if (PyString_Check(key)) {
-        char* temp = PyString_AsString(key);
-        Py_ssize_t slen = PyString_Size(key);
-        if (strchr(temp, '.') || strchr(temp, ':')) {
-            ret_ok = _prefix_convert(0, temp, pfx_rv);
-        } else if (slen == 4 || slen == 16) {
-            ret_ok = _packed_addr_to_prefix(temp, slen, pfx_rv);
-        } else {
-            PyErr_SetString(PyExc_ValueError, "Invalid key type");
+    if (pin < 0) {
+        Py_ssize_t size = shared->npins ? shared->npins * 2 : 8;
+        u_int *pins = realloc(shared->pins, size * sizeof(u_int));
+        if (!pins) {
+            PYTRICIA_UNLOCK(shared->lock);
+            PyErr_NoMemory();
+            return -1;
         }
-    } else if (PyLong_Check(key) || PyInt_Check(key)) {
-        unsigned long packed_addr = htonl(PyInt_AsUnsignedLongMask(key));
-        ret_ok = New_Prefix(AF_INET, &packed_addr, 32, pfx_rv);
-    } else if (PyTuple_Check(key)) {
-        PyObject* value = PyTuple_GetItem(key, 0);
-        PyObject* size = PyTuple_GetItem(key, 1);
-        if (!PyString_Check(value)) {
-            PyErr_SetString(PyExc_ValueError, "Invalid key tuple value type");
-            return 0;
+        for (Py_ssize_t i = shared->npins; i < size; i++) {
+            pins[i] = PYTRICIA_UNPINNED;
         }
-        Py_ssize_t slen = PyString_Size(value);
-        if (slen != 4 && slen != 16) {
-            PyErr_SetString(PyExc_ValueError, "Invalid key tuple value");
-            return 0;
+        pin = shared->npins;
+        shared->pins = pins;
+        shared->npins = size;
+    }
+    // snapshots with no change to the tree in between see the same version
+    if (shared->generation != self->m_generation || tree->version == 0) {
+        if (tree->version == USHRT_MAX && !_pytricia_renumber(self)) {
+            PYTRICIA_UNLOCK(shared->lock);
+            return -1;
         }
-        char* temp = PyString_AsString(value);
-        ret_ok = _packed_addr_to_prefix(temp, slen, pfx_rv);
-        if (pfx_rv) {
-	        if (!PyLong_Check(size) && !PyInt_Check(size)) {
-	            PyErr_SetString(PyExc_ValueError, "Invalid key tuple size type");
-	            return 0;
-	        }
-	        unsigned long bitlen = PyInt_AsLong(size);
-	        if (bitlen < pfx_rv->bitlen)
-	            pfx_rv->bitlen = bitlen;
-	    }
-    } else {
-        PyErr_SetString(PyExc_ValueError, "Invalid key type");
+        tree->version++;
+        shared->generation = self->m_generation;
     }
-#endif
-    return ret_ok;
+    shared->pins[pin] = tree->version - 1;
+    tree->shared_version = tree->version;
+    shared->refs++;
+    PYTRICIA_UNLOCK(shared->lock);
+    return pin;
 }
 
-static PyObject *
-_prefix_to_key_object(prefix_t* prefix, int raw_output) {
-    if (raw_output) {
-        int addr_size;
-        char *addr = (char*) prefix_touchar(prefix);
-        if (prefix->family == AF_INET6) {
-            addr_size = 16;
-        } else {
-            addr_size = 4;
+// drop a snapshot's pin, releasing what only it could still see
+static void
+_pytricia_unpin(PyTricia *self) {
+    pytricia_shared_t *shared = self->m_shared;
+    Py_ssize_t ndone = 0;
+    PYTRICIA_LOCK(shared->lock);
+    shared->pins[self->m_pin] = PYTRICIA_UNPINNED;
+    shared->unpinned = 1;
+    // if there is no room to note them, they go with the last snapshot
+    pytricia_kept_t *done = shared->nkept ? malloc(shared->nkept * sizeof(pytricia_kept_t)) : NULL;
+    if (done) {
+        Py_ssize_t n = 0;
+        for (Py_ssize_t i = 0; i < shared->nkept; i++) {
+            pytricia_kept_t *entry = &shared->kept[i];
+            if (_pytricia_pinned(shared, entry->born, entry->died)) {
+                shared->kept[n++] = *entry;
+            } else {
+                done[ndone++] = *entry;
+            }
         }
-        PyObject* value;
-#if PY_MAJOR_VERSION == 3
-        value = PyBytes_FromStringAndSize(addr, addr_size);
-#else
-        value = PyString_FromStringAndSize(addr, addr_size);
-#endif
-        PyObject* tuple;
-        tuple = Py_BuildValue("(Oi)", value, prefix->bitlen);
-        Py_XDECREF(value);
-        return tuple;
+        shared->nkept = n;
     }
-    char buffer[64];
-    prefix_toa2x(prefix, buffer, 1);
-    return Py_BuildValue("s", buffer);
+    PYTRICIA_UNLOCK(shared->lock);
+    for (Py_ssize_t i = 0; i < ndone; i++) {
+        _pytricia_retire(self, _pytricia_release_owned, done[i].ptr, done[i].block);
+    }
+    free(done);
+    self->m_pin = -1;
 }
 
+// stop sharing; the last of the tree and its snapshots frees what is left
 static void
-pytricia_xdecref(void *data) {
-    Py_XDECREF((PyObject*)data);
+_pytricia_shared_free(PyTricia *self) {
+    pytricia_shared_t *shared = self->m_shared;
+    Py_ssize_t refs;
+    PYTRICIA_LOCK(shared->lock);
+    refs = --shared->refs;
+    PYTRICIA_UNLOCK(shared->lock);
+    self->m_shared = NULL;
+    if (refs == 0) {
+        for (Py_ssize_t i = 0; i < shared->nkept; i++) {
+            _pytricia_retire(self, _pytricia_release_owned, shared->kept[i].ptr, shared->kept[i].block);
+        }
+        free(shared->kept);
+        free(shared->pins);
+        free(shared);
+    }
 }
 
+// empty a tree whose snapshots may see some of its nodes: those are kept
+// for them and the rest freed.  the tree object is going, so no lookup can
+// be running on it.
 static void
-pytricia_dealloc(PyTricia* self) {
-    if (self) {
-        Destroy_Patricia(self->m_tree, pytricia_xdecref);
-        Py_TYPE(self)->tp_free((PyObject*)self);
+_pytricia_destroy_shared(PyTricia *self) {
+    patricia_tree_t *tree = self->m_tree;
+    patricia_node_t *head = tree->head;
+    patricia_frozen_t *block = tree->block;
+    _pytricia_shared_sync(self);
+    tree->head = NULL;
+    tree->block = NULL;
+    tree->num_active_node = 0;
+    if (block) {
+        if (block->version < tree->shared_version) {
+            _pytricia_keep(self, block, 1);
+        } else {
+            _pytricia_release_owned(block, 1);
+        }
+        return;
+    }
+    patricia_node_t *stack[PATRICIA_MAXBITS + 1];
+    patricia_node_t **sp = stack;
+    patricia_node_t *node = head;
+    while (node) {
+        patricia_node_t *l = node->l;
+        patricia_node_t *r = node->r;
+        if (node->version < tree->shared_version) {
+            _pytricia_keep(self, node, 0);
+        } else {
+            _pytricia_release_owned(node, 0);
+        }
+        if (l) {
+            if (r) {
+                *sp++ = r;
+            }
+            node = l;
+        } else if (r) {
+            node = r;
+        } else if (sp != stack) {
+            node = *(--sp);
+        } else {
+            node = NULL;
+        }
     }
 }
 
-static PyObject *
-pytricia_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
-    PyTricia *self;
+// copy the nodes under node (the copy's parent being parent) with new
+// references to their values, or return NULL when out of memory
+static patricia_node_t *
+_pytricia_copy_nodes(patricia_node_t *node, patricia_node_t *parent);
 
-    self = (PyTricia*)type->tp_alloc(type, 0);
-    if (self != NULL) {
-        self->m_tree = NULL;
+static void
+_pytricia_free_copy(patricia_node_t *node) {
+    if (node) {
+        _pytricia_free_copy(node->l);
+        _pytricia_free_copy(node->r);
+        _pytricia_release_owned(node, 0);
     }
-    return (PyObject *)self;
 }
 
-static int
-pytricia_init(PyTricia *self, PyObject *args, PyObject *kwds) {
-    int prefixlen = 32;
-    int family = AF_INET;
-    PyObject* raw_output = NULL;
-    if (!PyArg_ParseTuple(args, "|iiO", &prefixlen, &family, &raw_output)) {
-        self->m_tree = New_Patricia(1); // need to have *something* to dealloc
-        PyErr_SetString(PyExc_ValueError, "Error parsing prefix length or address family");
-        return -1;
-    }
-
-    if (prefixlen < 0 || prefixlen > PATRICIA_MAXBITS) {
-        self->m_tree = New_Patricia(1); // need to have *something* to dealloc
-        PyErr_SetString(PyExc_ValueError, "Invalid number of maximum bits; must be between 0 and 128, inclusive");
-        return -1;
-    } 
-
-    if (!(family == AF_INET || family == AF_INET6)) {
-        self->m_tree = New_Patricia(1); // need to have *something* to dealloc
-        PyErr_SetString(PyExc_ValueError, "Invalid address family; must be AF_INET (2) or AF_INET6 (30)");
-        return -1;
+static patricia_node_t *
+_pytricia_copy_nodes(patricia_node_t *node, patricia_node_t *parent) {
+    patricia_node_t *copy = malloc(sizeof(patricia_node_t));
+    if (!copy) {
+        return NULL;
     }
-    
-    self->m_tree = New_Patricia(prefixlen);
-    self->m_family = family;
-    self->m_raw_output = raw_output && PyObject_IsTrue(raw_output);
-    if (self->m_tree == NULL) {
-        return -1;
+    *copy = *node;
+    copy->parent = parent;
+    copy->l = copy->r = NULL;
+    copy->user1 = NULL;
+    Py_XINCREF((PyObject*)copy->data);
+    if ((node->l && !(copy->l = _pytricia_copy_nodes(node->l, copy))) ||
+        (node->r && !(copy->r = _pytricia_copy_nodes(node->r, copy)))) {
+        _pytricia_free_copy(copy);
+        return NULL;
     }
-    return 0;
+    return copy;
 }
 
-static Py_ssize_t 
-pytricia_length(PyTricia *self) 
-{
-    patricia_node_t *node = NULL;
-    Py_ssize_t count = 0;
-
-    PATRICIA_WALK (self->m_tree->head, node) {
-        count += 1;
-    } PATRICIA_WALK_END;
-    return count;
+// replace the root of a tree, publishing the new one before clearing the
+// old one (see PATRICIA_ROOT)
+static void
+_pytricia_set_root(patricia_tree_t *tree, patricia_node_t *head, patricia_frozen_t *block) {
+    if (head) {
+        PATRICIA_STORE(tree->head, head);
+        PATRICIA_STORE(tree->block, block);
+    } else {
+        PATRICIA_STORE(tree->block, block);
+        PATRICIA_STORE(tree->head, head);
+    }
 }
 
-static PyObject* 
-pytricia_subscript(PyTricia *self, PyObject *key) {
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+// a copy of a frozen block with new references to its values, or NULL
+// when out of memory
+static patricia_frozen_t *
+_pytricia_copy_block(patricia_frozen_t *block) {
+    patricia_frozen_t *copy = patricia_frozen_new(block->num_nodes, block->num_entries);
+    if (!copy) {
         return NULL;
     }
-    patricia_node_t* node = patricia_search_best(self->m_tree, &prefix);
+    memcpy(copy->nodes, block->nodes, block->num_nodes * sizeof(patricia_hot_t));
+    memcpy(copy->entries, block->entries, block->num_entries * sizeof(patricia_entry_t));
+    for (u_int i = 0; i < copy->num_entries; i++) {
+        Py_XINCREF((PyObject*)copy->entries[i].data);
+        copy->entries[i].user1 = NULL;
+    }
+    return copy;
+}
 
-    if (!node) {
-        PyErr_SetString(PyExc_KeyError, "Prefix not found.");
-        return NULL;
+// freeze(), thaw() and lookup_array() move or number the nodes, so a
+// snapshot first gets its own copy.  it keeps its pin: an iterator may
+// still be walking the shared ones.
+static int
+_pytricia_own_nodes(PyTricia *self) {
+    if (self->m_snapshot != PYTRICIA_SNAPSHOT_SHARED) {
+        return 1;
+    }
+    patricia_node_t *copy = NULL;
+    patricia_frozen_t *block = NULL;
+    if ((self->m_tree->head && !(copy = _pytricia_copy_nodes(self->m_tree->head, NULL))) ||
+        (self->m_tree->block && !(block = _pytricia_copy_block(self->m_tree->block)))) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    if (block) {
+        block->version = self->m_tree->version;
     }
+    _pytricia_set_root(self->m_tree, copy, block);
+    self->m_snapshot = PYTRICIA_SNAPSHOT_OWN;
+    self->m_generation++;  // nodes have moved
+    return 1;
+}
 
-    PyObject* data = (PyObject*)node->data;
+// minimal portable native threads, used for lookups that run without the GIL
+typedef void (*pytricia_thread_fn)(void *);
 
-    Py_INCREF(data);
-    return data;
+typedef struct {
+    pytricia_thread_fn fn;
+    void *arg;
+} pytricia_thread_arg_t;
+
+#if defined(_WIN32) || defined(_WIN64)
+static unsigned __stdcall
+#else
+static void *
+#endif
+_pytricia_thread_main(void *p) {
+    pytricia_thread_arg_t targ = *(pytricia_thread_arg_t*)p;
+    free(p);
+    targ.fn(targ.arg);
+    return 0;
 }
 
 static int
-pytricia_internal_delete(PyTricia *self, PyObject *key) {
-    if (self->m_tree->frozen) {
-        PyErr_SetString(PyExc_ValueError, "can not modify a frozen pytricia!  Thaw?");
+_pytricia_thread_start(pytricia_thread_t *thread, pytricia_thread_fn fn, void *arg) {
+    pytricia_thread_arg_t *targ = malloc(sizeof *targ);
+    if (!targ) {
         return -1;
     }
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+    targ->fn = fn;
+    targ->arg = arg;
+#if defined(_WIN32) || defined(_WIN64)
+    *thread = (HANDLE)_beginthreadex(NULL, 0, _pytricia_thread_main, targ, 0, NULL);
+    if (*thread == 0) {
+        free(targ);
         return -1;
     }
-    patricia_node_t* node = patricia_search_exact(self->m_tree, &prefix);
-
-    if (!node) {
-        PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+#else
+    if (pthread_create(thread, NULL, _pytricia_thread_main, targ) != 0) {
+        free(targ);
         return -1;
     }
-
-    // decrement ref count on data referred to by key, if it exists
-    PyObject* data = (PyObject*)node->data;
-    Py_XDECREF(data);
-
-    patricia_remove(self->m_tree, node);
+#endif
     return 0;
 }
 
-static int 
-_pytricia_assign_subscript_internal(PyTricia *self, PyObject *key, PyObject *value, long prefixlen) {
+static void
+_pytricia_thread_join(pytricia_thread_t thread) {
+#if defined(_WIN32) || defined(_WIN64)
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+// sleep for about a millisecond, while polling
+static void
+_pytricia_thread_sleep(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    Sleep(1);
+#else
+    struct timespec ts = {0, 1000000};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+#if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 4
+static PyObject *ipaddr_module = NULL;
+static PyObject *ipaddr_base = NULL;
+static PyObject *ipnet_base = NULL;
+static PyObject *ipv4addr_type = NULL;
+static PyObject *ipv6addr_type = NULL;
+static PyObject *ipv4net_type = NULL;
+static PyObject *ipv6net_type = NULL;
+static PyObject *str_ip = NULL;
+static PyObject *str_prefixlen = NULL;
+static PyObject *str_network_address = NULL;
+static int _ipaddr_isset = 0;
+#endif
+
+#if PY_MAJOR_VERSION == 3
+// Store the non-negative int v as a len byte, network order address.
+static int
+_long_to_addr(PyObject *v, unsigned char *addr, Py_ssize_t len) {
+#if PY_VERSION_HEX >= 0x030D0000
+    Py_ssize_t need = PyLong_AsNativeBytes(v, addr, len, 
+        Py_ASNATIVEBYTES_BIG_ENDIAN | Py_ASNATIVEBYTES_UNSIGNED_BUFFER | Py_ASNATIVEBYTES_REJECT_NEGATIVE);
+    if (need < 0) {
+        return 0;
+    }
+    if (need > len) {
+        PyErr_SetString(PyExc_OverflowError, "int too large for an address");
+        return 0;
+    }
+    return 1;
+#else
+    return _PyLong_AsByteArray((PyLongObject *)v, addr, len, 0, 0) == 0;
+#endif
+}
+
+// ints are IPv6 addresses (up to 2**128 - 1) if family is AF_INET6.
+// otherwise those below 2**32 are IPv4 addresses, as they always have
+// been, and larger ones are IPv6 addresses.
+static int
+_long_to_prefix(PyObject *v, int family, prefix_t *prefix) {
+    int overflow = 0;
+    long long value = PyLong_AsLongLongAndOverflow(v, &overflow);
+    if (value == -1 && PyErr_Occurred()) {
+        return 0;
+    }
+    if (overflow < 0 || (overflow == 0 && value < 0)) {
+        PyErr_SetString(PyExc_ValueError, "Integer address can't be negative");
+        return 0;
+    }
+    if (family != AF_INET6 && overflow == 0 && value <= 0xffffffffLL) {
+        uint32_t packed_addr = htonl((uint32_t)value);
+        return New_Prefix(AF_INET, &packed_addr, 32, prefix);
+    }
+    unsigned char packed[16];
+    if (!_long_to_addr(v, packed, 16)) {
+        return 0;
+    }
+    return New_Prefix(AF_INET6, packed, 128, prefix);
+}
+#endif
+
+#if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 4
+static void _set_ipaddr_refs(void) {
+    ipaddr_module = ipaddr_base = ipnet_base = NULL;
+    if (_ipaddr_isset) {
+        return;
+    }
+    _ipaddr_isset = 1;
+    // 3.4 introduced ipaddress module.  get some static
+    // references to the module and a base class for type
+    // checking arguments to various methods.
+    ipaddr_module = PyImport_ImportModule("ipaddress");
+    if (ipaddr_module != NULL) {
+        ipaddr_base = PyObject_GetAttrString(ipaddr_module, "_BaseAddress");
+        ipnet_base = PyObject_GetAttrString(ipaddr_module, "_BaseNetwork");
+        if (ipaddr_base == NULL && ipnet_base == NULL) {
+            Py_DECREF(ipaddr_module);
+            ipaddr_module = NULL;
+        } else {
+            // the concrete classes and the attribute names holding their
+            // integer address and prefix length, for a fast path that
+            // skips isinstance and the packed/prefixlen properties.
+            ipv4addr_type = PyObject_GetAttrString(ipaddr_module, "IPv4Address");
+            ipv6addr_type = PyObject_GetAttrString(ipaddr_module, "IPv6Address");
+            ipv4net_type = PyObject_GetAttrString(ipaddr_module, "IPv4Network");
+            ipv6net_type = PyObject_GetAttrString(ipaddr_module, "IPv6Network");
+            str_ip = PyUnicode_InternFromString("_ip");
+            str_prefixlen = PyUnicode_InternFromString("_prefixlen");
+            str_network_address = PyUnicode_InternFromString("network_address");
+        }
+    }
+    PyErr_Clear();
+}
+
+// Read the _ip of an exact IPv4Address or IPv6Address into prefix.
+static int
+_ipaddress_addr_to_prefix(PyObject *addr, int v6, prefix_t *prefix) {
+    PyObject *ip = PyObject_GetAttr(addr, str_ip);
+    if (ip == NULL) {
+        return 0;
+    }
+    int ret_ok = 0;
+    if (!PyLong_Check(ip)) {
+        PyErr_SetString(PyExc_ValueError, "Error getting raw representation of IPAddress");
+    } else if (v6) {
+        unsigned char packed[16];
+        if (_long_to_addr(ip, packed, 16)) {
+            ret_ok = New_Prefix(AF_INET6, packed, 128, prefix);
+        }
+    } else {
+        unsigned long packed_addr = PyLong_AsUnsignedLong(ip);
+        if (!(packed_addr == (unsigned long)-1 && PyErr_Occurred())) {
+            packed_addr = htonl(packed_addr);
+            ret_ok = New_Prefix(AF_INET, &packed_addr, 32, prefix);
+        }
+    }
+    Py_DECREF(ip);
+    return ret_ok;
+}
+
+// Read network_address._ip and _prefixlen of an exact IPv4Network or
+// IPv6Network into prefix.
+static int
+_ipaddress_net_to_prefix(PyObject *key, int v6, prefix_t *prefix) {
+    PyObject *netaddr = PyObject_GetAttr(key, str_network_address);
+    if (netaddr == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Couldn't get network address from IPNetwork");
+        return 0;
+    }
+    int ret_ok = 0;
+    if (Py_TYPE(netaddr) != (PyTypeObject *)(v6 ? ipv6addr_type : ipv4addr_type)) {
+        PyErr_SetString(PyExc_ValueError, "Error getting raw representation of IPNetwork");
+    } else if (_ipaddress_addr_to_prefix(netaddr, v6, prefix)) {
+        PyObject *prefixlen = PyObject_GetAttr(key, str_prefixlen);
+        if (prefixlen && PyLong_Check(prefixlen)) {
+            long bitlen = PyLong_AsLong(prefixlen);
+            if (bitlen >= 0 && bitlen <= prefix->bitlen) {
+                prefix->bitlen = bitlen;
+                ret_ok = 1;
+            }
+        }
+        Py_XDECREF(prefixlen);
+        if (!ret_ok && !PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Error getting prefix length of IPNetwork");
+        }
+    }
+    Py_DECREF(netaddr);
+    return ret_ok;
+}
+
+// Fast path for the concrete ipaddress address and network classes,
+// checked by identity so that subclasses (including the Interface
+// classes) take the general path.  Returns 0 for any other object, else
+// 1 with the conversion's success in *ret_ok.
+static int
+_ipaddress_to_prefix(PyObject *key, prefix_t *prefix, int *ret_ok) {
+    PyObject *type = (PyObject *)Py_TYPE(key);
+    if (ipv4addr_type == NULL) {
+        return 0;
+    }
+    if (type == ipv4addr_type || type == ipv6addr_type) {
+        *ret_ok = _ipaddress_addr_to_prefix(key, type == ipv6addr_type, prefix);
+        return 1;
+    }
+    if (type != ipv4net_type && type != ipv6net_type) {
+        return 0;
+    }
+    *ret_ok = _ipaddress_net_to_prefix(key, type == ipv6net_type, prefix);
+    return 1;
+}
+#endif
+
+static int
+_prefix_convert(int family, const char *addr, prefix_t* prefix) {
+    int prefixlen = -1;
+    char addrcopy[128];
+
+    if (strlen(addr) < 4) {
+        return 0;
+    } 
+
+    strncpy(addrcopy, addr, 128);
+    char *slash = strchr(addrcopy, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        slash++;
+        if (strlen(slash) > 0) {
+            prefixlen = (int)strtol(slash, NULL, 10);
+        }
+    }
+
+    // if family isn't set, infer it
+    if (family == 0) {
+        if (strchr(addrcopy, ':')) {
+            family = AF_INET6;
+        } else {
+            family = AF_INET;
+        }
+    }
+
+    if (family == AF_INET) {
+        if (prefixlen == -1 || prefixlen < 0 || prefixlen > 32) {
+            prefixlen = 32;
+        }
+        struct in_addr sin;
+        if (inet_pton(AF_INET, addrcopy, &sin) != 1) {
+            return 0;
+        }
+        return New_Prefix(AF_INET, &sin, prefixlen, prefix);
+    } else if (family == AF_INET6) {
+        if (prefixlen == -1 || prefixlen < 0 || prefixlen > 128) {
+            prefixlen = 128;
+        }
+
+        struct in6_addr sin6;
+        if (inet_pton(AF_INET6, addrcopy, &sin6) != 1) {
+            return 0;
+        }
+        return New_Prefix(AF_INET6, &sin6, prefixlen, prefix);
+    } else {
+        return 0;
+    }
+}
+
+// parse "/NNN" at s[0..len) into *prefixlen, clamped to maxbits the way
+// _prefix_convert does.  an empty string leaves *prefixlen alone.
+static int
+_parse_prefixlen(const char *s, Py_ssize_t len, int maxbits, int *prefixlen) {
+    if (len == 0) {
+        return 1;
+    }
+    if (s[0] != '/' || len < 2 || len > 4) {
+        return 0;
+    }
+    int value = 0;
+    for (Py_ssize_t i = 1; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return 0;
+        }
+        value = value * 10 + (s[i] - '0');
+    }
+    *prefixlen = value > maxbits ? maxbits : value;
+    return 1;
+}
+
+// single-pass parsers for the common forms of string keys, working
+// directly on the key's UTF-8 buffer.  they return 1 on success and -1
+// for anything they don't handle (including invalid input), in which
+// case the caller falls back to _prefix_convert, so the result is always
+// the same as inet_pton's.
+static int
+_parse_ipv4_fast(const char *s, Py_ssize_t len, prefix_t *prefix) {
+    unsigned char addr[4];
+    Py_ssize_t i = 0;
+
+    for (int part = 0; part < 4; part++) {
+        if (part > 0) {
+            if (i >= len || s[i] != '.') {
+                return -1;
+            }
+            i++;
+        }
+        Py_ssize_t start = i;
+        unsigned int value = 0;
+        while (i < len && s[i] >= '0' && s[i] <= '9' && i - start < 3) {
+            value = value * 10 + (s[i] - '0');
+            i++;
+        }
+        // inet_pton refuses leading zeros
+        if (i == start || value > 255 || (s[start] == '0' && i - start > 1)) {
+            return -1;
+        }
+        addr[part] = (unsigned char)value;
+    }
+
+    int prefixlen = 32;
+    if (!_parse_prefixlen(s + i, len - i, 32, &prefixlen)) {
+        return -1;
+    }
+    return New_Prefix(AF_INET, addr, prefixlen, prefix) ? 1 : -1;
+}
+
+static int
+_hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// plain hex groups with at most one "::"; embedded IPv4 is left to inet_pton
+static int
+_parse_ipv6_fast(const char *s, Py_ssize_t len, prefix_t *prefix) {
+    unsigned short groups[8];
+    int ngroups = 0, gap = -1;
+    Py_ssize_t i = 0;
+
+    if (len >= 2 && s[0] == ':' && s[1] == ':') {
+        gap = 0;
+        i = 2;
+    }
+    while (i < len && s[i] != '/') {
+        if (ngroups == 8) {
+            return -1;
+        }
+        unsigned int value = 0;
+        Py_ssize_t start = i;
+        int digit;
+        while (i < len && i - start < 4 && (digit = _hexval(s[i])) >= 0) {
+            value = (value << 4) | (unsigned int)digit;
+            i++;
+        }
+        if (i == start) {
+            return -1;
+        }
+        groups[ngroups++] = (unsigned short)value;
+        if (i == len || s[i] == '/') {
+            break;
+        }
+        if (s[i] != ':') {
+            return -1;
+        }
+        i++;
+        if (i < len && s[i] == ':') {
+            if (gap >= 0) {
+                return -1;
+            }
+            gap = ngroups;
+            i++;
+        } else if (i == len || s[i] == '/') {
+            return -1;  // trailing single colon
+        }
+    }
+    if ((gap < 0 && ngroups != 8) || (gap >= 0 && ngroups > 7)) {
+        return -1;
+    }
+
+    unsigned char addr[16];
+    memset(addr, 0, sizeof(addr));
+    int tail = gap < 0 ? 0 : ngroups - gap;
+    for (int g = 0; g < ngroups; g++) {
+        int pos = (gap >= 0 && g >= gap) ? 8 - tail + (g - gap) : g;
+        addr[pos * 2] = (unsigned char)(groups[g] >> 8);
+        addr[pos * 2 + 1] = (unsigned char)(groups[g] & 0xff);
+    }
+
+    int prefixlen = 128;
+    if (!_parse_prefixlen(s + i, len - i, 128, &prefixlen)) {
+        return -1;
+    }
+    return New_Prefix(AF_INET6, addr, prefixlen, prefix) ? 1 : -1;
+}
+
+// convert a string key, trying the fast parsers first
+static int
+_string_to_prefix(const char *s, Py_ssize_t len, prefix_t *prefix) {
+    const char *colon = memchr(s, ':', len);
+    // _prefix_convert refuses strings shorter than 4 characters
+    if (len >= 4) {
+        int rv = colon ? _parse_ipv6_fast(s, len, prefix) : _parse_ipv4_fast(s, len, prefix);
+        if (rv > 0) {
+            return 1;
+        }
+    }
+    if (colon || memchr(s, '.', len)) {
+        return _prefix_convert(0, s, prefix);
+    }
+    return -1;
+}
+
+static int
+_packed_addr_to_prefix(char *addrbuf, long len, prefix_t* pfx_rv) {
+    int ret_ok = 0;
+    if (len == 4) {
+        ret_ok = New_Prefix(AF_INET, addrbuf, 32, pfx_rv);
+    } else if (len == 16) {
+        ret_ok = New_Prefix(AF_INET6, addrbuf, 128, pfx_rv);
+    } else {
+        PyErr_SetString(PyExc_ValueError, "Address bytes must be of length 4 or 16");
+    }
+    return ret_ok;
+}
+
+#if PY_MAJOR_VERSION == 3
+static int
+_bytes_to_prefix(PyObject *key, prefix_t* pfx_rv) {
+    char *addrbuf = NULL;
+    Py_ssize_t len = 0;
+    if (PyBytes_AsStringAndSize(key, &addrbuf, &len) < 0) {
+        PyErr_SetString(PyExc_ValueError, "Error decoding bytes");
+        return 0;
+    }
+    return _packed_addr_to_prefix(addrbuf, len, pfx_rv);
+}
+#endif
+
+// the family of the addresses int keys stand for in self.  all of them
+// are IPv6 addresses in an AF_INET6 tree; trees made with the default
+// AF_INET may hold either family, so there they go by size.
+static int
+_pytricia_int_family(PyTricia *self) {
+    return self->m_family == AF_INET6 ? AF_INET6 : AF_UNSPEC;
+}
+
+// family is the one int keys are read in (see _pytricia_int_family)
+static int
+_key_object_to_prefix(PyObject *key, prefix_t* pfx_rv, int family) {
+    int ret_ok = 0;
+#if PY_MAJOR_VERSION == 3
+#if PY_MINOR_VERSION >= 4
+    if (!_ipaddr_isset) {
+        _set_ipaddr_refs();
+    }
+#endif
+
+    if (PyUnicode_Check(key)) {
+        int rv = PyUnicode_READY(key); 
+        if (rv < 0) { 
+            PyErr_SetString(PyExc_ValueError, "Error parsing string prefix");
+            return 0;
+        }
+        Py_ssize_t slen = 0;
+        const char* temp = PyUnicode_AsUTF8AndSize(key, &slen);
+        if (temp == 0) {
+            PyErr_SetString(PyExc_ValueError, "Error parsing string prefix");
+            return 0;
+        }
+        ret_ok = _string_to_prefix(temp, slen, pfx_rv);
+        if (ret_ok < 0) {
+            PyErr_SetString(PyExc_ValueError, "Invalid key type");
+            return 0;
+        }
+    } else if (PyLong_Check(key)) {
+        ret_ok = _long_to_prefix(key, family, pfx_rv);
+    } else if (PyBytes_Check(key)) {
+        ret_ok = _bytes_to_prefix(key, pfx_rv);
+    } else if (PyTuple_Check(key)) {
+        PyObject* value = PyTuple_GetItem(key, 0);
+        PyObject* size = PyTuple_GetItem(key, 1);
+        if (!PyBytes_Check(value)) {
+            PyErr_SetString(PyExc_ValueError, "Invalid key tuple value type");
+            return 0;
+        }
+        Py_ssize_t slen = PyBytes_Size(value);
+        if (slen != 4 && slen != 16) {
+            PyErr_SetString(PyExc_ValueError, "Invalid key tuple value");
+            return 0;
+        }
+        ret_ok = _bytes_to_prefix(value, pfx_rv);
+        if (ret_ok) {
+	        if (!PyLong_Check(size)) {
+	            PyErr_SetString(PyExc_ValueError, "Invalid key tuple size type");
+	            return 0;
+	        }
+	        unsigned long bitlen = PyLong_AsUnsignedLong(size);
+	        if (bitlen < pfx_rv->bitlen)
+	            pfx_rv->bitlen = bitlen;
+	    }
+    }
+#if PY_MINOR_VERSION >= 4
+    // do we have an IPv4/6Address or IPv4/6Network object (ipaddress
+    // module added in Python 3.4
+    else if (_ipaddress_to_prefix(key, pfx_rv, &ret_ok)) {
+        // one of the exact ipaddress types; ret_ok is set
+    } else if (ipnet_base && PyObject_IsInstance(key, ipnet_base)) {
+        PyObject *netaddr = PyObject_GetAttrString(key, "network_address");
+        if (netaddr) {
+            PyObject *packed = PyObject_GetAttrString(netaddr, "packed");
+            if (packed && PyBytes_Check(packed)) {
+                ret_ok = _bytes_to_prefix(packed, pfx_rv);
+                PyObject *prefixlen = PyObject_GetAttrString(key, "prefixlen");
+                if (prefixlen && PyLong_Check(prefixlen)) {
+                    long bitlen = PyLong_AsLong(prefixlen);
+                    pfx_rv->bitlen = bitlen;
+                    Py_DECREF(prefixlen);
+                }
+                Py_DECREF(packed);
+            } else {
+                PyErr_SetString(PyExc_ValueError, "Error getting raw representation of IPNetwork");
+            }
+            Py_DECREF(netaddr);
+        } else {
+            PyErr_SetString(PyExc_ValueError, "Couldn't get network address from IPNetwork");
+        }
+    } else if (ipaddr_base && PyObject_IsInstance(key, ipaddr_base)) {
+        PyObject *packed = PyObject_GetAttrString(key, "packed");
+        if (packed && PyBytes_Check(packed)) {
+            ret_ok = _bytes_to_prefix(packed, pfx_rv);
+            Py_DECREF(packed);
+        } else {
+            PyErr_SetString(PyExc_ValueError, "Error getting raw representation of IPAddress");
+        }
+    } 
+#endif
+    else {
+        PyErr_SetString(PyExc_ValueError, "Invalid key type");
+    }
+#else //python2
+    if (PyString_Check(key)) {
+        char* temp = PyString_AsString(key);
+        Py_ssize_t slen = PyString_Size(key);
+        if (strchr(temp, '.') || strchr(temp, ':')) {
+            ret_ok = _prefix_convert(0, temp, pfx_rv);
+        } else if (slen == 4 || slen == 16) {
+            ret_ok = _packed_addr_to_prefix(temp, slen, pfx_rv);
+        } else {
+            PyErr_SetString(PyExc_ValueError, "Invalid key type");
+        }
+    } else if (PyLong_Check(key) || PyInt_Check(key)) {
+        unsigned long packed_addr = htonl(PyInt_AsUnsignedLongMask(key));
+        ret_ok = New_Prefix(AF_INET, &packed_addr, 32, pfx_rv);
+    } else if (PyTuple_Check(key)) {
+        PyObject* value = PyTuple_GetItem(key, 0);
+        PyObject* size = PyTuple_GetItem(key, 1);
+        if (!PyString_Check(value)) {
+            PyErr_SetString(PyExc_ValueError, "Invalid key tuple value type");
+            return 0;
+        }
+        Py_ssize_t slen = PyString_Size(value);
+        if (slen != 4 && slen != 16) {
+            PyErr_SetString(PyExc_ValueError, "Invalid key tuple value");
+            return 0;
+        }
+        char* temp = PyString_AsString(value);
+        ret_ok = _packed_addr_to_prefix(temp, slen, pfx_rv);
+        if (pfx_rv) {
+	        if (!PyLong_Check(size) && !PyInt_Check(size)) {
+	            PyErr_SetString(PyExc_ValueError, "Invalid key tuple size type");
+	            return 0;
+	        }
+	        unsigned long bitlen = PyInt_AsLong(size);
+	        if (bitlen < pfx_rv->bitlen)
+	            pfx_rv->bitlen = bitlen;
+	    }
+    } else {
+        PyErr_SetString(PyExc_ValueError, "Invalid key type");
+    }
+#endif
+    return ret_ok;
+}
+
+// write a decimal number of up to three digits, returning the end
+static char *
+_format_u8(char *p, unsigned int v) {
+    if (v >= 100) {
+        *p++ = '0' + v / 100;
+        v %= 100;
+        *p++ = '0' + v / 10;
+    } else if (v >= 10) {
+        *p++ = '0' + v / 10;
+    }
+    *p++ = '0' + v % 10;
+    return p;
+}
+
+// format a prefix as "address/bitlen" into buffer (at least 64 bytes),
+// the same as prefix_toa2x(prefix, buffer, 1), returning the length.
+// IPv4 is done by hand; IPv6 is left to inet_ntop for its zero
+// compression rules.
+static Py_ssize_t
+_prefix_format(prefix_t *prefix, char *buffer) {
+    char *p = buffer;
+    if (prefix->family == AF_INET) {
+        const u_char *a = prefix_touchar(prefix);
+        for (int i = 0; i < 4; i++) {
+            p = _format_u8(p, a[i]);
+            *p++ = i < 3 ? '.' : '/';
+        }
+    } else {
+        if (!inet_ntop(AF_INET6, &prefix->add.sin6, buffer, 48)) {
+            buffer[0] = '\0';
+        }
+        p += strlen(buffer);
+        *p++ = '/';
+    }
+    p = _format_u8(p, prefix->bitlen);
+    *p = '\0';
+    return p - buffer;
+}
+
+static PyObject *
+_prefix_to_key_object(prefix_t* prefix, int raw_output) {
+    if (raw_output) {
+        int addr_size;
+        char *addr = (char*) prefix_touchar(prefix);
+        if (prefix->family == AF_INET6) {
+            addr_size = 16;
+        } else {
+            addr_size = 4;
+        }
+        PyObject* value;
+#if PY_MAJOR_VERSION == 3
+        value = PyBytes_FromStringAndSize(addr, addr_size);
+#else
+        value = PyString_FromStringAndSize(addr, addr_size);
+#endif
+        PyObject* tuple;
+        tuple = Py_BuildValue("(Oi)", value, prefix->bitlen);
+        Py_XDECREF(value);
+        return tuple;
+    }
+    char buffer[64];
+    Py_ssize_t len = _prefix_format(prefix, buffer);
+#if PY_MAJOR_VERSION == 3
+    return PyUnicode_FromStringAndSize(buffer, len);
+#else
+    return PyString_FromStringAndSize(buffer, len);
+#endif
+}
+
+// the key object for a node holding data.  with node keys enabled, it is
+// made once and kept on the node (in user1) until the prefix is deleted.
+static PyObject *
+_pytricia_node_key(PyTricia *self, patricia_node_t *node) {
+    PyObject *key = (PyObject *)node->user1;
+    if (key) {
+        Py_INCREF(key);
+        return key;
+    }
+    key = _prefix_to_key_object(&node->prefix, self->m_raw_output);
+    if (key && self->m_node_keys) {
+        Py_INCREF(key);
+        node->user1 = key;
+    }
+    return key;
+}
+
+static void
+_pytricia_clear_node_key(patricia_node_t *node) {
+    PyObject *key = (PyObject *)node->user1;
+    node->user1 = NULL;
+    Py_XDECREF(key);
+}
+
+// a new reference to the value of a node found by a search, or NULL for
+// no node.  without the GIL the prefix may have been deleted since the
+// search saw it, which also gives NULL.
+static PyObject *
+_pytricia_node_value(patricia_node_t *node) {
+    PyObject *value = node ? (PyObject *)PATRICIA_LOAD(node->data) : NULL;
+    Py_XINCREF(value);
+    return value;
+}
+
+// what iterating in the given PYTRICIA_ITER_* mode yields for a node
+// holding data: its key, its value, or a (key, value) tuple
+static PyObject *
+_pytricia_node_item(PyTricia *self, patricia_node_t *node, int mode) {
+    PyObject *value = (PyObject *)PATRICIA_LOAD(node->data);
+    if (value == NULL) {
+        value = Py_None;  // deleted (without the GIL) since the walk got here
+    }
+    if (mode == PYTRICIA_ITER_VALUES) {
+        Py_INCREF(value);
+        return value;
+    }
+    PyObject *key = _pytricia_node_key(self, node);
+    if (!key || mode == PYTRICIA_ITER_KEYS) {
+        return key;
+    }
+    PyObject *item = PyTuple_New(2);
+    if (!item) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    Py_INCREF(value);
+    PyTuple_SET_ITEM(item, 0, key);
+    PyTuple_SET_ITEM(item, 1, value);
+    return item;
+}
+
+static void
+_pytricia_clear_node_keys(PyTricia *self) {
+    patricia_node_t *node = NULL;
+    if (self->m_tree) {
+        PATRICIA_WALK_TREE (self->m_tree, node) {
+            _pytricia_clear_node_key(node);
+        } PATRICIA_WALK_TREE_END;
+    }
+}
+
+static void
+pytricia_xdecref(void *data) {
+    Py_XDECREF((PyObject*)data);
+}
+
+// large trees are freed on a background thread, so that dropping one (the
+// old contents after swap_contents, say) does not stall the caller for as
+// long as it takes to free every node.  the thread frees the nodes without
+// the GIL and takes it only to drop the values, a batch at a time.
+#define PYTRICIA_REAP_MIN 65536       // nodes; smaller trees are freed at once
+#define PYTRICIA_REAP_BATCH 4096      // values dropped per hold of the GIL
+
+typedef struct pytricia_reaper {
+    pytricia_thread_t thread;
+    patricia_tree_t *tree;            // to free, or NULL
+    struct pytricia_ebr *ebr;         // to free once it watches no tree, or NULL
+    volatile long done;
+    struct pytricia_reaper *next;
+} pytricia_reaper_t;
+
+static pytricia_reaper_t *_pytricia_reapers = NULL;
+static long _pytricia_reapers_closed = 0;  // set at exit, see _pytricia_join_reapers
+static PYTRICIA_MUTEX _pytricia_reapers_lock;
+
+// free a tree whose nodes no lookup can still be using; called with the GIL
+static void
+_pytricia_reap_tree(patricia_tree_t *tree) {
+    PyObject **objects = NULL;
+    Py_ssize_t count = 0;
+    Py_BEGIN_ALLOW_THREADS
+    objects = malloc((2 * tree->num_active_node + 1) * sizeof(PyObject*));
+    if (objects) {
+        patricia_engine_free(tree);
+        patricia_frozen_t *block = tree->block;
+        if (block) {
+            for (u_int i = 0; i < block->num_entries; i++) {
+                objects[count++] = (PyObject*)block->entries[i].data;
+                if (block->entries[i].user1) {
+                    objects[count++] = (PyObject*)block->entries[i].user1;
+                }
+            }
+            free(block);
+            tree->block = NULL;
+        }
+        patricia_node_t *stack[PATRICIA_MAXBITS + 1];
+        patricia_node_t **sp = stack;
+        patricia_node_t *node = tree->head;
+        while (node) {
+            patricia_node_t *l = node->l;
+            patricia_node_t *r = node->r;
+            if (node->data) {
+                objects[count++] = (PyObject*)node->data;
+            }
+            if (node->user1) {
+                objects[count++] = (PyObject*)node->user1;
+            }
+            free(node);
+            if (l) {
+                if (r) {
+                    *sp++ = r;
+                }
+                node = l;
+            } else if (r) {
+                node = r;
+            } else if (sp != stack) {
+                node = *(--sp);
+            } else {
+                node = NULL;
+            }
+        }
+        tree->head = NULL;
+        tree->num_active_node = 0;
+    }
+    Py_END_ALLOW_THREADS
+    if (!objects) {
+        // out of memory: free it here after all
+        patricia_node_t *node = NULL;
+        PATRICIA_WALK_TREE (tree, node) {
+            _pytricia_clear_node_key(node);
+        } PATRICIA_WALK_TREE_END;
+        Destroy_Patricia(tree, pytricia_xdecref);
+        return;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        Py_DECREF(objects[i]);
+        if ((i + 1) % PYTRICIA_REAP_BATCH == 0) {
+            // let other threads have the GIL
+            Py_BEGIN_ALLOW_THREADS
+            Py_END_ALLOW_THREADS
+        }
+    }
+    free(objects);
+    Destroy_Patricia(tree, NULL);
+}
+
+static void
+_pytricia_reaper_main(void *arg) {
+    pytricia_reaper_t *reaper = (pytricia_reaper_t*)arg;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+#ifdef PATRICIA_ATOMIC
+    if (reaper->ebr) {
+        int watching;
+        Py_BEGIN_ALLOW_THREADS
+        while ((watching = _pytricia_ebr_watching(reaper->ebr)) &&
+               !PYTRICIA_ATOMIC_GET(_pytricia_reapers_closed)) {
+            _pytricia_thread_sleep();
+        }
+        Py_END_ALLOW_THREADS
+        // a lookup that outlives the interpreter's exit keeps what it reads
+        if (!watching) {
+            _pytricia_ebr_release(reaper->ebr);
+            _pytricia_ebr_unref(reaper->ebr);
+        }
+    }
+#endif
+    if (reaper->tree) {
+        _pytricia_reap_tree(reaper->tree);
+    }
+    PyGILState_Release(gstate);
+    PYTRICIA_ATOMIC_SET(reaper->done, 1);
+}
+
+// hand a tree, or epochs still watching another tree (see
+// _pytricia_ebr_free), to a new background thread; returns 0 if none
+// could be started.  finished threads are joined here.
+static int
+_pytricia_reap_later(patricia_tree_t *tree, struct pytricia_ebr *ebr) {
+    pytricia_reaper_t *reaper = calloc(1, sizeof(pytricia_reaper_t));
+    if (!reaper) {
+        return 0;
+    }
+    reaper->tree = tree;
+    reaper->ebr = ebr;
+    PYTRICIA_LOCK(_pytricia_reapers_lock);
+    pytricia_reaper_t **p = &_pytricia_reapers;
+    while (*p) {
+        if (PYTRICIA_ATOMIC_GET((*p)->done)) {
+            pytricia_reaper_t *finished = *p;
+            *p = finished->next;
+            _pytricia_thread_join(finished->thread);
+            free(finished);
+        } else {
+            p = &(*p)->next;
+        }
+    }
+    if (PYTRICIA_ATOMIC_GET(_pytricia_reapers_closed) ||
+        _pytricia_thread_start(&reaper->thread, _pytricia_reaper_main, reaper) != 0) {
+        PYTRICIA_UNLOCK(_pytricia_reapers_lock);
+        free(reaper);
+        return 0;
+    }
+    reaper->next = _pytricia_reapers;
+    _pytricia_reapers = reaper;
+    PYTRICIA_UNLOCK(_pytricia_reapers_lock);
+    return 1;
+}
+
+// registered with atexit: wait for the background threads, and free
+// whatever comes after in the foreground
+static PyObject *
+_pytricia_join_reapers(PyObject *unused, PyObject *unused2) {
+    PYTRICIA_LOCK(_pytricia_reapers_lock);
+    PYTRICIA_ATOMIC_SET(_pytricia_reapers_closed, 1);
+    pytricia_reaper_t *reapers = _pytricia_reapers;
+    _pytricia_reapers = NULL;
+    PYTRICIA_UNLOCK(_pytricia_reapers_lock);
+    Py_BEGIN_ALLOW_THREADS
+    while (reapers) {
+        pytricia_reaper_t *next = reapers->next;
+        _pytricia_thread_join(reapers->thread);
+        free(reapers);
+        reapers = next;
+    }
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef _pytricia_join_reapers_def = {
+    "_join_reapers", (PyCFunction)_pytricia_join_reapers, METH_NOARGS, NULL
+};
+
+// free a tree no lookup can still be using, with its values and kept keys
+static void
+_pytricia_release_tree(void *ptr, intptr_t unused) {
+    patricia_tree_t *tree = (patricia_tree_t*)ptr;
+    if (tree->num_active_node >= PYTRICIA_REAP_MIN && _pytricia_reap_later(tree, NULL)) {
+        return;
+    }
+    patricia_node_t *node = NULL;
+    PATRICIA_WALK_TREE (tree, node) {
+        _pytricia_clear_node_key(node);
+    } PATRICIA_WALK_TREE_END;
+    Destroy_Patricia(tree, pytricia_xdecref);
+}
+
+static void
+_pytricia_free_key_cache(PyTricia *self) {
+    for (Py_ssize_t i = 0; i < self->m_key_cache_size; i++) {
+        Py_XDECREF(self->m_key_cache[i].key);
+    }
+    free(self->m_key_cache);
+    self->m_key_cache = NULL;
+    self->m_key_cache_size = 0;
+}
+
+// _key_object_to_prefix through the key cache, if it is enabled.  ints,
+// bytes and tuples are cheap to convert and skip the cache.
+static int
+_pytricia_key_to_prefix(PyTricia *self, PyObject *key, prefix_t *prefix) {
+    if (self->m_key_cache == NULL || PyLong_Check(key) || PyBytes_Check(key) || PyTuple_Check(key)) {
+        return _key_object_to_prefix(key, prefix, _pytricia_int_family(self));
+    }
+
+    int is_str = PyUnicode_CheckExact(key);
+    Py_ssize_t hash;
+    if (is_str) {
+        hash = PyObject_Hash(key);
+        if (hash == -1) {
+            PyErr_Clear();
+            return _key_object_to_prefix(key, prefix, _pytricia_int_family(self));
+        }
+    } else {
+        hash = (Py_ssize_t)((size_t)key >> 4);
+    }
+
+    // two-way sets: the most recently used entry of a set is kept first
+    key_cache_entry_t *set = &self->m_key_cache[hash & (self->m_key_cache_size - 1) & ~(Py_ssize_t)1];
+    for (int way = 0; way < 2; way++) {
+        key_cache_entry_t *entry = &set[way];
+        if (entry->key == key || 
+            (is_str && entry->key && entry->hash == hash && PyUnicode_CheckExact(entry->key) && 
+             PyUnicode_Compare(entry->key, key) == 0)) {
+            self->m_key_cache_hits++;
+            *prefix = entry->prefix;
+            if (way == 1) {
+                key_cache_entry_t tmp = set[0];
+                set[0] = set[1];
+                set[1] = tmp;
+            }
+            return 1;
+        }
+    }
+
+    self->m_key_cache_misses++;
+    if (!_key_object_to_prefix(key, prefix, _pytricia_int_family(self))) {
+        return 0;
+    }
+    PyObject *old = set[1].key;
+    set[1] = set[0];
+    Py_INCREF(key);
+    set[0].key = key;
+    set[0].hash = hash;
+    set[0].prefix = *prefix;
+    Py_XDECREF(old);
+    return 1;
+}
+
+static size_t
+_result_cache_slot(PyTricia *self, const prefix_t *prefix, size_t addrlen) {
+    const unsigned char *addr = (const unsigned char*)&prefix->add;
+    uint64_t h = prefix->bitlen;
+    for (size_t i = 0; i < addrlen; i += 4) {
+        uint32_t word;
+        memcpy(&word, addr + i, 4);
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+    }
+    return (size_t)(h >> 32) & (size_t)(self->m_result_cache_size - 1);
+}
+
+// patricia_search_best through the result cache, if it is enabled.
+// entries are tagged with the tree generation, so any insert or delete
+// (or moving the nodes by freezing or thawing) invalidates them all.
+static patricia_node_t *
+_pytricia_search_best(PyTricia *self, prefix_t *prefix) {
+    if (self->m_result_cache == NULL) {
+        return patricia_search_best(self->m_tree, prefix);
+    }
+
+    size_t addrlen = prefix->family == AF_INET ? 4 : 16;
+    result_cache_entry_t *entry = &self->m_result_cache[_result_cache_slot(self, prefix, addrlen)];
+    if (entry->family == prefix->family && entry->bitlen == prefix->bitlen &&
+        entry->generation == self->m_generation && 
+        memcmp(entry->addr, &prefix->add, addrlen) == 0) {
+        self->m_result_cache_hits++;
+        return entry->node;
+    }
+
+    self->m_result_cache_misses++;
+    patricia_node_t *node = patricia_search_best(self->m_tree, prefix);
+    entry->generation = self->m_generation;
+    entry->family = prefix->family;
+    entry->bitlen = prefix->bitlen;
+    memcpy(entry->addr, &prefix->add, addrlen);
+    entry->node = node;
+    return node;
+}
+
+static void
+pytricia_dealloc(PyTricia* self) {
+    if (self) {
+        _pytricia_free_key_cache(self);
+        free(self->m_result_cache);
+        if (self->m_snapshot == PYTRICIA_SNAPSHOT_SHARED) {
+            // the nodes are its tree's
+            self->m_tree->head = NULL;
+            self->m_tree->block = NULL;
+            self->m_tree->num_active_node = 0;
+        } else if (self->m_shared && !self->m_snapshot) {
+            _pytricia_destroy_shared(self);
+        }
+        // lookups on a tree that swapped contents with this one may still
+        // be reading its nodes
+        if (self->m_tree && self->m_ebr) {
+            _pytricia_retire(self, _pytricia_release_tree, self->m_tree, 0);
+        } else if (self->m_tree) {
+            _pytricia_release_tree(self->m_tree, 0);
+        }
+        self->m_tree = NULL;
+        if (self->m_shared) {
+            if (self->m_snapshot) {
+                _pytricia_unpin(self);
+            }
+            _pytricia_shared_free(self);
+            _pytricia_reclaim(self);
+        }
+        _pytricia_ebr_free(self);
+        Py_TYPE(self)->tp_free((PyObject*)self);
+    }
+}
+
+static PyObject *
+pytricia_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    PyTricia *self;
+
+    self = (PyTricia*)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->m_tree = NULL;
+        self->m_generation = 0;
+        self->m_index_generation = (unsigned long)-1;
+        self->m_readers = 0;
+        self->m_iterators = 0;
+        self->m_key_cache = NULL;
+        self->m_node_keys = 0;
+        self->m_key_cache_size = 0;
+        self->m_key_cache_hits = 0;
+        self->m_key_cache_misses = 0;
+        self->m_result_cache = NULL;
+        self->m_result_cache_size = 0;
+        self->m_result_cache_hits = 0;
+        self->m_result_cache_misses = 0;
+        self->m_shared = NULL;
+        self->m_pin = -1;
+        self->m_snapshot = 0;
+        if (!_pytricia_ebr_init(self)) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+    return (PyObject *)self;
+}
+
+static int
+pytricia_init(PyTricia *self, PyObject *args, PyObject *kwds) {
+    int prefixlen = 32;
+    int family = AF_INET;
+    PyObject* raw_output = NULL;
+    if (!PyArg_ParseTuple(args, "|iiO", &prefixlen, &family, &raw_output)) {
+        self->m_tree = New_Patricia(1); // need to have *something* to dealloc
+        PyErr_SetString(PyExc_ValueError, "Error parsing prefix length or address family");
+        return -1;
+    }
+
+    if (prefixlen < 0 || prefixlen > PATRICIA_MAXBITS) {
+        self->m_tree = New_Patricia(1); // need to have *something* to dealloc
+        PyErr_SetString(PyExc_ValueError, "Invalid number of maximum bits; must be between 0 and 128, inclusive");
+        return -1;
+    } 
+
+    if (!(family == AF_INET || family == AF_INET6)) {
+        self->m_tree = New_Patricia(1); // need to have *something* to dealloc
+        PyErr_SetString(PyExc_ValueError, "Invalid address family; must be AF_INET (2) or AF_INET6 (30)");
+        return -1;
+    }
+    
+    self->m_tree = New_Patricia(prefixlen);
+    self->m_family = family;
+    self->m_raw_output = raw_output && PyObject_IsTrue(raw_output);
+    if (self->m_tree == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+static Py_ssize_t 
+pytricia_length(PyTricia *self) 
+{
+    patricia_node_t *node = NULL;
+    Py_ssize_t count = 0;
+
+    long *reader = _pytricia_read_begin(self);
+    PATRICIA_WALK_TREE (self->m_tree, node) {
+        count += 1;
+    } PATRICIA_WALK_TREE_END;
+    _pytricia_read_end(reader);
+    return count;
+}
+
+static PyObject* 
+pytricia_subscript(PyTricia *self, PyObject *key) {
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    int ret_ok = _pytricia_key_to_prefix(self, key, &prefix);
+    if (!ret_ok) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    long *reader = _pytricia_read_begin(self);
+    PyObject* data = _pytricia_node_value(_pytricia_search_best(self, &prefix));
+    _pytricia_read_end(reader);
+
+    if (!data) {
+        PyErr_SetString(PyExc_KeyError, "Prefix not found.");
+        return NULL;
+    }
+    return data;
+}
+
+// lookups running without the GIL (see lookup_array) rely on the tree
+// not changing underneath them.
+static int
+_pytricia_check_no_readers(PyTricia *self) {
+    if (PYTRICIA_ATOMIC_GET(self->m_readers) > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "can not modify a pytricia while lookups are in progress");
+        return 0;
+    }
+    return 1;
+}
+
+// with the GIL, nothing keeps the nodes an unfinished iterator is at from
+// being freed when the tree moves them (see m_iterators).
+static int
+_pytricia_check_no_iterators(PyTricia *self, const char *what) {
+#ifndef PATRICIA_ATOMIC
+    if (self->m_iterators > 0) {
+        PyErr_Format(PyExc_RuntimeError, "can not %s a pytricia while iterating over it", what);
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+static int
+_pytricia_check_writable(PyTricia *self) {
+    if (!_pytricia_check_no_readers(self)) {
+        return 0;
+    }
+    if (self->m_snapshot) {
+        PyErr_SetString(PyExc_ValueError, "can not modify a pytricia snapshot");
+        return 0;
+    }
+    if (self->m_tree->frozen) {
+        PyErr_SetString(PyExc_ValueError, "can not modify a frozen pytricia!  Thaw?");
+        return 0;
+    }
+    return 1;
+}
+
+static int
+pytricia_internal_delete(PyTricia *self, PyObject *key) {
+    if (!_pytricia_check_writable(self)) {
+        return -1;
+    }
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+
+    int ret_ok = _key_object_to_prefix(key, &prefix, _pytricia_int_family(self));
+    if (!ret_ok) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return -1;
+    }
+    patricia_node_t* node = patricia_search_exact(self->m_tree, &prefix);
+
+    if (!node) {
+        PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+        return -1;
+    }
+    // a node snapshots may see is copied (with those above it) first
+    node = patricia_unshare(self->m_tree, node);
+    if (!node) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    // decrement ref count on data referred to by key, if it exists, once
+    // no lookup can still be reading it or the removed nodes
+    PyObject* data = (PyObject*)node->data;
+    _pytricia_clear_node_key(node);
+
+    patricia_node_t *removed[2];
+    int n = patricia_unlink(self->m_tree, node, removed);
+    for (int i = 0; i < n; i++) {
+        _pytricia_retire(self, _pytricia_release_memory, removed[i], 0);
+    }
+    if (data) {
+        _pytricia_retire(self, _pytricia_release_object, data, 0);
+    }
+    self->m_generation++;
+    return 0;
+}
+
+static int _pytricia_assign_prefix(PyTricia *self, prefix_t *prefix, PyObject *value);
+
+static int 
+_pytricia_assign_subscript_internal(PyTricia *self, PyObject *key, PyObject *value, long prefixlen) {
     if (!value) {
         return pytricia_internal_delete(self, key);
     }
 
-    if (self->m_tree->frozen) {
-        PyErr_SetString(PyExc_ValueError, "can not modify a frozen pytricia!  Thaw?");
-        return -1;
+    if (!_pytricia_check_writable(self)) {
+        return -1;
+    }
+
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    int ret_ok = _key_object_to_prefix(key, &prefix, _pytricia_int_family(self));
+    if (!ret_ok) {
+        return -1;
+    }
+
+    // if prefixlen > -1, it should override (possibly) parsed prefix len in key
+    if (prefixlen != -1) {
+        prefix.bitlen = prefixlen;
+    }
+    return _pytricia_assign_prefix(self, &prefix, value);
+}
+
+// map a parsed prefix to value, in a tree known to be writable
+static int
+_pytricia_assign_prefix(PyTricia *self, prefix_t *prefix, PyObject *value) {
+    patricia_node_t *node = patricia_lookup(self->m_tree, prefix);
+    
+    if (!node) {
+        PyErr_SetString(PyExc_ValueError, "Error inserting into patricia tree");
+        return -1;
+    }
+
+    // node already existed, lower ref count on old data (once no lookup
+    // can still be reading it)
+    PyObject* old = (PyObject*)node->data;
+
+    Py_INCREF(value);
+    PATRICIA_STORE(node->data, (void*)value);
+    if (old) {
+        _pytricia_retire(self, _pytricia_release_object, old, 0);
+    }
+    self->m_generation++;
+
+    return 0;
+}
+
+// _pytricia_assign_subscript_internal (or delete, for a NULL value) as one
+// serialized write
+static int
+_pytricia_assign_locked(PyTricia *self, PyObject *key, PyObject *value, long prefixlen) {
+    int rv;
+    PYTRICIA_BEGIN_LOCKED(self)
+    _pytricia_shared_sync(self);
+    rv = _pytricia_assign_subscript_internal(self, key, value, prefixlen);
+    _pytricia_reclaim(self);
+    PYTRICIA_END_LOCKED
+    return rv;
+}
+
+static int 
+pytricia_assign_subscript(PyTricia *self, PyObject *key, PyObject *value) {
+    return _pytricia_assign_locked(self, key, value, -1);
+}
+
+static PyObject*
+pytricia_insert(PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+    PyObject *value1 = NULL;
+    PyObject *value2 = NULL;
+    PyObject *rhs = NULL;
+
+    if (!_pytricia_unpack("insert", args, nargs, 1, 3, &key, &value1, &value2)) { 
+        PyErr_SetString(PyExc_ValueError, "Invalid argument(s) to insert");
+        return NULL;
+    }
+
+    if (value1) {
+        long prefixlen = -1;
+        if (value2 == NULL) {
+            rhs = value1;
+        } else {
+            rhs = value2;
+#if PY_MAJOR_VERSION == 3
+            if (PyLong_Check(value1)) {
+                prefixlen = PyLong_AsLong(value1);
+            }
+#else // python2
+            if (PyLong_Check(value1) || PyInt_Check(value1)) {
+                prefixlen  = PyInt_AsLong(value1);
+            }
+#endif
+        }
+        int rv = _pytricia_assign_locked(self, key, rhs, prefixlen); 
+        if (rv == -1) {
+            PyErr_SetString(PyExc_ValueError, "Invalid key.");
+            return NULL;
+        }
+    } else {
+        PyErr_SetString(PyExc_ValueError, "Missing argument(s) to insert");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_delitem(PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+    if (!_pytricia_unpack("delete", args, nargs, 1, 1, &key)) {
+        return NULL;
+    }
+    
+    int rv = _pytricia_assign_locked(self, key, NULL, -1);
+    if (rv < 0) {
+        return NULL;
+    } 
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+pytricia_get(register PyTricia *obj, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+    PyObject *defvalue = NULL;
+
+    if (!_pytricia_unpack("get", args, nargs, 1, 2, &key, &defvalue)) {
+        return NULL;
+    }
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    int ret_ok = _pytricia_key_to_prefix(obj, key, &prefix);
+    if (!ret_ok) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    long *reader = _pytricia_read_begin(obj);
+    PyObject* data = _pytricia_node_value(_pytricia_search_best(obj, &prefix));
+    _pytricia_read_end(reader);
+
+    if (!data) {
+        if (defvalue) {
+            Py_INCREF(defvalue);
+            return defvalue;
+        }
+        Py_RETURN_NONE;
+    }
+    return data;
+}
+
+static PyObject *
+pytricia_get_key(register PyTricia *obj, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+
+    if (!_pytricia_unpack("get_key", args, nargs, 1, 1, &key)) {
+        return NULL;
+    }
+
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    int ret_ok = _pytricia_key_to_prefix(obj, key, &prefix);
+    if (!ret_ok) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    long *reader = _pytricia_read_begin(obj);
+    patricia_node_t* node = _pytricia_search_best(obj, &prefix);
+    PyObject *rv = node ? _pytricia_node_key(obj, node) : Py_None;
+    if (!node) {
+        Py_INCREF(rv);
+    }
+    _pytricia_read_end(reader);
+    return rv;
+}
+
+// keys converted and searched together by the batch lookup methods
+#define PYTRICIA_BATCH 64
+
+// common loop for get_many and contains_many.  keys may be any iterable;
+// they are converted PYTRICIA_BATCH at a time and searched with the
+// interleaved kernel.  if out is given, it must be a list of the same
+// length as keys, and is filled in place.
+static PyObject *
+_pytricia_lookup_many(PyTricia *self, PyObject *keys, PyObject *defvalue, PyObject *out, int contains_only) {
+    PyObject *seq = PySequence_Fast(keys, "argument must be iterable");
+    if (!seq) {
+        return NULL;
+    }
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+
+    if (out && out != Py_None) {
+        if (!PyList_Check(out) || PyList_GET_SIZE(out) != count) {
+            PyErr_SetString(PyExc_ValueError, "output list must be a list with the same length as the input");
+            Py_DECREF(seq);
+            return NULL;
+        }
+        Py_INCREF(out);
+    } else {
+        out = PyList_New(count);
+        if (!out) {
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+
+    prefix_t prefixes[PYTRICIA_BATCH];
+    patricia_node_t *nodes[PYTRICIA_BATCH];
+    memset(prefixes, 0, sizeof(prefixes));
+    for (Py_ssize_t base = 0; base < count; base += PYTRICIA_BATCH) {
+        size_t n = count - base < PYTRICIA_BATCH ? (size_t)(count - base) : PYTRICIA_BATCH;
+        for (size_t j = 0; j < n; j++) {
+            if (!_pytricia_key_to_prefix(self, items[base + j], &prefixes[j])) {
+                PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+                Py_DECREF(out);
+                Py_DECREF(seq);
+                return NULL;
+            }
+        }
+        PyObject *results[PYTRICIA_BATCH];
+        long *reader = _pytricia_read_begin(self);
+        if (self->m_result_cache) {
+            for (size_t j = 0; j < n; j++) {
+                nodes[j] = _pytricia_search_best(self, &prefixes[j]);
+            }
+        } else {
+            patricia_search_best_many(self->m_tree, prefixes, n, nodes, PATRICIA_DEFAULT_INTERLEAVE);
+        }
+        for (size_t j = 0; j < n; j++) {
+            results[j] = contains_only ? NULL : _pytricia_node_value(nodes[j]);
+        }
+        _pytricia_read_end(reader);
+
+        for (size_t j = 0; j < n; j++) {
+            PyObject *result;
+            if (contains_only) {
+                result = nodes[j] ? Py_True : Py_False;
+                Py_INCREF(result);
+            } else if (results[j]) {
+                result = results[j];
+            } else {
+                result = defvalue;
+                Py_INCREF(result);
+            }
+            // SetItem steals the new reference and releases any old item
+            PyList_SetItem(out, base + j, result);
+        }
+    }
+
+    Py_DECREF(seq);
+    return out;
+}
+
+static PyObject *
+pytricia_get_many(register PyTricia *obj, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *keys = NULL;
+    PyObject *defvalue = Py_None;
+    PyObject *out = NULL;
+
+    if (!_pytricia_unpack("get_many", args, nargs, 1, 3, &keys, &defvalue, &out)) {
+        return NULL;
+    }
+    return _pytricia_lookup_many(obj, keys, defvalue, out, 0);
+}
+
+static PyObject *
+pytricia_contains_many(register PyTricia *obj, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *keys = NULL;
+    PyObject *out = NULL;
+
+    if (!_pytricia_unpack("contains_many", args, nargs, 1, 2, &keys, &out)) {
+        return NULL;
+    }
+    return _pytricia_lookup_many(obj, keys, NULL, out, 1);
+}
+
+// assign each prefix its position in walk (i.e., keys()) order.  the
+// numbering is only redone if the tree has changed since the last time.
+// a frozen tree's entries are already in that order.
+static void
+_pytricia_number_prefixes(PyTricia *self) {
+    if (self->m_index_generation == self->m_generation) {
+        return;
+    }
+    patricia_node_t *node = NULL;
+    u_int index = 0;
+    PATRICIA_WALK (self->m_tree->head, node) {
+        node->index = index++;
+    } PATRICIA_WALK_END;
+    self->m_index_generation = self->m_generation;
+}
+
+// strip a native byte order/alignment character from a struct-style format
+static const char *
+_buffer_format(Py_buffer *view) {
+    const char *fmt = view->format ? view->format : "B";
+    if (*fmt == '@' || *fmt == '=') {
+        fmt++;
+    }
+    return fmt;
+}
+
+// figure out how addresses are laid out in a buffer: either an array of
+// 4-byte native integers (IPv4 addresses, like int keys), or packed
+// network-order addresses of addrlen bytes each (an (N,4) or (N,16) byte
+// array, or a flat byte buffer).  returns the number of addresses, or -1.
+static Py_ssize_t
+_pytricia_addr_layout(PyTricia *self, Py_buffer *view, int *addrlen, int *is_int) {
+    const char *fmt = _buffer_format(view);
+    *is_int = 0;
+
+    if (view->itemsize == 4 && fmt[1] == '\0' && strchr("iIlL", fmt[0])) {
+        *is_int = 1;
+        *addrlen = 4;
+        return view->len / 4;
+    }
+    if (view->itemsize != 1 || fmt[1] != '\0' || !strchr("bBc", fmt[0])) {
+        PyErr_SetString(PyExc_ValueError, "Address buffer must contain 4-byte integers or bytes");
+        return -1;
+    }
+    if (view->ndim == 2) {
+        if (*addrlen != 0 && *addrlen != view->shape[1]) {
+            PyErr_SetString(PyExc_ValueError, "Address length doesn't match address buffer shape");
+            return -1;
+        }
+        *addrlen = (int)view->shape[1];
+    } else if (*addrlen == 0) {
+        *addrlen = self->m_tree->maxbits > 32 ? 16 : 4;
+    }
+    if ((*addrlen != 4 && *addrlen != 16) || view->len % *addrlen != 0) {
+        PyErr_SetString(PyExc_ValueError, "Address bytes must be of length 4 or 16");
+        return -1;
+    }
+    return view->len / *addrlen;
+}
+
+// check a (hi, lo) pair of buffers of 8-byte native integers holding the
+// upper and lower halves of IPv6 addresses.  returns the number of
+// addresses, or -1.
+static Py_ssize_t
+_pytricia_u64_layout(Py_buffer *hi, Py_buffer *lo) {
+    const char *hifmt = _buffer_format(hi);
+    const char *lofmt = _buffer_format(lo);
+    if (hi->itemsize != 8 || lo->itemsize != 8 || hifmt[1] != '\0' || lofmt[1] != '\0' ||
+        !strchr("qQlLnN", hifmt[0]) || !strchr("qQlLnN", lofmt[0])) {
+        PyErr_SetString(PyExc_ValueError, "Address halves must be buffers of 8-byte integers");
+        return -1;
+    }
+    if (hi->len != lo->len) {
+        PyErr_SetString(PyExc_ValueError, "Address halves must be of the same length");
+        return -1;
+    }
+    return hi->len / 8;
+}
+
+static void
+_store_be64(unsigned char *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) {
+        p[i] = (unsigned char)v;
+    }
+}
+
+// one shard of a lookup_array call.  runs without the GIL, so it must
+// not touch any Python objects.
+typedef struct {
+    patricia_tree_t *tree;
+    patricia_frozen_t *block;  // the tree's, if frozen: positions are entry indexes
+    const char *addrs;
+    const char *lo;  // lower address halves, if addrs holds the upper ones
+    char *out;
+    Py_ssize_t count;
+    int addrlen;
+    int is_int;
+    int outsize;
+    int interleave;
+    Py_ssize_t matches;
+} lookup_array_job_t;
+
+static void
+_pytricia_lookup_array_run(void *arg) {
+    lookup_array_job_t *job = (lookup_array_job_t*)arg;
+    const char *addr = job->addrs;
+    prefix_t prefixes[PYTRICIA_BATCH];
+    patricia_node_t *nodes[PYTRICIA_BATCH];
+    memset(prefixes, 0, sizeof(prefixes));
+
+    job->matches = 0;
+    for (Py_ssize_t base = 0; base < job->count; base += PYTRICIA_BATCH) {
+        size_t n = job->count - base < PYTRICIA_BATCH ? (size_t)(job->count - base) : PYTRICIA_BATCH;
+        for (size_t j = 0; j < n; j++, addr += job->addrlen) {
+            if (job->lo) {
+                unsigned char packed[16];
+                _store_be64(packed, *(const uint64_t*)addr);
+                _store_be64(packed + 8, ((const uint64_t*)job->lo)[base + j]);
+                New_Prefix(AF_INET6, packed, 128, &prefixes[j]);
+            } else if (job->is_int) {
+                uint32_t packed_addr = htonl(*(const uint32_t*)addr);
+                New_Prefix(AF_INET, &packed_addr, 32, &prefixes[j]);
+            } else {
+                New_Prefix(job->addrlen == 4 ? AF_INET : AF_INET6, (void*)addr, -1, &prefixes[j]);
+            }
+        }
+        patricia_search_best_many(job->tree, prefixes, n, nodes, job->interleave);
+
+        for (size_t j = 0; j < n; j++) {
+            long long index = -1;
+            if (nodes[j]) {
+                index = job->block ? PATRICIA_ENTRY_INDEX(job->block, nodes[j]) : nodes[j]->index;
+                job->matches++;
+            }
+            if (job->outsize == 4) {
+                ((int32_t*)job->out)[base + j] = (int32_t)index;
+            } else {
+                ((int64_t*)job->out)[base + j] = (int64_t)index;
+            }
+        }
+    }
+}
+
+static PyObject *
+pytricia_lookup_array(register PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"addrs", "out", "addrlen", "threads", "interleave", NULL};
+    PyObject *addrs = NULL;
+    PyObject *out = NULL;
+    int addrlen = 0;
+    int nthreads = 1;
+    int interleave = PATRICIA_DEFAULT_INTERLEAVE;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|iii:lookup_array", kwlist, &addrs, &out, &addrlen, &nthreads, &interleave)) {
+        return NULL;
+    }
+    if (nthreads < 1) {
+        PyErr_SetString(PyExc_ValueError, "Number of threads must be at least 1");
+        return NULL;
+    }
+    if (interleave < 1 || interleave > PATRICIA_MAX_INTERLEAVE) {
+        PyErr_Format(PyExc_ValueError, "Interleave must be between 1 and %d", PATRICIA_MAX_INTERLEAVE);
+        return NULL;
+    }
+
+    // IPv6 addresses may also come as a (hi, lo) pair of uint64 buffers
+    Py_buffer inview, loview, outview;
+    int has_lo = PyTuple_Check(addrs) && PyTuple_GET_SIZE(addrs) == 2;
+    if (PyObject_GetBuffer(has_lo ? PyTuple_GET_ITEM(addrs, 0) : addrs, &inview, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        return NULL;
+    }
+    if (has_lo && PyObject_GetBuffer(PyTuple_GET_ITEM(addrs, 1), &loview, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        PyBuffer_Release(&inview);
+        return NULL;
+    }
+    if (PyObject_GetBuffer(out, &outview, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | PyBUF_WRITABLE) < 0) {
+        PyBuffer_Release(&inview);
+        if (has_lo) {
+            PyBuffer_Release(&loview);
+        }
+        return NULL;
+    }
+
+    int is_int = 0;
+    Py_ssize_t count;
+    if (has_lo) {
+        count = _pytricia_u64_layout(&inview, &loview);
+        addrlen = 8;
+    } else {
+        count = _pytricia_addr_layout(self, &inview, &addrlen, &is_int);
+    }
+    const char *outfmt = _buffer_format(&outview);
+    if (count >= 0) {
+        if ((outview.itemsize != 4 && outview.itemsize != 8) || outfmt[1] != '\0' || !strchr("ilqn", outfmt[0])) {
+            PyErr_SetString(PyExc_ValueError, "Output buffer must contain signed 4- or 8-byte integers");
+            count = -1;
+        } else if (outview.len / outview.itemsize < count) {
+            PyErr_SetString(PyExc_ValueError, "Output buffer is too small");
+            count = -1;
+        }
+    }
+    if (count < 0) {
+        PyBuffer_Release(&inview);
+        if (has_lo) {
+            PyBuffer_Release(&loview);
+        }
+        PyBuffer_Release(&outview);
+        return NULL;
+    }
+
+    int owned;
+    PYTRICIA_BEGIN_LOCKED(self)
+    owned = _pytricia_own_nodes(self);
+    PYTRICIA_END_LOCKED
+    if (!owned) {
+        PyBuffer_Release(&inview);
+        if (has_lo) {
+            PyBuffer_Release(&loview);
+        }
+        PyBuffer_Release(&outview);
+        return NULL;
+    }
+
+    if (nthreads > count) {
+        nthreads = count > 0 ? (int)count : 1;
+    }
+    lookup_array_job_t *jobs = calloc(nthreads, sizeof(lookup_array_job_t));
+    pytricia_thread_t *threads = calloc(nthreads, sizeof(pytricia_thread_t));
+    if (!jobs || !threads) {
+        free(jobs);
+        free(threads);
+        PyBuffer_Release(&inview);
+        if (has_lo) {
+            PyBuffer_Release(&loview);
+        }
+        PyBuffer_Release(&outview);
+        return PyErr_NoMemory();
+    }
+
+    // shard the addresses evenly across threads
+    Py_ssize_t offset = 0;
+    for (int t = 0; t < nthreads; t++) {
+        Py_ssize_t shard = count / nthreads + (t < count % nthreads ? 1 : 0);
+        jobs[t].tree = self->m_tree;
+        jobs[t].addrs = (const char*)inview.buf + offset * addrlen;
+        jobs[t].lo = has_lo ? (const char*)loview.buf + offset * 8 : NULL;
+        jobs[t].out = (char*)outview.buf + offset * outview.itemsize;
+        jobs[t].count = shard;
+        jobs[t].addrlen = addrlen;
+        jobs[t].is_int = is_int;
+        jobs[t].outsize = (int)outview.itemsize;
+        jobs[t].interleave = interleave;
+        offset += shard;
+    }
+
+    // the tree is only read from here on; writers are refused until
+    // all lookups have finished.
+    PYTRICIA_ATOMIC_ADD(self->m_readers, 1);
+    PYTRICIA_BEGIN_LOCKED(self)
+    _pytricia_number_prefixes(self);
+    for (int t = 0; t < nthreads; t++) {
+        jobs[t].block = self->m_tree->block;
+    }
+    PYTRICIA_END_LOCKED
+    long *reader = _pytricia_read_begin(self);
+    int started = 1;
+    Py_BEGIN_ALLOW_THREADS
+    for (int t = 1; t < nthreads; t++, started++) {
+        if (_pytricia_thread_start(&threads[t], _pytricia_lookup_array_run, &jobs[t]) != 0) {
+            break;
+        }
+    }
+    // the calling thread takes the first shard, plus any shards we
+    // couldn't start a thread for
+    _pytricia_lookup_array_run(&jobs[0]);
+    for (int t = started; t < nthreads; t++) {
+        _pytricia_lookup_array_run(&jobs[t]);
+    }
+    for (int t = 1; t < started; t++) {
+        _pytricia_thread_join(threads[t]);
+    }
+    Py_END_ALLOW_THREADS
+    _pytricia_read_end(reader);
+    PYTRICIA_ATOMIC_ADD(self->m_readers, -1);
+
+    Py_ssize_t matches = 0;
+    for (int t = 0; t < nthreads; t++) {
+        matches += jobs[t].matches;
+    }
+    free(jobs);
+    free(threads);
+    PyBuffer_Release(&inview);
+    if (has_lo) {
+        PyBuffer_Release(&loview);
+    }
+    PyBuffer_Release(&outview);
+    return PyLong_FromSsize_t(matches);
+}
+
+static int
+pytricia_contains(PyTricia *self, PyObject *key) {
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    int ret_ok = _pytricia_key_to_prefix(self, key, &prefix);
+    if (!ret_ok) {
+        return -1;
+    }
+    long *reader = _pytricia_read_begin(self);
+    patricia_node_t* node = _pytricia_search_best(self, &prefix);
+    _pytricia_read_end(reader);
+    if (node) {
+        return 1;
+    }
+    return 0;
+}
+
+static PyObject*
+pytricia_has_key(PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+    if (!_pytricia_unpack("has_key", args, nargs, 1, 1, &key))
+        return NULL;
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    int ret_ok = _pytricia_key_to_prefix(self, key, &prefix);
+    if (!ret_ok) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    long *reader = _pytricia_read_begin(self);
+    patricia_node_t* node = patricia_search_exact(self->m_tree, &prefix);
+    _pytricia_read_end(reader);
+    if (node) {
+        Py_RETURN_TRUE;
+    }
+    Py_RETURN_FALSE;
+}
+
+static PyObject* 
+_pytricia_list(PyTricia *self, int mode) {
+    PyObject *rvlist = PyList_New(0);
+    if (!rvlist) {
+        return NULL;
+    }
+    
+    patricia_node_t *node = NULL;
+    
+    long *reader = _pytricia_read_begin(self);
+    PATRICIA_WALK_TREE (self->m_tree, node) {
+        PyObject *item = _pytricia_node_item(self, node, mode);
+        if (!item || PyList_Append(rvlist, item) != 0) {
+            Py_XDECREF(item);
+            Py_CLEAR(rvlist);
+            break;
+        }
+        Py_DECREF(item);
+    } PATRICIA_WALK_TREE_END;
+    _pytricia_read_end(reader);
+    return rvlist;
+}
+
+static PyObject* 
+pytricia_keys(register PyTricia *self, PyObject *unused) {
+    return _pytricia_list(self, PYTRICIA_ITER_KEYS);
+}
+
+static PyObject* 
+pytricia_values(register PyTricia *self, PyObject *unused) {
+    return _pytricia_list(self, PYTRICIA_ITER_VALUES);
+}
+
+static PyObject* 
+pytricia_items(register PyTricia *self, PyObject *unused) {
+    return _pytricia_list(self, PYTRICIA_ITER_ITEMS);
+}
+
+// the tree's current root, for searches whose result is walked on from:
+// a node found in view is an entry of view->block if that is set
+static patricia_tree_t *
+_pytricia_view(PyTricia *self, patricia_tree_t *view) {
+    memset(view, 0, sizeof(*view));
+    view->maxbits = self->m_tree->maxbits;
+    PATRICIA_ROOT(self->m_tree, view->head, view->block);
+    return view;
+}
+
+// whether the prefix of node lies under that of base (or is the same)
+static int
+_pytricia_covers(patricia_node_t *base, patricia_node_t *node) {
+    u_int bitlen = base->prefix.bitlen;
+    return node->prefix.bitlen >= bitlen && 
+           patricia_differ_bit(prefix_touchar(&base->prefix), prefix_touchar(&node->prefix), bitlen) >= bitlen;
+}
+
+static PyObject*
+pytricia_children(register PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+
+    if (!_pytricia_unpack("children", args, nargs, 1, 1, &key)) {
+        return NULL;
+    }
+
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    int ret_ok = _pytricia_key_to_prefix(self, key, &prefix);
+    if (!ret_ok) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+
+    PyObject *rvlist = PyList_New(0);
+    if (!rvlist) {
+        return NULL;
+    }
+
+    long *reader = _pytricia_read_begin(self);
+    patricia_tree_t view;
+    patricia_node_t* base_node = patricia_search_exact(_pytricia_view(self, &view), &prefix);
+    if (!base_node) {
+       _pytricia_read_end(reader);
+       PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+       Py_DECREF(rvlist);
+       return NULL;
+    }
+    patricia_node_t* node = NULL;
+
+    // in a frozen tree they are the entries that follow, in keys() order
+    if (view.block) {
+        for (u_int i = PATRICIA_ENTRY_INDEX(view.block, base_node) + 1; i < view.block->num_entries; i++) {
+            node = PATRICIA_ENTRY(view.block, i);
+            if (!_pytricia_covers(base_node, node)) {
+                break;
+            }
+            PyObject *item = _pytricia_node_key(self, node);
+            if (!item || PyList_Append(rvlist, item) != 0) {
+                Py_XDECREF(item);
+                Py_CLEAR(rvlist);
+                break;
+            }
+            Py_DECREF(item);
+        }
+        _pytricia_read_end(reader);
+        return rvlist;
+    }
+
+    PATRICIA_WALK (base_node, node) {
+        /* Discard first prefix (we want strict children) */
+        if (node != base_node) {
+            PyObject *item = _pytricia_node_key(self, node);
+            if (!item || PyList_Append(rvlist, item) != 0) {
+                Py_XDECREF(item);
+                Py_CLEAR(rvlist);
+                break;
+            }
+            Py_DECREF(item);
+        }
+    } PATRICIA_WALK_END;
+    _pytricia_read_end(reader);
+    return rvlist;
+}
+
+static PyObject*
+pytricia_parent(register PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+
+    if (!_pytricia_unpack("parent", args, nargs, 1, 1, &key)) {
+        return NULL;
+    }
+
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    int ret_ok = _pytricia_key_to_prefix(self, key, &prefix);
+    if (!ret_ok) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+
+    long *reader = _pytricia_read_begin(self);
+    patricia_tree_t view;
+    patricia_node_t* node = patricia_search_exact(_pytricia_view(self, &view), &prefix);
+    if (!node) {
+	   _pytricia_read_end(reader);
+	   PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+	   return NULL;
+    }
+    // every node's ancestors cover it, so the parent is the closest one
+    // holding data; no second search from the root is needed.  parent
+    // pointers of shared nodes lead into the tree, not the snapshot, and
+    // the entries of a frozen tree have none.
+    patricia_node_t* parent_node;
+    if (view.block || self->m_snapshot == PYTRICIA_SNAPSHOT_SHARED) {
+        parent_node = patricia_search_best2(&view, &node->prefix, 0);
+    } else {
+        parent_node = PATRICIA_LOAD(node->parent);
+        while (parent_node && !PATRICIA_LOAD(parent_node->data)) {
+            parent_node = PATRICIA_LOAD(parent_node->parent);
+        }
+    }
+    PyObject *rv = parent_node ? _pytricia_node_key(self, parent_node) : Py_None;
+    if (!parent_node) {
+        Py_INCREF(rv);
+    }
+    _pytricia_read_end(reader);
+    return rv;
+}
+
+// node orders for the frozen block; every one of them places the root
+// first and parents before their children
+#define PYTRICIA_LAYOUT_PREORDER 0
+#define PYTRICIA_LAYOUT_BFS 1
+#define PYTRICIA_LAYOUT_VEB 2
+
+static int
+_pytricia_layout_from_name(const char *name) {
+    if (name == NULL || strcmp(name, "preorder") == 0) {
+        return PYTRICIA_LAYOUT_PREORDER;
+    }
+    if (strcmp(name, "bfs") == 0) {
+        return PYTRICIA_LAYOUT_BFS;
+    }
+    if (strcmp(name, "veb") == 0) {
+        return PYTRICIA_LAYOUT_VEB;
+    }
+    PyErr_Format(PyExc_ValueError, "Unknown node layout '%s'", name);
+    return -1;
+}
+
+// height of the subtree under hot node i (index + 1, or 0 for none)
+static int
+_pytricia_height(const patricia_hot_t *hot, uint32_t i) {
+    if (i == 0) {
+        return 0;
+    }
+    int l = _pytricia_height(hot, hot[i - 1].l);
+    int r = _pytricia_height(hot, hot[i - 1].r);
+    return 1 + (l > r ? l : r);
+}
+
+static void _pytricia_veb_order(const patricia_hot_t *hot, uint32_t i, int height, uint32_t *order, size_t *idx);
+
+// lay out each subtree hanging depth levels below node i with _pytricia_veb_order
+static void
+_pytricia_veb_bottom(const patricia_hot_t *hot, uint32_t i, int depth, int height, uint32_t *order, size_t *idx) {
+    if (i == 0) {
+        return;
+    }
+    if (depth == 0) {
+        _pytricia_veb_order(hot, i, height, order, idx);
+        return;
+    }
+    _pytricia_veb_bottom(hot, hot[i - 1].l, depth - 1, height, order, idx);
+    _pytricia_veb_bottom(hot, hot[i - 1].r, depth - 1, height, order, idx);
+}
+
+// van Emde Boas order of the first height levels under node i: the top
+// half of the levels recursively, then each subtree below them in turn
+static void
+_pytricia_veb_order(const patricia_hot_t *hot, uint32_t i, int height, uint32_t *order, size_t *idx) {
+    if (i == 0) {
+        return;
+    }
+    if (height == 1) {
+        order[(*idx)++] = i - 1;
+        return;
+    }
+    int top = height / 2;
+    _pytricia_veb_order(hot, i, top, order, idx);
+    _pytricia_veb_bottom(hot, i, top, height - top, order, idx);
+}
+
+// fill order with the indexes of the hot nodes in walk (keys()) order,
+// returning their number
+static size_t
+_pytricia_preorder(const patricia_hot_t *hot, uint32_t *order) {
+    uint32_t stack[PATRICIA_MAXBITS + 1];
+    size_t idx = 0;
+    int sp = 0;
+    uint32_t i = 1;
+    while (i) {
+        order[idx++] = i - 1;
+        if (hot[i - 1].l) {
+            if (hot[i - 1].r) {
+                stack[sp++] = hot[i - 1].r;
+            }
+            i = hot[i - 1].l;
+        } else if (hot[i - 1].r) {
+            i = hot[i - 1].r;
+        } else {
+            i = sp ? stack[--sp] : 0;
+        }
+    }
+    return idx;
+}
+
+// a copy of block with its nodes in the given layout.  the entries are
+// copied as they are, with the references they hold.  returns NULL when
+// out of memory.
+static patricia_frozen_t *
+_pytricia_relayout(patricia_frozen_t *block, int layout) {
+    const patricia_hot_t *hot = block->nodes;
+    size_t count = block->num_nodes, idx = 0;
+    patricia_frozen_t *copy = patricia_frozen_new(block->num_nodes, block->num_entries);
+    uint32_t *order = malloc(count * sizeof(uint32_t));
+    uint32_t *pos = malloc(count * sizeof(uint32_t));
+    if (!copy || !order || !pos) {
+        free(copy);
+        free(order);
+        free(pos);
+        return NULL;
+    }
+
+    if (layout == PYTRICIA_LAYOUT_BFS) {
+        order[idx++] = 0;
+        for (size_t i = 0; i < idx; i++) {
+            if (hot[order[i]].l)
+                order[idx++] = hot[order[i]].l - 1;
+            if (hot[order[i]].r)
+                order[idx++] = hot[order[i]].r - 1;
+        }
+    } else if (layout == PYTRICIA_LAYOUT_VEB) {
+        _pytricia_veb_order(hot, 1, _pytricia_height(hot, 1), order, &idx);
+    } else {
+        idx = _pytricia_preorder(hot, order);
+    }
+    assert (idx == count);
+
+    for (idx = 0; idx < count; idx++) {
+        pos[order[idx]] = (uint32_t)idx;
+    }
+    for (idx = 0; idx < count; idx++) {
+        patricia_hot_t *node = &copy->nodes[idx];
+        *node = hot[order[idx]];
+        node->l = node->l ? pos[node->l - 1] + 1 : 0;
+        node->r = node->r ? pos[node->r - 1] + 1 : 0;
+    }
+    memcpy(copy->entries, block->entries, block->num_entries * sizeof(patricia_entry_t));
+    copy->version = block->version;
+    free(order);
+    free(pos);
+    return copy;
+}
+
+// copy the count nodes under head into a frozen block in preorder, the
+// nodes holding data (nentries of them) giving the entries, and fill
+// order with the nodes by their index.  the entries hold the nodes'
+// values and keys without references of their own.  returns NULL when
+// out of memory.
+static patricia_frozen_t *
+_pytricia_block_from_nodes(patricia_node_t *head, patricia_node_t **order, size_t count, size_t nentries) {
+    patricia_frozen_t *block = patricia_frozen_new((u_int)count, (u_int)nentries);
+    if (!block) {
+        return NULL;
+    }
+    patricia_node_t *node = NULL;
+    u_int idx = 0, entry = 0;
+    PATRICIA_WALK_ALL (head, node) {
+        patricia_hot_t *hot = &block->nodes[idx];
+        order[idx] = node;
+        node->index = idx;
+        hot->bit = node->bit;
+        if (node->data) {
+            patricia_entry_t *e = &block->entries[entry++];
+            e->prefix = node->prefix;
+            e->data = node->data;
+            e->user1 = node->user1;
+            hot->entry = entry;
+        }
+        // the parent came first, so its node is in place
+        if (node->parent) {
+            patricia_hot_t *parent = &block->nodes[node->parent->index];
+            if (node->parent->l == node) {
+                parent->l = idx + 1;
+            } else {
+                parent->r = idx + 1;
+            }
+        }
+        idx++;
+    } PATRICIA_WALK_END;
+    assert (idx == count && entry == nentries);
+    return block;
+}
+
+// turn the tree into a single frozen block in the given layout, with the
+// given engine compiled for it, and mark it frozen.  an already frozen
+// tree is moved to a new block.  returns 0 when out of memory, leaving
+// the tree as it was.  a tree no one else can see yet (see build_async)
+// may be compacted without the GIL.
+static int
+_pytricia_compact(PyTricia *self, int layout, int engine) {
+    patricia_tree_t *tree = self->m_tree;
+    u_int shared_version = tree->shared_version;
+    patricia_frozen_t *block;
+    void *engine_data;
+
+    if (tree->block) {
+        patricia_frozen_t *old_block = tree->block;
+        if (!(block = _pytricia_relayout(old_block, layout))) {
+            return 0;
+        }
+        if (!_pytricia_compile_engine(tree->maxbits, block, engine, &engine_data)) {
+            free(block);
+            return 0;
+        }
+        block->version = tree->version;
+        // the engine goes first: it refers to the entries where they are now
+        _pytricia_retire_engine(self);
+        PATRICIA_STORE(tree->block, block);
+        // snapshots may see the old block: the copy takes new references
+        if (old_block->version < shared_version) {
+            for (u_int i = 0; i < block->num_entries; i++) {
+                Py_XINCREF((PyObject*)block->entries[i].data);
+                block->entries[i].user1 = NULL;
+            }
+            _pytricia_keep(self, old_block, 1);
+        } else {
+            _pytricia_retire(self, _pytricia_release_memory, old_block, 0);
+        }
+        patricia_engine_attach(tree, engine, engine_data);
+        tree->frozen = 1;
+        return 1;
+    }
+
+    patricia_node_t *head = tree->head;
+    patricia_node_t *node = NULL;
+    size_t count = 0, nentries = 0;
+    PATRICIA_WALK_ALL (head, node) {
+        count += 1;
+        nentries += node->data != NULL;
+    } PATRICIA_WALK_END;
+    if (count == 0) {
+        tree->frozen = 1;
+        patricia_engine_attach(tree, engine, NULL);
+        return 1;
+    }
+
+    patricia_node_t **order = malloc(count * sizeof(patricia_node_t*));
+    block = order ? _pytricia_block_from_nodes(head, order, count, nentries) : NULL;
+    if (block && layout != PYTRICIA_LAYOUT_PREORDER) {
+        patricia_frozen_t *preorder = block;
+        block = _pytricia_relayout(preorder, layout);
+        free(preorder);
+    }
+    if (!block || !_pytricia_compile_engine(tree->maxbits, block, engine, &engine_data)) {
+        free(block);
+        free(order);
+        return 0;
+    }
+    block->version = tree->version;
+
+    // the entries take over the values of the nodes, except for those
+    // snapshots may see: their entries take new references instead.
+    // entries come in the same (pre)order as the nodes in order.
+    u_int entry = 0;
+    for (size_t idx = 0; idx < count; idx++) {
+        if (order[idx]->data && order[idx]->version < shared_version) {
+            Py_INCREF((PyObject*)block->entries[entry].data);
+            block->entries[entry].user1 = NULL;
+        }
+        entry += order[idx]->data != NULL;
+    }
+
+    _pytricia_set_root(tree, NULL, block);
+
+    size_t own = 0;
+    for (size_t idx = 0; idx < count; idx++) {
+        if (order[idx]->version < shared_version) {
+            _pytricia_keep(self, order[idx], 0);
+        } else {
+            order[own++] = order[idx];
+        }
+    }
+    _pytricia_retire(self, _pytricia_release_nodes, order, (intptr_t)own);
+
+    patricia_engine_attach(tree, engine, engine_data);
+    tree->frozen = 1;
+    return 1;
+}
+
+// map a freeze() engine name to a PATRICIA_ENGINE_* value, or -1 on error
+static int
+_pytricia_engine_from_name(PyTricia *self, const char *name) {
+    if (name == NULL || strcmp(name, "trie") == 0) {
+        return PATRICIA_ENGINE_TRIE;
+    }
+    if (strcmp(name, "dir24") == 0) {
+        if (self->m_tree->maxbits != 32) {
+            PyErr_SetString(PyExc_ValueError, "The dir24 engine requires a tree with a maximum of 32 bits");
+            return -1;
+        }
+        return PATRICIA_ENGINE_DIR24;
+    }
+    if (strcmp(name, "poptrie") == 0) {
+        return PATRICIA_ENGINE_POPTRIE;
+    }
+    PyErr_Format(PyExc_ValueError, "Unknown lookup engine '%s'", name);
+    return -1;
+}
+
+static PyObject*
+_pytricia_freeze(PyTricia *self, int engine, int layout, int relayout) {
+    if (self->m_tree->frozen && self->m_tree->engine == engine && !relayout) {
+        Py_RETURN_NONE;
+    }
+    // a frozen tree is only moved again when a layout is asked for
+    int move = !self->m_tree->frozen || relayout;
+    if (!_pytricia_check_no_readers(self) || 
+        (move && !_pytricia_check_no_iterators(self, "freeze")) || !_pytricia_own_nodes(self)) {
+        return NULL;
+    }
+    // the new engine is built before anything changes, so running out of
+    // memory leaves the tree as it was
+    if (move) {
+        if (!_pytricia_compact(self, layout, engine)) {
+            return PyErr_NoMemory();
+        }
+        self->m_generation++;  // nodes have moved
+    } else {
+        void *engine_data;
+        if (!_pytricia_compile_engine(self->m_tree->maxbits, self->m_tree->block, engine, &engine_data)) {
+            return PyErr_NoMemory();
+        }
+        _pytricia_retire_engine(self);
+        patricia_engine_attach(self->m_tree, engine, engine_data);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_freeze(register PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"engine", "layout", NULL};
+    const char *engine_name = NULL;
+    const char *layout_name = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zz:freeze", kwlist, &engine_name, &layout_name)) {
+        return NULL;
+    }
+    int engine = _pytricia_engine_from_name(self, engine_name);
+    if (engine < 0) {
+        return NULL;
+    }
+    int layout = _pytricia_layout_from_name(layout_name);
+    if (layout < 0) {
+        return NULL;
+    }
+    PyObject *rv;
+    PYTRICIA_BEGIN_LOCKED(self)
+    _pytricia_shared_sync(self);
+    rv = _pytricia_freeze(self, engine, layout, layout_name != NULL);
+    _pytricia_reclaim(self);
+    PYTRICIA_END_LOCKED
+    return rv;
+}
+
+
+static PyObject*
+_pytricia_thaw(PyTricia *self) {
+    if (!self->m_tree->frozen) {
+        Py_RETURN_NONE;  // already thaw'd
+    }
+    if (!_pytricia_check_no_readers(self) || !_pytricia_check_no_iterators(self, "thaw") || 
+        !_pytricia_own_nodes(self)) {
+        return NULL;
+    }
+    patricia_tree_t *tree = self->m_tree;
+    patricia_frozen_t *block = tree->block;
+    if (block == NULL) {
+        _pytricia_retire_engine(self);
+        tree->frozen = 0;
+        Py_RETURN_NONE;
+    }
+    // allocate a node for each hot node, then fill them in and link them
+    patricia_node_t **nodes = calloc(block->num_nodes, sizeof(patricia_node_t*));
+    for (u_int i = 0; nodes && i < block->num_nodes; i++) {
+        if (!(nodes[i] = calloc(1, sizeof(patricia_node_t)))) {
+            _pytricia_release_nodes(nodes, i);
+            nodes = NULL;
+        }
+    }
+    if (!nodes) {
+        return PyErr_NoMemory();
+    }
+    _pytricia_retire_engine(self);
+    // snapshots may see the block, so the nodes take new references
+    int shared = block->version < tree->shared_version;
+    for (u_int i = 0; i < block->num_nodes; i++) {
+        patricia_hot_t *hot = &block->nodes[i];
+        patricia_node_t *node = nodes[i];
+        node->bit = hot->bit;
+        node->version = tree->version;
+        if (hot->entry) {
+            patricia_entry_t *entry = &block->entries[hot->entry - 1];
+            node->prefix = entry->prefix;
+            node->data = entry->data;
+            node->user1 = entry->user1;
+            if (shared) {
+                Py_XINCREF((PyObject*)node->data);
+                node->user1 = NULL;
+            }
+        }
+        if (hot->l) {
+            node->l = nodes[hot->l - 1];
+            node->l->parent = node;
+        }
+        if (hot->r) {
+            node->r = nodes[hot->r - 1];
+            node->r->parent = node;
+        }
+    }
+    _pytricia_set_root(tree, nodes[0], NULL);
+    free(nodes);
+
+    if (shared) {
+        _pytricia_keep(self, block, 1);
+    } else {
+        _pytricia_retire(self, _pytricia_release_memory, block, 0);
+    }
+
+    // mark as NOT frozen
+    tree->frozen = 0;
+    self->m_generation++;  // nodes have moved
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_thaw(register PyTricia *self, PyObject *unused) {
+    PyObject *rv;
+    PYTRICIA_BEGIN_LOCKED(self)
+    _pytricia_shared_sync(self);
+    rv = _pytricia_thaw(self);
+    _pytricia_reclaim(self);
+    PYTRICIA_END_LOCKED
+    return rv;
+}
+
+static PyObject*
+_pytricia_snapshot(PyTricia *self) {
+    if (self->m_snapshot) {
+        Py_INCREF(self);
+        return (PyObject*)self;
+    }
+    if (!self->m_shared) {
+        self->m_shared = calloc(1, sizeof(pytricia_shared_t));
+        if (!self->m_shared) {
+            return PyErr_NoMemory();
+        }
+        self->m_shared->refs = 1;
+        self->m_tree->unshare_fn = _pytricia_unshared;
+        self->m_tree->unshare_arg = self;
+    }
+
+    PyObject *args = PyTuple_New(0);
+    if (!args) {
+        return NULL;
+    }
+    PyTricia *snapshot = (PyTricia*)Py_TYPE(self)->tp_new(Py_TYPE(self), args, NULL);
+    Py_DECREF(args);
+    if (!snapshot) {
+        return NULL;
+    }
+    snapshot->m_tree = New_Patricia(self->m_tree->maxbits);
+    if (!snapshot->m_tree) {
+        Py_DECREF(snapshot);
+        return PyErr_NoMemory();
+    }
+    snapshot->m_family = self->m_family;
+    snapshot->m_raw_output = self->m_raw_output;
+
+    Py_ssize_t pin = _pytricia_pin(self);
+    if (pin < 0) {
+        Py_DECREF(snapshot);
+        return NULL;
+    }
+    snapshot->m_shared = self->m_shared;
+    snapshot->m_pin = pin;
+    snapshot->m_snapshot = PYTRICIA_SNAPSHOT_SHARED;
+    snapshot->m_tree->head = self->m_tree->head;
+    snapshot->m_tree->block = self->m_tree->block;
+    snapshot->m_tree->frozen = self->m_tree->frozen;
+    snapshot->m_tree->num_active_node = self->m_tree->num_active_node;
+    _pytricia_ebr_share(snapshot, self);
+    return (PyObject*)snapshot;
+}
+
+static PyObject*
+pytricia_snapshot(register PyTricia *self, PyObject *unused) {
+    PyObject *rv;
+    PYTRICIA_BEGIN_LOCKED(self)
+    _pytricia_shared_sync(self);
+    rv = _pytricia_snapshot(self);
+    PYTRICIA_END_LOCKED
+    return rv;
+}
+
+static PyObject*
+pytricia_enable_key_cache(register PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *sizeobj = NULL;
+    if (!_pytricia_unpack("enable_key_cache", args, nargs, 1, 1, &sizeobj)) {
+        return NULL;
+    }
+    Py_ssize_t size = PyNumber_AsSsize_t(sizeobj, PyExc_OverflowError);
+    if (size == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "Cache size can not be negative");
+        return NULL;
+    }
+#ifdef PATRICIA_ATOMIC
+    // lookups fill the caches in, and they may run in parallel without
+    // the GIL, so the caches (and node keys) stay off there
+    Py_RETURN_NONE;
+#endif
+
+    _pytricia_free_key_cache(self);
+    self->m_key_cache_hits = self->m_key_cache_misses = 0;
+    if (size == 0) {
+        Py_RETURN_NONE;
+    }
+    // round up to a power of two so that slots can be found by masking
+    Py_ssize_t slots = 2;
+    while (slots < size && slots < ((Py_ssize_t)1 << 24)) {
+        slots <<= 1;
+    }
+    self->m_key_cache = calloc(slots, sizeof(key_cache_entry_t));
+    if (!self->m_key_cache) {
+        return PyErr_NoMemory();
+    }
+    self->m_key_cache_size = slots;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_enable_result_cache(register PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *sizeobj = NULL;
+    if (!_pytricia_unpack("enable_result_cache", args, nargs, 1, 1, &sizeobj)) {
+        return NULL;
+    }
+    Py_ssize_t size = PyNumber_AsSsize_t(sizeobj, PyExc_OverflowError);
+    if (size == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "Cache size can not be negative");
+        return NULL;
+    }
+#ifdef PATRICIA_ATOMIC
+    Py_RETURN_NONE;  // see enable_key_cache
+#endif
+
+    free(self->m_result_cache);
+    self->m_result_cache = NULL;
+    self->m_result_cache_size = 0;
+    self->m_result_cache_hits = self->m_result_cache_misses = 0;
+    if (size == 0) {
+        Py_RETURN_NONE;
+    }
+    Py_ssize_t slots = 1;
+    while (slots < size && slots < ((Py_ssize_t)1 << 24)) {
+        slots <<= 1;
+    }
+    self->m_result_cache = calloc(slots, sizeof(result_cache_entry_t));
+    if (!self->m_result_cache) {
+        return PyErr_NoMemory();
+    }
+    self->m_result_cache_size = slots;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_enable_node_keys(register PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *flag = Py_True;
+    if (!_pytricia_unpack("enable_node_keys", args, nargs, 0, 1, &flag)) {
+        return NULL;
+    }
+    int enable = PyObject_IsTrue(flag);
+    if (enable < 0) {
+        return NULL;
+    }
+#ifdef PATRICIA_ATOMIC
+    Py_RETURN_NONE;  // see enable_key_cache
+#endif
+    if (!enable) {
+        _pytricia_clear_node_keys(self);
+    }
+    self->m_node_keys = enable;
+    Py_RETURN_NONE;
+}
+
+static double
+_hit_rate(unsigned long long hits, unsigned long long misses) {
+    return hits + misses ? (double)hits / (double)(hits + misses) : 0.0;
+}
+
+static PyObject*
+pytricia_stats(register PyTricia *self, PyObject *unused) {
+    return Py_BuildValue("{s:n,s:K,s:K,s:d,s:n,s:K,s:K,s:d}",
+                         "key_cache_size", self->m_key_cache_size,
+                         "key_cache_hits", self->m_key_cache_hits,
+                         "key_cache_misses", self->m_key_cache_misses,
+                         "key_cache_hit_rate", _hit_rate(self->m_key_cache_hits, self->m_key_cache_misses),
+                         "result_cache_size", self->m_result_cache_size,
+                         "result_cache_hits", self->m_result_cache_hits,
+                         "result_cache_misses", self->m_result_cache_misses,
+                         "result_cache_hit_rate", _hit_rate(self->m_result_cache_hits, self->m_result_cache_misses));
+}
+
+// forward declaration
+static PyTypeObject PyTriciaType;
+
+static PyObject* _pytricia_reduce(PyTricia *self) {
+    if (!self->m_tree->frozen) {
+        PyErr_SetString(PyExc_RuntimeError, "pytri must be frozen before attempting to pickle!");
+        return NULL;
+    }
+
+    PyObject *args = PyTuple_New(1);
+    if (!args) {
+      return NULL;
+    }
+    PyTuple_SET_ITEM(args, 0, PyLong_FromLong(self->m_tree->maxbits));
+
+    // setup the extra dictionary info for setstate
+    PyObject* dict = PyDict_New();
+    PyObject* bytes = PyBytes_FromStringAndSize((const char*)self->m_tree, sizeof(patricia_tree_t));
+
+    if (!dict || !bytes) {
+	    PyErr_SetString(PyExc_MemoryError, "unable to allocate space for tri");
+        Py_XDECREF(dict);
+        Py_XDECREF(bytes);
+        return NULL;
+    }
+
+    int ret_err = PyDict_SetItemString(dict, "tree", bytes);
+    Py_DECREF(bytes);  // dictionary now owns the reference
+    if(ret_err) {
+        PyErr_SetString(PyExc_MemoryError, "error writing tree_t to dictionary");
+        Py_DECREF(dict);
+        return NULL;
+    }
+
+    // the hot nodes, the prefixes of the entries, and their values
+    patricia_frozen_t *block = self->m_tree->block;
+    u_int num_nodes = block ? block->num_nodes : 0;
+    u_int num_entries = block ? block->num_entries : 0;
+    bytes = PyBytes_FromStringAndSize(block ? (const char*)block->nodes : NULL, sizeof(patricia_hot_t) * num_nodes);
+    ret_err = !bytes || PyDict_SetItemString(dict, "nodes", bytes);
+    Py_XDECREF(bytes);  // dictionary now owns the reference
+    if(ret_err) {
+        PyErr_SetString(PyExc_MemoryError, "error writing nodes to dictionary");
+        Py_DECREF(dict);
+        return NULL;
+    }
+
+    bytes = PyBytes_FromStringAndSize(NULL, sizeof(prefix_t) * num_entries);
+    if (bytes) {
+        for (u_int i = 0; i < num_entries; i++) {
+            memcpy(PyBytes_AS_STRING(bytes) + i * sizeof(prefix_t), &block->entries[i].prefix, sizeof(prefix_t));
+        }
+    }
+    ret_err = !bytes || PyDict_SetItemString(dict, "prefixes", bytes);
+    Py_XDECREF(bytes);
+    if(ret_err) {
+        PyErr_SetString(PyExc_MemoryError, "error writing prefixes to dictionary");
+        Py_DECREF(dict);
+        return NULL;
     }
 
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        return -1;
+    PyObject* list = PyList_New(num_entries);
+    if (!list) {
+        PyErr_SetString(PyExc_MemoryError, "error allocating data list");
+        Py_DECREF(dict);
+        return NULL;
+    }
+    for (u_int i = 0; i < num_entries; i++) {
+        // SET_ITEM steal reference so increment in advance to keep original
+        Py_INCREF((PyObject*)block->entries[i].data);
+        PyList_SET_ITEM(list, i, (PyObject*)block->entries[i].data);
     }
 
-    // if prefixlen > -1, it should override (possibly) parsed prefix len in key
-    if (prefixlen != -1) {
-        prefix.bitlen = prefixlen;
+    ret_err = PyDict_SetItemString(dict, "data", list);
+    Py_DECREF(list);  // dictionary now owns the reference
+    if(ret_err) {
+        PyErr_SetString(PyExc_MemoryError, "error writing data list to dictionary");
+        Py_DECREF(dict);
+        return NULL;
+    }
+
+    PyObject* out_tuple = PyTuple_Pack(3, (PyObject*)Py_TYPE(self), args, dict);
+    Py_DECREF(args);
+    Py_DECREF(dict);
+    return out_tuple;
+}
+
+// the node block is copied as a whole, so no thaw may move it meanwhile
+static PyObject* pytricia_reduce(PyTricia *self, PyObject *Py_UNUSED(ignored)) {
+    PyObject *rv;
+    PYTRICIA_BEGIN_LOCKED(self)
+    rv = _pytricia_reduce(self);
+    PYTRICIA_END_LOCKED
+    return rv;
+}
+
+// whether the hot nodes of an unpickled block form a tree under nodes[0]
+// of at most maxbits + 1 levels, and the entries they refer to exist
+static int
+_pytricia_check_block(patricia_frozen_t *block, u_int maxbits) {
+    u_char *seen = calloc(block->num_nodes, 1);
+    int ok = seen != NULL;
+    for (u_int i = 0; ok && i < block->num_nodes; i++) {
+        patricia_hot_t *hot = &block->nodes[i];
+        uint32_t child[2] = {hot->l, hot->r};
+        ok = hot->bit <= maxbits && hot->entry <= block->num_entries && (i == 0) != seen[i];
+        // children come after their parent, below it, and have no other
+        for (int j = 0; ok && j < 2; j++) {
+            if (child[j]) {
+                ok = child[j] <= block->num_nodes && !seen[child[j] - 1] &&
+                     child[j] - 1 > i && block->nodes[child[j] - 1].bit > hot->bit;
+                if (ok) {
+                    seen[child[j] - 1] = 1;
+                }
+            }
+        }
+    }
+    free(seen);
+    return ok;
+}
+
+// the frozen block pickled as hot nodes, prefixes and values, or NULL
+// for an empty one.  NULL with an exception set on error.
+static patricia_frozen_t *
+_pytricia_unpickle_block(patricia_tree_t *tree, PyObject *state, PyObject *nodebytes, PyObject *list) {
+    PyObject* prefixbytes = PyDict_GetItemString(state, "prefixes");
+    if (!prefixbytes || !PyBytes_Check(prefixbytes)) {
+        PyErr_SetString(PyExc_TypeError, "__setstate__ failed prefixes type checking");
+        return NULL;
+    }
+    Py_ssize_t num_nodes = PyBytes_Size(nodebytes) / sizeof(patricia_hot_t);
+    Py_ssize_t num_entries = PyList_Size(list);
+    if (PyBytes_Size(nodebytes) % sizeof(patricia_hot_t) || 
+        num_entries * (Py_ssize_t)sizeof(prefix_t) != PyBytes_Size(prefixbytes) ||
+        num_entries > num_nodes || num_nodes > UINT32_MAX) {
+        PyErr_SetString(PyExc_TypeError, "__setstate__ node and data list sizes inconsistent!");
+        return NULL;
+    }
+    if (num_nodes == 0) {
+        return NULL;
+    }
+    patricia_frozen_t *block = patricia_frozen_new((u_int)num_nodes, (u_int)num_entries);
+    if (!block) {
+        PyErr_SetString(PyExc_MemoryError, "__setstate__ error allocating space for nodes");
+        return NULL;
+    }
+    memcpy(block->nodes, PyBytes_AsString(nodebytes), num_nodes * sizeof(patricia_hot_t));
+    if (!_pytricia_check_block(block, tree->maxbits)) {
+        free(block);
+        PyErr_SetString(PyExc_TypeError, "__setstate__ nodes are not a tree");
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < num_entries; i++) {
+        memcpy(&block->entries[i].prefix, PyBytes_AsString(prefixbytes) + i * sizeof(prefix_t), sizeof(prefix_t));
+        block->entries[i].data = PyList_GET_ITEM(list, i);
+        Py_INCREF((PyObject*)block->entries[i].data);
+    }
+    return block;
+}
+
+// a node as pickled before frozen trees were kept as hot nodes and
+// entries (the layout of patricia_node_t then)
+typedef struct {
+    u_short bit;                      // a u_int before snapshots were added
+    u_short version;
+    prefix_t prefix;
+    u_int index;
+    char *l, *r, *parent;
+    void *data;
+    void *user1;
+} pytricia_pickled_node_t;
+
+// the frozen block for nodes pickled as a copy of the old block of whole
+// nodes, whose pointers are relative to the old tree's head (the root,
+// which came first), with the values of all of them in walk order and
+// None for glue nodes.  NULL for an empty tree, and NULL with an
+// exception set on error.
+static patricia_frozen_t *
+_pytricia_unpickle_nodes(patricia_tree_t *tree, int old_nodes, PyObject *nodebytes, PyObject *list) {
+    Py_ssize_t num_nodes = PyList_Size(list);
+    if (num_nodes * (Py_ssize_t)sizeof(pytricia_pickled_node_t) != PyBytes_Size(nodebytes) || 
+        num_nodes > UINT32_MAX) {
+        PyErr_SetString(PyExc_TypeError, "__setstate__ node and data list sizes inconsistent!");
+        return NULL;
+    }
+    if (num_nodes == 0) {
+        return NULL;
+    }
+    Py_ssize_t num_entries = 0;
+    for (Py_ssize_t i = 0; i < num_nodes; i++) {
+        num_entries += PyList_GET_ITEM(list, i) != Py_None;
+    }
+    patricia_frozen_t *block = patricia_frozen_new((u_int)num_nodes, (u_int)num_entries);
+    uint32_t *order = malloc(num_nodes * sizeof(uint32_t));
+    if (!block || !order) {
+        free(block);
+        free(order);
+        PyErr_SetString(PyExc_MemoryError, "__setstate__ error allocating space for nodes");
+        return NULL;
+    }
+
+    const char *pickled = PyBytes_AsString(nodebytes);
+    uintptr_t base = (uintptr_t)tree->head;
+    int ok = 1;
+    for (Py_ssize_t i = 0; i < num_nodes && ok; i++) {
+        pytricia_pickled_node_t node;
+        memcpy(&node, pickled + i * sizeof(node), sizeof(node));
+        u_int bit = node.bit;
+        if (old_nodes) {
+            memcpy(&bit, pickled + i * sizeof(node), sizeof(bit));
+        }
+        block->nodes[i].bit = (uint16_t)bit;
+        ok = bit <= tree->maxbits;
+        // the links, relative to the root, become indexes + 1
+        char *link[2] = {node.l, node.r};
+        uint32_t *child[2] = {&block->nodes[i].l, &block->nodes[i].r};
+        for (int j = 0; j < 2 && ok; j++) {
+            uintptr_t offset = (uintptr_t)link[j] - base;
+            if (link[j]) {
+                ok = offset % sizeof(node) == 0 && offset / sizeof(node) < (uintptr_t)num_nodes;
+                *child[j] = ok ? (uint32_t)(offset / sizeof(node)) + 1 : 0;
+            }
+        }
+    }
+    // the values come in walk order
+    if (ok && (ok = _pytricia_check_block(block, tree->maxbits))) {
+        size_t count = _pytricia_preorder(block->nodes, order);
+        assert (count == (size_t)num_nodes);
+        u_int entry = 0;
+        for (size_t k = 0; k < count; k++) {
+            PyObject *data = PyList_GET_ITEM(list, k);
+            if (data == Py_None) {
+                continue;  // a glue node
+            }
+            pytricia_pickled_node_t node;
+            memcpy(&node, pickled + order[k] * sizeof(node), sizeof(node));
+            block->entries[entry].prefix = node.prefix;
+            block->entries[entry].data = data;
+            Py_INCREF(data);
+            block->nodes[order[k]].entry = ++entry;
+        }
+    }
+    free(order);
+    if (!ok) {
+        free(block);
+        PyErr_SetString(PyExc_TypeError, "__setstate__ nodes are not a tree");
+        return NULL;
+    }
+    return block;
+}
+
+static PyObject* _pytricia_setstate(PyTricia *self, PyObject *state) {
+    if (!PyDict_Check(state)) {
+      PyErr_SetString(PyExc_TypeError, "__setstate__ argument must be a dictionary");
+      return NULL;
+    }
+    if (!_pytricia_check_no_readers(self)) {
+        return NULL;
+    }
+    if (self->m_snapshot) {
+        PyErr_SetString(PyExc_ValueError, "can not modify a pytricia snapshot");
+        return NULL;
+    }
+
+    // trees pickled before frozen trees were kept as blocks of hot nodes
+    // and entries end at block, those pickled before lookup engines were
+    // added at engine_data, and those pickled before snapshots at unshare_fn
+    PyObject* bytes = PyDict_GetItemString(state, "tree");
+    if (!bytes || !PyBytes_Check(bytes) || 
+        (PyBytes_Size(bytes) != sizeof(patricia_tree_t) && 
+         PyBytes_Size(bytes) != offsetof(patricia_tree_t, block) &&
+         PyBytes_Size(bytes) != offsetof(patricia_tree_t, unshare_fn) &&
+         PyBytes_Size(bytes) != offsetof(patricia_tree_t, engine_data))) {
+      PyErr_SetString(PyExc_TypeError, "__setstate__ failed tree type checking");
+      return NULL;
+    }
+    int old_block = PyBytes_Size(bytes) != sizeof(patricia_tree_t);
+    // nodes pickled before snapshots have a u_int bit and no version
+    int old_nodes = old_block && PyBytes_Size(bytes) != offsetof(patricia_tree_t, block);
+    // the restored tree is put together aside and only then replaces the
+    // current one, which lookups may be reading without the GIL
+    patricia_tree_t tree;
+    memset(&tree, 0, sizeof(tree));
+    memcpy(&tree, PyBytes_AsString(bytes), PyBytes_Size(bytes));
+    // any compiled engine has to be rebuilt from the restored block
+    int engine = tree.engine;
+    if (tree.maxbits > PATRICIA_MAXBITS || engine > PATRICIA_ENGINE_POPTRIE || 
+        (engine == PATRICIA_ENGINE_DIR24 && tree.maxbits != 32)) {
+      PyErr_SetString(PyExc_TypeError, "__setstate__ failed tree type checking");
+      return NULL;
     }
-    patricia_node_t *node = patricia_lookup(self->m_tree, &prefix);
     
-    if (!node) {
-        PyErr_SetString(PyExc_ValueError, "Error inserting into patricia tree");
-        return -1;
+    PyObject* nodebytes = PyDict_GetItemString(state, "nodes");
+    if (!nodebytes || !PyBytes_Check(nodebytes)) {
+        PyErr_SetString(PyExc_TypeError, "__setstate__ failed nodes type checking");
+        return NULL;
+    }
+    PyObject* list = PyDict_GetItemString(state, "data");
+    if (!list || !PyList_Check(list)) {
+        PyErr_SetString(PyExc_TypeError, "__setstate__ data is not list as expected!");
+        return NULL;
+    }
+    patricia_frozen_t *block = old_block ? _pytricia_unpickle_nodes(&tree, old_nodes, nodebytes, list) :
+                                           _pytricia_unpickle_block(&tree, state, nodebytes, list);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    void *engine_data;
+    if (!_pytricia_compile_engine(tree.maxbits, block, engine, &engine_data)) {
+        _pytricia_release_owned(block, 1);
+        return PyErr_NoMemory();
     }
 
-    // node already existed, lower ref count on old data 
-    if (node->data) {
-        PyObject* data = (PyObject*)node->data;
-        Py_DECREF(data);
+    _pytricia_retire_engine(self);
+    self->m_tree->maxbits = tree.maxbits;
+    self->m_tree->num_active_node = block ? (int)block->num_nodes : 0;
+    self->m_tree->frozen = 1;
+    if (block) {
+        block->version = self->m_tree->version;
     }
+    _pytricia_set_root(self->m_tree, NULL, block);
+    patricia_engine_attach(self->m_tree, engine, engine_data);
+    self->m_generation++;
 
-    Py_INCREF(value);
-    node->data = value;
+    Py_RETURN_NONE;
+}
 
-    return 0;
+static PyObject* pytricia_setstate(PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *state;
+    if (!_pytricia_unpack("__setstate__", args, nargs, 1, 1, &state)) {
+        return NULL;
+    }
+    PyObject *rv;
+    PYTRICIA_BEGIN_LOCKED(self)
+    rv = _pytricia_setstate(self, state);
+    _pytricia_reclaim(self);
+    PYTRICIA_END_LOCKED
+    return rv;
 }
 
-static int 
-pytricia_assign_subscript(PyTricia *self, PyObject *key, PyObject *value) {
-    return _pytricia_assign_subscript_internal(self, key, value, -1);
+// whether snapshots of the tree are still around
+static int
+_pytricia_has_snapshots(PyTricia *self) {
+    Py_ssize_t refs = 0;
+    if (self->m_shared) {
+        PYTRICIA_LOCK(self->m_shared->lock);
+        refs = self->m_shared->refs;
+        PYTRICIA_UNLOCK(self->m_shared->lock);
+    }
+    return refs > 1;
 }
 
+// exchange what two trees hold.  the tree structs stay with their objects,
+// as iterators refer to them.  a lookup already running on either may
+// finish on the contents it started with, so what each tree frees from
+// now on is held back until such lookups on the other are done.
 static PyObject*
-pytricia_insert(PyTricia *self, PyObject *args) {
-    PyObject *key = NULL;
-    PyObject *value1 = NULL;
-    PyObject *value2 = NULL;
-    PyObject *rhs = NULL;
+_pytricia_swap_contents(PyTricia *self, PyTricia *other) {
+    PyTricia *both[2] = {self, other};
+    for (int i = 0; i < 2; i++) {
+        if (!_pytricia_check_no_readers(both[i])) {
+            return NULL;
+        }
+        if (both[i]->m_snapshot) {
+            PyErr_SetString(PyExc_ValueError, "can not modify a pytricia snapshot");
+            return NULL;
+        }
+        if (_pytricia_has_snapshots(both[i])) {
+            PyErr_SetString(PyExc_ValueError, "can not swap the contents of a pytricia that has snapshots");
+            return NULL;
+        }
+        if (!_pytricia_check_no_iterators(both[i], "swap the contents of")) {
+            return NULL;
+        }
+    }
+    if (self->m_tree->maxbits != other->m_tree->maxbits) {
+        PyErr_SetString(PyExc_ValueError, "can only swap contents with a pytricia of the same maximum bits");
+        return NULL;
+    }
+    if (!_pytricia_ebr_reserve(self->m_ebr) || !_pytricia_ebr_reserve(other->m_ebr)) {
+        return PyErr_NoMemory();
+    }
 
-    if (!PyArg_ParseTuple(args, "O|OO", &key, &value1, &value2)) { 
-        PyErr_SetString(PyExc_ValueError, "Invalid argument(s) to insert");
+    int engine[2];
+    void *engine_data[2];
+    for (int i = 0; i < 2; i++) {
+        patricia_tree_t *tree = both[i]->m_tree;
+        // with its snapshots gone, nothing is kept and no node is shared
+        if (both[i]->m_shared) {
+            _pytricia_shared_free(both[i]);
+            tree->unshare_fn = NULL;
+            tree->unshare_arg = NULL;
+            tree->shared_version = 0;
+        }
+        engine_data[i] = patricia_engine_detach(tree, &engine[i]);
+    }
+    patricia_tree_t *a = self->m_tree;
+    patricia_tree_t *b = other->m_tree;
+    patricia_node_t *head = a->head;
+    patricia_frozen_t *block = a->block;
+    _pytricia_set_root(a, b->head, b->block);
+    _pytricia_set_root(b, head, block);
+    int num_active_node = a->num_active_node;
+    a->num_active_node = b->num_active_node;
+    b->num_active_node = num_active_node;
+    int frozen = a->frozen;
+    a->frozen = b->frozen;
+    b->frozen = frozen;
+    u_short version = a->version;
+    a->version = b->version;
+    b->version = version;
+    PYTRICIA_ATOMIC_FENCE();
+    _pytricia_ebr_watch(self->m_ebr, other->m_ebr);
+    _pytricia_ebr_watch(other->m_ebr, self->m_ebr);
+    patricia_engine_attach(a, engine[1], engine_data[1]);
+    patricia_engine_attach(b, engine[0], engine_data[0]);
+
+    // kept keys are in the output format of the tree that made them
+    if (self->m_raw_output != other->m_raw_output) {
+        _pytricia_clear_node_keys(self);
+        _pytricia_clear_node_keys(other);
+    }
+    self->m_generation++;
+    other->m_generation++;
+    _pytricia_reclaim(self);
+    _pytricia_reclaim(other);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_swap_contents(register PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *other = NULL;
+    if (!_pytricia_unpack("swap_contents", args, nargs, 1, 1, &other)) {
         return NULL;
     }
+    if (!PyObject_TypeCheck(other, &PyTriciaType)) {
+        PyErr_SetString(PyExc_TypeError, "swap_contents() argument must be a pytricia");
+        return NULL;
+    }
+    if (other == (PyObject*)self) {
+        Py_RETURN_NONE;
+    }
+    PyObject *rv;
+    PYTRICIA_BEGIN_LOCKED2(self, other)
+    rv = _pytricia_swap_contents(self, (PyTricia*)other);
+    PYTRICIA_END_LOCKED2
+    return rv;
+}
 
-    if (value1) {
-        long prefixlen = -1;
-        if (value2 == NULL) {
-            rhs = value1;
-        } else {
-            rhs = value2;
+// build_async() collects the prefixes and values with the GIL, then
+// builds and freezes the tree on a thread of its own.  string keys are
+// parsed there too; other keys (ints, bytes, ipaddress objects) need
+// Python to convert and are parsed up front.
+typedef struct {
+    const char *str;                  // a string key, still to be parsed
+    Py_ssize_t len;
+    prefix_t prefix;                  // otherwise, the key parsed already
+    PyObject *key;
+    PyObject *value;
+} pytricia_build_item_t;
+
+typedef struct {
+    pytricia_build_item_t *items;
+    Py_ssize_t count;
+    Py_ssize_t size;
+} pytricia_build_items_t;
+
+#define PYTRICIA_BUILD_OK 0
+#define PYTRICIA_BUILD_INVALID 1      // a key could not be parsed
+#define PYTRICIA_BUILD_INSERT 2       // or inserted
+#define PYTRICIA_BUILD_MEMORY 3
+#define PYTRICIA_BUILD_TOO_LONG 4     // a prefix longer than maxbits, see from_sorted
+
+typedef struct {
+    PyObject_HEAD
+    PyTricia *m_result;               // the tree being built
+    pytricia_build_items_t m_items;
+    int m_engine;
+    int m_layout;
+    int m_error;                      // PYTRICIA_BUILD_*
+    Py_ssize_t m_bad;                 // the item that failed
+    PyObject *m_bad_key;
+    int m_threaded;
+    pytricia_thread_t m_thread;
+    volatile long m_done;
+    volatile long m_joining;
+    volatile long m_joined;
+} PyTriciaBuild;
+
+// parse the string keys, which needs no GIL; returns the index of the
+// first invalid one, or -1
+static Py_ssize_t
+_pytricia_parse_items(pytricia_build_items_t *items) {
+    for (Py_ssize_t i = 0; i < items->count; i++) {
+        pytricia_build_item_t *item = &items->items[i];
+        if (item->str && _string_to_prefix(item->str, item->len, &item->prefix) <= 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// runs without the GIL; the tree is not reachable from Python meanwhile
+static void
+_pytricia_build_main(void *arg) {
+    PyTriciaBuild *build = (PyTriciaBuild*)arg;
+    PyTricia *tree = build->m_result;
+    build->m_bad = _pytricia_parse_items(&build->m_items);
+    if (build->m_bad >= 0) {
+        build->m_error = PYTRICIA_BUILD_INVALID;
+    }
+    for (Py_ssize_t i = 0; i < build->m_items.count && !build->m_error; i++) {
+        pytricia_build_item_t *item = &build->m_items.items[i];
+        patricia_node_t *node = patricia_lookup(tree->m_tree, &item->prefix);
+        if (!node) {
+            build->m_error = PYTRICIA_BUILD_INSERT;
+            build->m_bad = i;
+            break;
+        }
+        // a later duplicate wins; the item is left holding what it replaced
+        void *old = node->data;
+        node->data = item->value;
+        item->value = (PyObject*)old;
+    }
+    if (build->m_error == PYTRICIA_BUILD_OK) {
+        tree->m_generation++;
+        if (!_pytricia_compact(tree, build->m_layout, build->m_engine)) {
+            build->m_error = PYTRICIA_BUILD_MEMORY;
+        }
+    }
+    PYTRICIA_ATOMIC_SET(build->m_done, 1);
+}
+
+// wait for the build thread.  the first caller joins it; any other waits
+// for that, both with the GIL released.
+static void
+_pytricia_build_wait(PyTriciaBuild *build) {
+    if (!build->m_threaded) {
+        return;
+    }
+    if (PYTRICIA_ATOMIC_ADD(build->m_joining, 1) == 1) {
+        Py_BEGIN_ALLOW_THREADS
+        _pytricia_thread_join(build->m_thread);
+        Py_END_ALLOW_THREADS
+        PYTRICIA_ATOMIC_SET(build->m_joined, 1);
+    } else if (!PYTRICIA_ATOMIC_GET(build->m_joined)) {
+        Py_BEGIN_ALLOW_THREADS
+        while (!PYTRICIA_ATOMIC_GET(build->m_joined)) {
+            _pytricia_thread_sleep();
+        }
+        Py_END_ALLOW_THREADS
+    }
+}
+
+// drop what the items hold: once in a tree, only the values replaced by
+// duplicates are left to them
+static void
+_pytricia_free_items(pytricia_build_items_t *items) {
+    for (Py_ssize_t i = 0; i < items->count; i++) {
+        Py_XDECREF(items->items[i].key);
+        Py_XDECREF(items->items[i].value);
+    }
+    free(items->items);
+    memset(items, 0, sizeof(pytricia_build_items_t));
+}
+
+// drop the items once the build is over
+static void
+_pytricia_build_clear(PyTriciaBuild *build) {
+    if (build->m_error != PYTRICIA_BUILD_OK && build->m_bad >= 0 && !build->m_bad_key) {
+        build->m_bad_key = build->m_items.items[build->m_bad].key;
+        Py_INCREF(build->m_bad_key);
+    }
+    _pytricia_free_items(&build->m_items);
+}
+
+// raise the error a build ran into with the given key
+static void
+_pytricia_build_error(int error, PyObject *key) {
+    switch (error) {
+    case PYTRICIA_BUILD_INVALID:
 #if PY_MAJOR_VERSION == 3
-            if (PyLong_Check(value1)) {
-                prefixlen = PyLong_AsLong(value1);
-            }
-#else // python2
-            if (PyLong_Check(value1) || PyInt_Check(value1)) {
-                prefixlen  = PyInt_AsLong(value1);
+        PyErr_Format(PyExc_ValueError, "Invalid prefix %R", key);
+#else
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+#endif
+        break;
+    case PYTRICIA_BUILD_TOO_LONG:
+#if PY_MAJOR_VERSION == 3
+        PyErr_Format(PyExc_ValueError, "Prefix %R is longer than the maximum bits of the tree", key);
+#else
+        PyErr_SetString(PyExc_ValueError, "Prefix is longer than the maximum bits of the tree");
+#endif
+        break;
+    case PYTRICIA_BUILD_INSERT:
+        PyErr_SetString(PyExc_ValueError, "Error inserting into patricia tree");
+        break;
+    default:
+        PyErr_NoMemory();
+        break;
+    }
+}
+
+static PyObject*
+_pytricia_build_result(PyTriciaBuild *self) {
+    _pytricia_build_clear(self);
+    if (self->m_error != PYTRICIA_BUILD_OK) {
+        _pytricia_build_error(self->m_error, self->m_bad_key);
+        Py_CLEAR(self->m_result);
+        return NULL;
+    }
+    _pytricia_reclaim(self->m_result);
+    Py_INCREF(self->m_result);
+    return (PyObject*)self->m_result;
+}
+
+static PyObject*
+pytricia_build_result(PyTriciaBuild *self, PyObject *unused) {
+    _pytricia_build_wait(self);
+    PyObject *rv;
+    PYTRICIA_BEGIN_LOCKED(self)
+    rv = _pytricia_build_result(self);
+    PYTRICIA_END_LOCKED
+    return rv;
+}
+
+static PyObject*
+pytricia_build_done(PyTriciaBuild *self, PyObject *unused) {
+    return PyBool_FromLong(PYTRICIA_ATOMIC_GET(self->m_done));
+}
+
+static void
+pytricia_build_dealloc(PyTriciaBuild *self) {
+    _pytricia_build_wait(self);
+    _pytricia_build_clear(self);
+    Py_XDECREF(self->m_result);
+    Py_XDECREF(self->m_bad_key);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyMethodDef pytricia_build_methods[] = {
+    {"done", (PyCFunction)pytricia_build_done, METH_NOARGS, "done() -> boolean\nReturn true once the tree is built and frozen."},
+    {"result", (PyCFunction)pytricia_build_result, METH_NOARGS, "result() -> pytricia\nWait for the build, with the GIL released, and return the frozen tree.\nRaises the error the build ran into, such as a ValueError for an invalid prefix."},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PyTypeObject PyTriciaBuildType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pytricia.PyTriciaBuild",               /* tp_name */
+    sizeof(PyTriciaBuild),                  /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    /* methods */
+    (destructor)pytricia_build_dealloc,     /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    "A pytricia being built by build_async()", /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    pytricia_build_methods,                 /* tp_methods */
+};
+
+// take the (prefix, value) pairs of source, or of source.items(), for
+// tree.  string keys are left to _pytricia_parse_items.
+static int
+_pytricia_collect_items(PyTricia *tree, PyObject *source, pytricia_build_items_t *items) {
+    PyObject *pairs;
+    if (PyObject_HasAttrString(source, "items")) {
+        pairs = PyObject_CallMethod(source, "items", NULL);
+    } else {
+        Py_INCREF(source);
+        pairs = source;
+    }
+    if (!pairs) {
+        return 0;
+    }
+    PyObject *iter = PyObject_GetIter(pairs);
+    Py_DECREF(pairs);
+    if (!iter) {
+        return 0;
+    }
+    PyObject *pair;
+    while ((pair = PyIter_Next(iter))) {
+        PyObject *seq = PySequence_Fast(pair, "expected (prefix, value) pairs");
+        Py_DECREF(pair);
+        if (!seq) {
+            break;
+        }
+        if (PySequence_Fast_GET_SIZE(seq) != 2) {
+            Py_DECREF(seq);
+            PyErr_SetString(PyExc_TypeError, "expected (prefix, value) pairs");
+            break;
+        }
+        if (items->count == items->size) {
+            Py_ssize_t size = items->size ? items->size * 2 : 256;
+            pytricia_build_item_t *grown = realloc(items->items, size * sizeof(pytricia_build_item_t));
+            if (!grown) {
+                Py_DECREF(seq);
+                PyErr_NoMemory();
+                break;
             }
+            items->items = grown;
+            items->size = size;
+        }
+        pytricia_build_item_t *item = &items->items[items->count];
+        memset(item, 0, sizeof(pytricia_build_item_t));
+        PyObject *key = PySequence_Fast_GET_ITEM(seq, 0);
+        PyObject *value = PySequence_Fast_GET_ITEM(seq, 1);
+        int ok = 1;
+#if PY_MAJOR_VERSION == 3
+        if (PyUnicode_Check(key)) {
+            item->str = PyUnicode_AsUTF8AndSize(key, &item->len);
+            ok = item->str != NULL;
+        } else
 #endif
+        if (!_key_object_to_prefix(key, &item->prefix, _pytricia_int_family(tree))) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+            }
+            ok = 0;
         }
-        int rv = _pytricia_assign_subscript_internal(self, key, rhs, prefixlen); 
-        if (rv == -1) {
-            PyErr_SetString(PyExc_ValueError, "Invalid key.");
-            return NULL;
+        if (!ok) {
+            Py_DECREF(seq);
+            break;
         }
-    } else {
-        PyErr_SetString(PyExc_ValueError, "Missing argument(s) to insert");
-        return NULL;
+        Py_INCREF(key);
+        Py_INCREF(value);
+        item->key = key;
+        item->value = value;
+        items->count++;
+        Py_DECREF(seq);
     }
-
-    Py_RETURN_NONE;
+    Py_DECREF(iter);
+    return !PyErr_Occurred();
 }
 
-static PyObject*
-pytricia_delitem(PyTricia *self, PyObject *args) {
-    PyObject *key = NULL;
-    if (!PyArg_ParseTuple(args, "O", &key)) {
+// the empty tree for build_async() or from_sorted(), made by calling cls
+// with the arguments after the source, and the engine and layout keywords
+static PyTricia*
+_pytricia_build_target(PyObject *cls, PyObject *args, PyObject *kwds, const char *format, int *engine, int *layout) {
+    static char *kwlist[] = {"engine", "layout", NULL};
+    const char *engine_name = NULL;
+    const char *layout_name = NULL;
+    Py_ssize_t nargs = PyTuple_GET_SIZE(args);
+    if (nargs < 1) {
+        PyErr_Format(PyExc_TypeError, "%s() takes a source of (prefix, value) pairs", strchr(format, ':') + 1);
         return NULL;
     }
-    
-    int rv = pytricia_internal_delete(self, key);
-    if (rv < 0) {
-        return NULL;
-    } 
-    Py_RETURN_NONE;
-}
-
-static PyObject *
-pytricia_get(register PyTricia *obj, PyObject *args) {
-    PyObject *key = NULL;
-    PyObject *defvalue = NULL;
-
-    if (!PyArg_ParseTuple(args, "O|O:get", &key, &defvalue)) {
+    PyObject *empty = PyTuple_New(0);
+    if (!empty) {
         return NULL;
     }
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+    int ok = PyArg_ParseTupleAndKeywords(empty, kwds, format, kwlist, &engine_name, &layout_name);
+    Py_DECREF(empty);
+    if (!ok) {
         return NULL;
     }
-    patricia_node_t* node = patricia_search_best(obj->m_tree, &prefix);
-
-    if (!node) {
-        if (defvalue) {
-            Py_INCREF(defvalue);
-            return defvalue;
-        }
-        Py_RETURN_NONE;
-    }
-
-    PyObject* data = (PyObject*)node->data;
-    Py_INCREF(data);
-    return data;
-}
-
-static PyObject *
-pytricia_get_key(register PyTricia *obj, PyObject *args) {
-    PyObject *key = NULL;
-
-    if (!PyArg_ParseTuple(args, "O", &key)) {
+    *layout = _pytricia_layout_from_name(layout_name);
+    if (*layout < 0) {
         return NULL;
     }
 
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+    // the rest of the arguments are for the constructor
+    PyObject *ctor_args = PyTuple_GetSlice(args, 1, nargs);
+    if (!ctor_args) {
         return NULL;
     }
-    patricia_node_t* node = patricia_search_best(obj->m_tree, &prefix);
-
-    if (!node) {
-        Py_RETURN_NONE;
-    }
-
-    return _prefix_to_key_object(&node->prefix, obj->m_raw_output);
-}
-
-static int
-pytricia_contains(PyTricia *self, PyObject *key) {
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        return -1;
-    }
-    patricia_node_t* node = patricia_search_best(self->m_tree, &prefix);
-    if (node) {
-        return 1;
-    }
-    return 0;
-}
-
-static PyObject*
-pytricia_has_key(PyTricia *self, PyObject *args) {
-    PyObject *key = NULL;
-    if (!PyArg_ParseTuple(args, "O", &key))
-        return NULL;
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+    PyObject *tree = PyObject_Call(cls, ctor_args, NULL);
+    Py_DECREF(ctor_args);
+    if (!tree) {
         return NULL;
     }
-    patricia_node_t* node = patricia_search_exact(self->m_tree, &prefix);
-    if (node) {
-        Py_RETURN_TRUE;
+    if (!PyObject_TypeCheck(tree, &PyTriciaType) || ((PyTricia*)tree)->m_tree->head
+        || ((PyTricia*)tree)->m_tree->block) {
+        Py_DECREF(tree);
+        PyErr_Format(PyExc_TypeError, "%s() must make an empty pytricia", strchr(format, ':') + 1);
+        return NULL;
     }
-    Py_RETURN_FALSE;
-}
-
-static PyObject* 
-pytricia_keys(register PyTricia *self, PyObject *unused) {
-    register PyObject *rvlist = PyList_New(0);
-    if (!rvlist) {
+    *engine = _pytricia_engine_from_name((PyTricia*)tree, engine_name);
+    if (*engine < 0) {
+        Py_DECREF(tree);
         return NULL;
     }
-    
-    patricia_node_t *node = NULL;
-    int err = 0;
-    
-    PATRICIA_WALK (self->m_tree->head, node) {
-        PyObject *item = _prefix_to_key_object(&node->prefix, self->m_raw_output);
-        if (!item) {
-            Py_DECREF(rvlist);
-            return NULL;
-        }
-        err = PyList_Append(rvlist, item);
-        Py_DECREF(item);
-        if (err != 0) {
-            Py_DECREF(rvlist);
-            return NULL;
-        }
-    } PATRICIA_WALK_END;
-    return rvlist;
+    return (PyTricia*)tree;
 }
 
 static PyObject*
-pytricia_children(register PyTricia *self, PyObject *args) {
-    PyObject *key = NULL;
-
-    if (!PyArg_ParseTuple(args, "O", &key)) {
+pytricia_build_async(PyObject *cls, PyObject *args, PyObject *kwds) {
+    int engine, layout;
+    PyTricia *tree = _pytricia_build_target(cls, args, kwds, "|zz:build_async", &engine, &layout);
+    if (!tree) {
         return NULL;
     }
 
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+    PyTriciaBuild *build = PyObject_New(PyTriciaBuild, &PyTriciaBuildType);
+    if (!build) {
+        Py_DECREF(tree);
         return NULL;
     }
-
-    register PyObject *rvlist = PyList_New(0);
-    if (!rvlist) {
+    build->m_result = tree;
+    memset(&build->m_items, 0, sizeof(pytricia_build_items_t));
+    build->m_engine = engine;
+    build->m_layout = layout;
+    build->m_error = PYTRICIA_BUILD_OK;
+    build->m_bad = -1;
+    build->m_bad_key = NULL;
+    build->m_threaded = 0;
+    build->m_done = build->m_joining = build->m_joined = 0;
+    if (!_pytricia_collect_items(tree, PyTuple_GET_ITEM(args, 0), &build->m_items)) {
+        Py_DECREF(build);
         return NULL;
     }
 
-    patricia_node_t* base_node = patricia_search_exact(self->m_tree, &prefix);
-    if (!base_node) {
-       PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
-       Py_DECREF(rvlist);
-       return NULL;
+    if (_pytricia_thread_start(&build->m_thread, _pytricia_build_main, build) == 0) {
+        build->m_threaded = 1;
+    } else {
+        // no thread to be had: build it now
+        Py_BEGIN_ALLOW_THREADS
+        _pytricia_build_main(build);
+        Py_END_ALLOW_THREADS
     }
-    patricia_node_t* node = NULL;
-    int err = 0;
-
-    PATRICIA_WALK (base_node, node) {
-        /* Discard first prefix (we want strict children) */
-        if (node != base_node) {
-            PyObject *item = _prefix_to_key_object(&node->prefix, self->m_raw_output);
-            if (!item) {
-                Py_DECREF(rvlist);
-                return NULL;
-            }
-            err = PyList_Append(rvlist, item);
-            Py_DECREF(item);
-            if (err != 0) {
-                Py_DECREF(rvlist);
-                return NULL;
-            }
-        }
-    } PATRICIA_WALK_END;
-    return rvlist;
+    return (PyObject*)build;
 }
 
-static PyObject*
-pytricia_parent(register PyTricia *self, PyObject *args) {
-    PyObject *key = NULL;
+// from_sorted() lays out the frozen block directly.  adding prefixes in
+// keys() order (by address, each before the prefixes it contains) only
+// ever changes the rightmost path of the trie, so its shape is made in
+// one pass with that path on a stack, then copied out in preorder.
+typedef struct {
+    Py_ssize_t l, r;                  // children, or -1
+    Py_ssize_t item;                  // in sorted, or -1 for a glue node
+    u_short bit;
+} pytricia_shape_t;
 
-    if (!PyArg_ParseTuple(args, "O", &key)) {
-        return NULL;
+// the keys() order of two prefixes: <0, 0 for the same prefix, or >0
+static int
+_pytricia_prefix_order(prefix_t *a, prefix_t *b) {
+    u_int limit = a->bitlen < b->bitlen ? a->bitlen : b->bitlen;
+    const u_char *x = prefix_touchar(a);
+    u_int differ = patricia_differ_bit(x, prefix_touchar(b), limit);
+    if (differ < limit) {
+        return BIT_TEST(x[differ >> 3], 0x80 >> (differ & 0x07)) ? 1 : -1;
     }
+    return (a->bitlen > b->bitlen) - (a->bitlen < b->bitlen);
+}
 
-    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
-    int ret_ok = _key_object_to_prefix(key, &prefix);
-    if (!ret_ok) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
-        return NULL;
-    }
+// for qsort, on pointers into one array of items: equal prefixes keep
+// their order, so the last value for one still wins
+static int
+_pytricia_compare_items(const void *a, const void *b) {
+    pytricia_build_item_t *x = *(pytricia_build_item_t * const *)a;
+    pytricia_build_item_t *y = *(pytricia_build_item_t * const *)b;
+    int order = _pytricia_prefix_order(&x->prefix, &y->prefix);
+    return order ? order : (x > y) - (x < y);
+}
 
-    patricia_node_t* node = patricia_search_exact(self->m_tree, &prefix);
-    if (!node) {
-	   PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
-	   return NULL;
+// make a frozen block of the count distinct prefixes in sorted, taking
+// their values; returns 0 when out of memory.  needs no GIL.
+static int
+_pytricia_build_sorted(patricia_tree_t *tree, pytricia_build_item_t **sorted, Py_ssize_t count) {
+    tree->frozen = 1;
+    if (count == 0) {
+        return 1;
     }
-    patricia_node_t* parent_node = patricia_search_best2(self->m_tree, &node->prefix, 0);
-    if (!parent_node) {
-        Py_RETURN_NONE;
+    pytricia_shape_t *shape = malloc((2 * count - 1) * sizeof(pytricia_shape_t));
+    if (!shape) {
+        return 0;
     }
-
-    return _prefix_to_key_object(&parent_node->prefix, self->m_raw_output);
-}
-
-static PyObject*
-pytricia_freeze(register PyTricia *self, PyObject *unused) {
-    if (self->m_tree->frozen) {
-        Py_RETURN_NONE;
+    // the rightmost path; its bits go up from the root, so it is short
+    Py_ssize_t path[PATRICIA_MAXBITS + 2];
+    int depth = 0;
+    Py_ssize_t nshape = 0, root = 0;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        prefix_t *prefix = &sorted[i]->prefix;
+        Py_ssize_t node = nshape++;
+        shape[node].l = shape[node].r = -1;
+        shape[node].item = i;
+        shape[node].bit = prefix->bitlen;
+        if (i > 0) {
+            // where this prefix parts from the previous one
+            prefix_t *last = &sorted[i - 1]->prefix;
+            const u_char *addr = prefix_touchar(prefix);
+            u_int limit = prefix->bitlen < last->bitlen ? prefix->bitlen : last->bitlen;
+            u_int differ = patricia_differ_bit(addr, prefix_touchar(last), limit);
+            Py_ssize_t below = -1;
+            while (depth > 0 && shape[path[depth - 1]].bit > differ) {
+                below = path[--depth];
+            }
+            if (depth > 0 && shape[path[depth - 1]].bit == differ) {
+                // a prefix on the path contains this one
+                Py_ssize_t parent = path[depth - 1];
+                if (BIT_TEST(addr[differ >> 3], 0x80 >> (differ & 0x07))) {
+                    shape[parent].r = node;
+                } else {
+                    shape[parent].l = node;
+                }
+            } else {
+                // the two part where no prefix ends: a glue node takes
+                // the earlier ones on its left and this one on its right
+                Py_ssize_t glue = nshape++;
+                shape[glue].l = below;
+                shape[glue].r = node;
+                shape[glue].item = -1;
+                shape[glue].bit = differ;
+                if (depth == 0) {
+                    root = glue;
+                } else if (shape[path[depth - 1]].r == below) {
+                    shape[path[depth - 1]].r = glue;
+                } else {
+                    shape[path[depth - 1]].l = glue;
+                }
+                path[depth++] = glue;
+            }
+        }
+        path[depth++] = node;
     }
 
-    patricia_node_t *node = NULL;
-
-    // Get count of all nodes
-    size_t count = 0;
-    PATRICIA_WALK_ALL (self->m_tree->head, node) {
-        count += 1;
-    } PATRICIA_WALK_END;
-
-    // allocate contiguous space for all nodes
-    patricia_node_t* new_node = calloc(count, sizeof(patricia_node_t));
-
-    // copy all nodes to new array and discard originals
-    size_t idx = 0;
-    patricia_node_t** free_list = calloc(count, sizeof(patricia_node_t*));
-    PATRICIA_WALK_ALL (self->m_tree->head, node) {
-        new_node[idx] = *node;
-        if(node->l)
-            node->l->parent = &(new_node[idx]);
-        if(node->r)
-            node->r->parent = &(new_node[idx]);
-        if(node->parent == NULL) {
-            assert (self->m_tree->head == node);
-            self->m_tree->head = new_node;
-        }
-        else if (node->parent->r == node) {
-            node->parent->r = &(new_node[idx]);
-        }
-        else {
-            node->parent->l = &(new_node[idx]);
-        }
-        free_list[idx] = node;
+    patricia_frozen_t *block = patricia_frozen_new((u_int)nshape, (u_int)count);
+    if (!block) {
+        free(shape);
+        return 0;
+    }
+    struct {
+        Py_ssize_t shape;
+        uint32_t parent;              // index + 1, or 0 for the root
+        int right;
+    } todo[PATRICIA_MAXBITS + 2];
+    int ntodo = 1;
+    todo[0].shape = root;
+    todo[0].parent = 0;
+    todo[0].right = 0;
+    u_int idx = 0, entry = 0;
+    while (ntodo > 0) {
+        ntodo--;
+        pytricia_shape_t *from = &shape[todo[ntodo].shape];
+        patricia_hot_t *node = &block->nodes[idx];
+        node->bit = from->bit;
+        if (from->item >= 0) {
+            patricia_entry_t *e = &block->entries[entry++];
+            e->prefix = sorted[from->item]->prefix;
+            e->data = sorted[from->item]->value;
+            sorted[from->item]->value = NULL;
+            node->entry = entry;
+        }
+        if (todo[ntodo].parent && todo[ntodo].right) {
+            block->nodes[todo[ntodo].parent - 1].r = idx + 1;
+        } else if (todo[ntodo].parent) {
+            block->nodes[todo[ntodo].parent - 1].l = idx + 1;
+        }
+        if (from->r >= 0) {
+            todo[ntodo].shape = from->r;
+            todo[ntodo].parent = idx + 1;
+            todo[ntodo++].right = 1;
+        }
+        if (from->l >= 0) {
+            todo[ntodo].shape = from->l;
+            todo[ntodo].parent = idx + 1;
+            todo[ntodo++].right = 0;
+        }
         idx++;
-    } PATRICIA_WALK_END;
-
-    // clearing via free_list because otherise PATRICIA_WALK_END
-    // will illegally reference items from node to determine next steps
-    for(size_t i=0; i<count; i++) {
-        free(free_list[i]);
     }
-    free(free_list);
-
-    // mark as frozen
-    self->m_tree->frozen = 1;
-
-    Py_RETURN_NONE;
+    assert (entry == (u_int)count);
+    free(shape);
+    block->version = tree->version;
+    tree->block = block;
+    tree->num_active_node = (int)nshape;
+    return 1;
 }
 
-static PyObject*
-pytricia_thaw(register PyTricia *self, PyObject *unused) {
-    if (!self->m_tree->frozen) {
-        Py_RETURN_NONE;  // already thaw'd
+// parse, sort and lay out the items as the frozen tree, without the GIL.
+// returns a PYTRICIA_BUILD_* error, and the item it is about in *bad.
+static int
+_pytricia_from_items(PyTricia *self, pytricia_build_items_t *items, pytricia_build_item_t **sorted,
+                     int engine, int layout, Py_ssize_t *bad) {
+    *bad = _pytricia_parse_items(items);
+    if (*bad >= 0) {
+        return PYTRICIA_BUILD_INVALID;
     }
-    if (self->m_tree->head == NULL) {
-        self->m_tree->frozen = 0;
-        Py_RETURN_NONE;
+    int ordered = 1;
+    for (Py_ssize_t i = 0; i < items->count; i++) {
+        if (items->items[i].prefix.bitlen > self->m_tree->maxbits) {
+            *bad = i;
+            return PYTRICIA_BUILD_TOO_LONG;
+        }
+        sorted[i] = &items->items[i];
+        if (i > 0 && ordered) {
+            ordered = _pytricia_prefix_order(&sorted[i - 1]->prefix, &sorted[i]->prefix) <= 0;
+        }
     }
-    patricia_node_t* original_head = self->m_tree->head;
-
-    // walk all nodes, allocating heap space for individual
-    // nodes and re-linking
-    patricia_node_t *node = NULL;
-    PATRICIA_WALK_ALL (self->m_tree->head, node) {
-        patricia_node_t* new_node = calloc(1, sizeof(patricia_node_t));
-        *new_node = *node;
-        if(node->l)
-            node->l->parent = new_node;
-        if(node->r)
-            node->r->parent = new_node;
-        if(node->parent == NULL) {
-            assert (self->m_tree->head == node);
-            self->m_tree->head = new_node;
-        }
-        else if (node->parent->r == node) {
-            node->parent->r = new_node;
-        }
-        else {
-            node->parent->l = new_node;
+    if (!ordered) {
+        qsort(sorted, items->count, sizeof(pytricia_build_item_t*), _pytricia_compare_items);
+    }
+    // the last value for a prefix wins, as with inserts
+    Py_ssize_t count = 0;
+    for (Py_ssize_t i = 0; i < items->count; i++) {
+        if (count > 0 && _pytricia_prefix_order(&sorted[count - 1]->prefix, &sorted[i]->prefix) == 0) {
+            PyObject *value = sorted[count - 1]->value;
+            sorted[count - 1]->value = sorted[i]->value;
+            sorted[i]->value = value;
+        } else {
+            sorted[count++] = sorted[i];
         }
-    } PATRICIA_WALK_END;
-
-    free(original_head);
-
-    // mark as NOT frozen
-    self->m_tree->frozen = 0;
-
-    Py_RETURN_NONE;
+    }
+    if (!_pytricia_build_sorted(self->m_tree, sorted, count)) {
+        return PYTRICIA_BUILD_MEMORY;
+    }
+    self->m_generation++;
+    if (layout != PYTRICIA_LAYOUT_PREORDER ? !_pytricia_compact(self, layout, engine) : 
+        !patricia_engine_build(self->m_tree, engine)) {
+        return PYTRICIA_BUILD_MEMORY;
+    }
+    return PYTRICIA_BUILD_OK;
 }
 
-// forward declaration
-static PyTypeObject PyTriciaType;
-
-static PyObject* pytricia_reduce(PyTricia *self, PyObject *Py_UNUSED(ignored)) {
-    if (!self->m_tree->frozen) {
-        PyErr_SetString(PyExc_RuntimeError, "pytri must be frozen before attempting to pickle!");
+static PyObject*
+pytricia_from_sorted(PyObject *cls, PyObject *args, PyObject *kwds) {
+    int engine, layout;
+    PyTricia *tree = _pytricia_build_target(cls, args, kwds, "|zz:from_sorted", &engine, &layout);
+    if (!tree) {
         return NULL;
     }
-
-    PyObject *args = PyTuple_New(1);
-    if (!args) {
-      return NULL;
-    }
-    PyTuple_SET_ITEM(args, 0, PyLong_FromLong(self->m_tree->maxbits));
-
-    // setup the extra dictionary info for setstate
-    PyObject* dict = PyDict_New();
-    PyObject* bytes = PyBytes_FromStringAndSize((const char*)self->m_tree, sizeof(patricia_tree_t));
-
-    if (!dict || !bytes) {
-	    PyErr_SetString(PyExc_MemoryError, "unable to allocate space for tri");
-        Py_XDECREF(dict);
-        Py_XDECREF(bytes);
+    pytricia_build_items_t items;
+    memset(&items, 0, sizeof(pytricia_build_items_t));
+    pytricia_build_item_t **sorted = NULL;
+    if (!_pytricia_collect_items(tree, PyTuple_GET_ITEM(args, 0), &items) ||
+        !(sorted = malloc((items.count ? items.count : 1) * sizeof(pytricia_build_item_t*)))) {
+        if (!PyErr_Occurred()) {
+            PyErr_NoMemory();
+        }
+        _pytricia_free_items(&items);
+        Py_DECREF(tree);
         return NULL;
     }
 
-    int ret_err = PyDict_SetItemString(dict, "tree", bytes);
-    Py_DECREF(bytes);  // dictionary now owns the reference
-    if(ret_err) {
-        PyErr_SetString(PyExc_MemoryError, "error writing tree_t to dictionary");
-        Py_DECREF(dict);
-        return NULL;
+    int error;
+    Py_ssize_t bad = -1;
+    Py_BEGIN_ALLOW_THREADS
+    error = _pytricia_from_items(tree, &items, sorted, engine, layout, &bad);
+    Py_END_ALLOW_THREADS
+    free(sorted);
+    if (error != PYTRICIA_BUILD_OK) {
+        _pytricia_build_error(error, bad >= 0 ? items.items[bad].key : NULL);
+        Py_CLEAR(tree);
+    } else {
+        _pytricia_reclaim(tree);
     }
+    _pytricia_free_items(&items);
+    return (PyObject*)tree;
+}
 
-    // Now set nodes internal block
-    patricia_node_t *node = NULL;
-    size_t count = 0;
-    PATRICIA_WALK_ALL (self->m_tree->head, node) {
-        count += 1;
-    } PATRICIA_WALK_END;
+// load_pfx2as() reads routeviews prefix-to-AS files ("addr<TAB>len<TAB>asn"
+// lines), gzipped or not, in chunks.  with zlib, a path is read with
+// gzread and gzip data from the read() method of a file object with
+// inflate; without it, gzip data is read through Python's gzip module.
+#define PYTRICIA_PFX2AS_CHUNK 65536
 
-    bytes = PyBytes_FromStringAndSize((const char*)self->m_tree->head, sizeof(patricia_node_t)*count);
-    ret_err = PyDict_SetItemString(dict, "nodes", bytes);
-    Py_DECREF(bytes);  // dictionary now owns the reference
-    if(ret_err) {
-        PyErr_SetString(PyExc_MemoryError, "error writing nodes to dictionary");
-        Py_DECREF(dict);
-        return NULL;
-    }
+typedef struct {
+#ifdef PYTRICIA_HAVE_ZLIB
+    gzFile gz;                        // a path opened with zlib
+    z_stream stream;
+    int ended;                        // the gzip data ended at a member's end
+#endif
+    PyObject *source;                 // the file object read from
+    PyObject *file;                   // a file opened for a path, closed at the end
+    PyObject *gzip;                   // a gzip.GzipFile over source, without zlib
+    PyObject *read;                   // the read method in use
+    PyObject *chunk;                  // the bytes from read() being used
+    const char *next;                 // the unused part of chunk
+    Py_ssize_t avail;
+    int inflating;                    // 1 for gzip data, -1 for plain, 0 before the first chunk
+    int eof;
+} pytricia_pfx2as_t;
 
-    PyObject* list = PyList_New(count);
-    if (!list) {
-        PyErr_SetString(PyExc_MemoryError, "error allocating data list");
-        return NULL;
+// decide from the first chunk how to read the data: gzip data starts
+// with 1f 8b, anything else is taken as text.  returns 0 with an error set.
+static int
+_pytricia_pfx2as_start(pytricia_pfx2as_t *reader) {
+    const u_char *head = (const u_char *)reader->next;
+    reader->inflating = -1;
+    if (head[0] != 0x1f || (reader->avail > 1 && head[1] != 0x8b)) {
+        return 1;
+    }
+#ifdef PYTRICIA_HAVE_ZLIB
+    if (inflateInit2(&reader->stream, 16 + MAX_WBITS) != Z_OK) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    reader->inflating = 1;
+    return 1;
+#else
+    // read it again from the start, through gzip.GzipFile
+    PyObject *rv = PyObject_CallMethod(reader->source, "seek", "ni", -reader->avail, 1);
+    if (!rv) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError, "pytricia was built without zlib, so gzip data must come from a path or a seekable file object");
+        return 0;
+    }
+    Py_DECREF(rv);
+    PyObject *module = PyImport_ImportModule("gzip");
+    if (!module) {
+        return 0;
+    }
+    reader->gzip = PyObject_CallMethod(module, "GzipFile", "OsiO", Py_None, "rb", 9, reader->source);
+    Py_DECREF(module);
+    if (!reader->gzip) {
+        return 0;
+    }
+    PyObject *read = PyObject_GetAttrString(reader->gzip, "read");
+    if (!read) {
+        return 0;
     }
+    Py_DECREF(reader->read);
+    reader->read = read;
+    reader->avail = 0;
+    return 1;
+#endif
+}
 
-    count = 0;
-    if (self->m_tree->head) {
-        PATRICIA_WALK_ALL (self->m_tree->head, node) {
-            // some nodes may be glued in middle and will have prefix, but not data
-            // In case of no data, we'll leave the list entry as default (None)
-            if(node->data) {
-                // SET_ITEM steal reference so increment in advance to keep original
-                Py_INCREF(node->data);
-                PyList_SET_ITEM(list, count, node->data);
+// read up to size bytes of text into buf, returning the count, 0 at the
+// end, or -1 with an error set
+static Py_ssize_t
+_pytricia_pfx2as_read(pytricia_pfx2as_t *reader, char *buf, Py_ssize_t size) {
+#ifdef PYTRICIA_HAVE_ZLIB
+    if (reader->gz) {
+        int n;
+        Py_BEGIN_ALLOW_THREADS
+        n = gzread(reader->gz, buf, (unsigned)size);
+        Py_END_ALLOW_THREADS
+        if (n < 0) {
+            int errnum = 0;
+            PyErr_Format(PyExc_ValueError, "Error reading pfx2as data: %s", gzerror(reader->gz, &errnum));
+        }
+        return n;
+    }
+#endif
+    for (;;) {
+        if (reader->avail == 0) {
+            Py_CLEAR(reader->chunk);
+            if (reader->eof) {
+                return 0;
+            }
+            reader->chunk = PyObject_CallFunction(reader->read, "n", (Py_ssize_t)PYTRICIA_PFX2AS_CHUNK);
+            if (!reader->chunk) {
+                // report bad data from gzip (EOFError, OSError, zlib.error,
+                // struct.error on python 2) as zlib would
+                if (reader->gzip && PyErr_ExceptionMatches(PyExc_Exception) && !PyErr_ExceptionMatches(PyExc_MemoryError)) {
+                    PyErr_Clear();
+                    PyErr_SetString(PyExc_ValueError, "Error reading pfx2as data: invalid or truncated gzip data");
+                }
+                return -1;
+            }
+            if (!PyBytes_Check(reader->chunk)) {
+                PyErr_SetString(PyExc_TypeError, "read() should return bytes");
+                return -1;
+            }
+            Py_ssize_t n = PyBytes_GET_SIZE(reader->chunk);
+            if (n == 0) {
+                reader->eof = 1;
+#ifdef PYTRICIA_HAVE_ZLIB
+                if (reader->inflating > 0 && !reader->ended) {
+                    PyErr_SetString(PyExc_ValueError, "Error reading pfx2as data: truncated gzip data");
+                    return -1;
+                }
+#endif
+                continue;
             }
-            else {
-                Py_INCREF(Py_None);
-                PyList_SET_ITEM(list, count, Py_None);
+            reader->next = PyBytes_AS_STRING(reader->chunk);
+            reader->avail = n;
+            if (reader->inflating == 0 && !_pytricia_pfx2as_start(reader)) {
+                return -1;
             }
-            count += 1;
-        } PATRICIA_WALK_END;
+            continue;
+        }
+        if (reader->inflating < 0) {
+            Py_ssize_t n = reader->avail < size ? reader->avail : size;
+            memcpy(buf, reader->next, n);
+            reader->next += n;
+            reader->avail -= n;
+            return n;
+        }
+#ifdef PYTRICIA_HAVE_ZLIB
+        reader->stream.next_in = (Bytef*)reader->next;
+        reader->stream.avail_in = (uInt)reader->avail;
+        reader->stream.next_out = (Bytef*)buf;
+        reader->stream.avail_out = (uInt)size;
+        int rv = inflate(&reader->stream, Z_NO_FLUSH);
+        reader->next = (const char*)reader->stream.next_in;
+        reader->avail = reader->stream.avail_in;
+        if (rv == Z_STREAM_END) {
+            // another gzip member may follow
+            inflateReset(&reader->stream);
+            reader->ended = 1;
+        } else if (rv == Z_OK) {
+            reader->ended = 0;
+        } else if (rv != Z_BUF_ERROR) {
+            PyErr_Format(PyExc_ValueError, "Error reading pfx2as data: %s",
+                         reader->stream.msg ? reader->stream.msg : "invalid gzip data");
+            return -1;
+        }
+        Py_ssize_t n = size - reader->stream.avail_out;
+        if (n > 0) {
+            return n;
+        }
+#endif
     }
+}
 
-    ret_err = PyDict_SetItemString(dict, "data", list);
-    Py_DECREF(list);  // dictionary now owns the reference
-    if(ret_err) {
-        PyErr_SetString(PyExc_MemoryError, "error writing data list to dictionary");
-        Py_DECREF(dict);
-        return NULL;
+// close a file opened by load_pfx2as(), keeping any error already set;
+// returns 0 if closing raised
+static int
+_pytricia_pfx2as_close(PyObject *file) {
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyObject *rv = PyObject_CallMethod(file, "close", NULL);
+    Py_XDECREF(rv);
+    Py_DECREF(file);
+    if (type) {
+        PyErr_Clear();
+        PyErr_Restore(type, value, traceback);
     }
-
-    PyObject* out_tuple = PyTuple_Pack(3, (PyObject*)Py_TYPE(self), args, dict);
-    Py_DECREF(args);
-    Py_DECREF(dict);
-    return out_tuple;
+    return rv != NULL;
 }
 
-static PyObject* pytricia_setstate(PyTricia *self, PyObject *args) {
-    PyObject *state;
-    if (!PyArg_ParseTuple(args, "O", &state)) {
+// the next whitespace-separated field of a line, NUL-terminated in place
+static char *
+_pytricia_pfx2as_field(char **line, char *end) {
+    char *p = *line;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    if (p == end) {
         return NULL;
     }
-    if (!PyDict_Check(state)) {
-      PyErr_SetString(PyExc_TypeError, "__setstate__ argument must be a dictionary");
-      return NULL;
+    char *field = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+        p++;
     }
+    *p = '\0';
+    *line = p < end ? p + 1 : p;
+    return field;
+}
 
-    PyObject* bytes = PyDict_GetItemString(state, "tree");
-    if (!bytes || !PyBytes_Check(bytes) || PyBytes_Size(bytes) != sizeof(patricia_tree_t)) {
-      PyErr_SetString(PyExc_TypeError, "__setstate__ failed tree type checking");
-      return NULL;
+// the value for an AS field: an int, or a str for a multi-origin
+// ("1_2") or AS set ("1,2") field.  consecutive lines tend to have the
+// same origin, so the last value is reused.
+static PyObject *
+_pytricia_pfx2as_value(const char *asn, char *last, PyObject **last_value) {
+    size_t len = strlen(asn);
+    if (*last_value && len < 32 && !strcmp(asn, last)) {
+        Py_INCREF(*last_value);
+        return *last_value;
     }
-    memcpy(self->m_tree, PyBytes_AsString(bytes), sizeof(patricia_tree_t));
-    
-    // restore head/node data
-    PyObject* nodebytes = PyDict_GetItemString(state, "nodes");
-    if (!PyBytes_Check(nodebytes)) {
-        PyErr_SetString(PyExc_TypeError, "__setstate__ failed nodes type checking");
-        return NULL;
+    PyObject *value = NULL;
+    if (len > 0 && len <= 10 && strspn(asn, "0123456789") == len) {
+        value = PyLong_FromUnsignedLong(strtoul(asn, NULL, 10));
+    } else {
+#if PY_MAJOR_VERSION == 3
+        value = PyUnicode_FromStringAndSize(asn, len);
+#else
+        value = PyString_FromStringAndSize(asn, len);
+#endif
     }
-    if (PyBytes_Size(nodebytes)) {
-        patricia_node_t* original_head = self->m_tree->head;
-        self->m_tree->head = calloc(1, PyBytes_Size(nodebytes));
-        ssize_t offset_bytes = (char*)self->m_tree->head - (char*)original_head;
-        size_t num_nodes = PyBytes_Size(nodebytes) / sizeof(patricia_node_t);
-        if(self->m_tree->head == NULL) {
-            PyErr_SetString(PyExc_MemoryError, "__setstate__ error allocating space for nodes");
-            return NULL;
+    if (value && len < 32) {
+        memcpy(last, asn, len + 1);
+        Py_XDECREF(*last_value);
+        Py_INCREF(value);
+        *last_value = value;
+    }
+    return value;
+}
+
+// insert the complete lines in [buf, end), counting them in *lineno and
+// the prefixes loaded in *count; returns 0 with an error set
+static int
+_pytricia_pfx2as_lines(PyTricia *self, char *buf, char *end, Py_ssize_t *lineno, Py_ssize_t *count,
+                       char *last, PyObject **last_value) {
+    while (buf < end) {
+        char *newline = memchr(buf, '\n', end - buf);
+        char *line = buf;
+        char *line_end = newline ? newline : end;
+        buf = line_end + 1;
+        (*lineno)++;
+
+        char *addr = _pytricia_pfx2as_field(&line, line_end);
+        if (!addr || addr[0] == '#') {
+            continue;
         }
-        memcpy(self->m_tree->head, PyBytes_AsString(nodebytes), PyBytes_Size(nodebytes));
- 
-        // Now re-write the links relative to the start of the contiguous memory block
-        patricia_node_t *node = self->m_tree->head;
-        for(size_t i=0; i<num_nodes; i++) {
-            if(node->parent) {
-                node->parent = (patricia_node_t*)((char*)node->parent + offset_bytes);
-            }
-            if(node->l) {
-                node->l = (patricia_node_t*)((char*)node->l + offset_bytes);
-            }
-            if(node->r) {
-                node->r = (patricia_node_t*)((char*)node->r + offset_bytes);
-            }
-            node++;
+        char *len = _pytricia_pfx2as_field(&line, line_end);
+        char *asn = _pytricia_pfx2as_field(&line, line_end);
+        prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+        char *bits_end = NULL;
+        long bits = len ? strtol(len, &bits_end, 10) : -1;
+        if (!asn || _pytricia_pfx2as_field(&line, line_end) || *bits_end || bits < 0 ||
+            _string_to_prefix(addr, strlen(addr), &prefix) != 1 || bits > (prefix.family == AF_INET ? 32 : 128)) {
+            PyErr_Format(PyExc_ValueError, "Invalid pfx2as line %zd", *lineno);
+            return 0;
+        }
+        if (bits > self->m_tree->maxbits) {
+            PyErr_Format(PyExc_ValueError, "Prefix on pfx2as line %zd is longer than the maximum bits of the tree", *lineno);
+            return 0;
+        }
+        prefix.bitlen = (u_short)bits;
+
+        PyObject *value = _pytricia_pfx2as_value(asn, last, last_value);
+        if (!value) {
+            return 0;
+        }
+        int rv = _pytricia_assign_prefix(self, &prefix, value);
+        Py_DECREF(value);
+        if (rv < 0) {
+            return 0;
         }
+        (*count)++;
     }
+    return 1;
+}
 
-    // Restore node data items
-    PyObject* list = PyDict_GetItemString(state, "data");
-    if (!PyList_Check(list)) {
-        PyErr_SetString(PyExc_TypeError, "__setstate__ data is not list as expected!");
+static PyObject*
+pytricia_load_pfx2as(PyTricia *self, PYTRICIA_ARGS) {
+    PYTRICIA_UNPACK_ARGS
+    PyObject *source = NULL;
+    if (!_pytricia_unpack("load_pfx2as", args, nargs, 1, 1, &source)) {
         return NULL;
     }
-    else {
-        Py_ssize_t list_len = PyList_Size(list);
-        if (list_len * (Py_ssize_t)sizeof(patricia_node_t) != PyBytes_Size(nodebytes)) {
-            PyErr_SetString(PyExc_TypeError, "__setstate__ node and data list sizes inconsistent!");
+
+    pytricia_pfx2as_t reader;
+    memset(&reader, 0, sizeof(pytricia_pfx2as_t));
+    reader.source = source;
+    reader.read = PyObject_GetAttrString(source, "read");
+    if (!reader.read) {
+        PyErr_Clear();
+#if !defined(PYTRICIA_HAVE_ZLIB)
+        // a path is opened as a file object, and read like one
+        PyObject *io = PyImport_ImportModule("io");
+        if (!io) {
+            return NULL;
+        }
+        reader.file = PyObject_CallMethod(io, "open", "Os", source, "rb");
+        Py_DECREF(io);
+        if (!reader.file) {
+            return NULL;
+        }
+        reader.source = reader.file;
+        reader.read = PyObject_GetAttrString(reader.file, "read");
+        if (!reader.read) {
+            _pytricia_pfx2as_close(reader.file);
+            return NULL;
+        }
+#elif PY_MAJOR_VERSION == 3
+        PyObject *path = NULL;
+        if (!PyUnicode_FSConverter(source, &path)) {
+            return NULL;
+        }
+        reader.gz = gzopen(PyBytes_AS_STRING(path), "rb");
+        if (!reader.gz) {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, source);
+        }
+        Py_DECREF(path);
+#else
+        if (!PyString_Check(source)) {
+            PyErr_SetString(PyExc_TypeError, "load_pfx2as() takes a path or a file object");
             return NULL;
         }
+        reader.gz = gzopen(PyString_AS_STRING(source), "rb");
+        if (!reader.gz) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, PyString_AS_STRING(source));
+        }
+#endif
+#ifdef PYTRICIA_HAVE_ZLIB
+        if (!reader.gz) {
+            return NULL;
+        }
+        gzbuffer(reader.gz, PYTRICIA_PFX2AS_CHUNK);
+#endif
     }
-    patricia_node_t *node = NULL;
-    size_t count = 0;
-    if (self->m_tree->head) {
-        PATRICIA_WALK_ALL (self->m_tree->head, node) {
-            node->data = PyList_GET_ITEM(list, count);
-            Py_INCREF(node->data); // make our own reference
-            // in special case of glue node with data value of None
-            // we'll want to remove python None and instead use NULL
-            if (node->data == Py_None) {
-                Py_DECREF(node->data);
-                node->data = NULL;
+
+    // lines are parsed in place, with a partial one carried to the next chunk
+    Py_ssize_t size = 2 * PYTRICIA_PFX2AS_CHUNK;
+    char *buf = malloc(size);
+    if (!buf) {
+        PyErr_NoMemory();
+    }
+    Py_ssize_t pending = 0, lineno = 0, count = 0;
+    char last[32];
+    PyObject *last_value = NULL;
+    int ok = buf != NULL;
+    while (ok) {
+        Py_ssize_t n = _pytricia_pfx2as_read(&reader, buf + pending, size - pending);
+        if (n < 0) {
+            ok = 0;
+            break;
+        }
+        char *end = buf + pending + n;
+        if (n > 0) {
+            // up to the last complete line
+            while (end > buf && end[-1] != '\n') {
+                end--;
+            }
+            if (end == buf) {
+                if (pending + n == size) {
+                    PyErr_Format(PyExc_ValueError, "Invalid pfx2as line %zd", lineno + 1);
+                    ok = 0;
+                    break;
+                }
+                pending += n;
+                continue;
             }
-            count += 1;
-        } PATRICIA_WALK_END;
+        }
+        PYTRICIA_BEGIN_LOCKED(self)
+        _pytricia_shared_sync(self);
+        ok = _pytricia_check_writable(self) &&
+             _pytricia_pfx2as_lines(self, buf, end, &lineno, &count, last, &last_value);
+        _pytricia_reclaim(self);
+        PYTRICIA_END_LOCKED
+        if (n == 0) {
+            break;
+        }
+        pending = buf + pending + n - end;
+        memmove(buf, end, pending);
     }
 
-    Py_RETURN_NONE;
+    Py_XDECREF(last_value);
+    free(buf);
+#ifdef PYTRICIA_HAVE_ZLIB
+    if (reader.gz) {
+        gzclose(reader.gz);
+    }
+    if (reader.inflating > 0) {
+        inflateEnd(&reader.stream);
+    }
+#endif
+    Py_XDECREF(reader.chunk);
+    Py_XDECREF(reader.read);
+    if (reader.gzip && !_pytricia_pfx2as_close(reader.gzip)) {
+        ok = 0;
+    }
+    if (reader.file && !_pytricia_pfx2as_close(reader.file)) {
+        ok = 0;
+    }
+    if (!ok) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(count);
 }
 
 static PyMappingMethods pytricia_as_mapping = {
@@ -999,24 +5141,53 @@ static PySequenceMethods pytricia_as_sequence = {
        0                   /*sq_inplace_repeat*/
 };
 
-// forward declaration
+// forward declarations
 static PyObject*
 pytricia_iter(register PyTricia *, PyObject *);
+static PyObject*
+pytricia_itervalues(register PyTricia *, PyObject *);
+static PyObject*
+pytricia_iteritems(register PyTricia *, PyObject *);
+static PyObject*
+pytricia_iter_children(register PyTricia *, PYTRICIA_ARGS);
+static PyObject*
+pytricia_iter_supernets(register PyTricia *, PYTRICIA_ARGS);
+static PyObject*
+pytricia_iter_range(register PyTricia *, PYTRICIA_ARGS);
 
 
 static PyMethodDef pytricia_methods[] = {
-    {"has_key",   (PyCFunction)pytricia_has_key, METH_VARARGS, "has_key(prefix) -> boolean\nReturn true iff prefix is in tree.  Note that this method checks for an *exact* match with the prefix.\nUse the 'in' operator if you want to test whether a given address is contained within some prefix."},
+    {"has_key",   (PyCFunction)pytricia_has_key, PYTRICIA_METH_FASTCALL, "has_key(prefix) -> boolean\nReturn true iff prefix is in tree.  Note that this method checks for an *exact* match with the prefix.\nUse the 'in' operator if you want to test whether a given address is contained within some prefix."},
     {"keys",   (PyCFunction)pytricia_keys, METH_NOARGS, "keys() -> list\nReturn a list of all prefixes in the tree."},
-    {"get", (PyCFunction)pytricia_get, METH_VARARGS, "get(prefix, [default]) -> object\nReturn value associated with prefix."},
-    {"get_key", (PyCFunction)pytricia_get_key, METH_VARARGS, "get_key(prefix) -> prefix\nReturn key associated with prefix (longest matching prefix)."},
-    {"delete", (PyCFunction)pytricia_delitem, METH_VARARGS, "delete(prefix) -> \nDelete mapping associated with prefix.\n"},
-    {"insert", (PyCFunction)pytricia_insert, METH_VARARGS, "insert(prefix, data) -> data\nCreate mapping between prefix and data in tree."},
-    {"children", (PyCFunction)pytricia_children, METH_VARARGS, "children(prefix) -> list\nReturn a list of all prefixes that are more specific than the given prefix (the prefix must be present as an exact match)."},
-    {"parent", (PyCFunction)pytricia_parent, METH_VARARGS, "parent(prefix) -> prefix\nReturn the immediate parent of the given prefix (the prefix must be present as an exact match)."},
-    {"freeze", (PyCFunction)pytricia_freeze, METH_NOARGS, "freeze() -> \nCompacts pytricia object for efficient access, but disallows updates"},
+    {"values",   (PyCFunction)pytricia_values, METH_NOARGS, "values() -> list\nReturn a list of the values of all prefixes in the tree, in keys() order."},
+    {"items",   (PyCFunction)pytricia_items, METH_NOARGS, "items() -> list\nReturn a list of (prefix, value) tuples for all prefixes in the tree, in keys() order."},
+    {"itervalues",   (PyCFunction)pytricia_itervalues, METH_NOARGS, "itervalues() -> iterator\nIterate over the values of all prefixes in the tree, in keys() order."},
+    {"iteritems",   (PyCFunction)pytricia_iteritems, METH_NOARGS, "iteritems() -> iterator\nIterate over (prefix, value) tuples for all prefixes in the tree, in keys() order."},
+    {"get", (PyCFunction)pytricia_get, PYTRICIA_METH_FASTCALL, "get(prefix, [default]) -> object\nReturn value associated with prefix."},
+    {"get_key", (PyCFunction)pytricia_get_key, PYTRICIA_METH_FASTCALL, "get_key(prefix) -> prefix\nReturn key associated with prefix (longest matching prefix)."},
+    {"get_many", (PyCFunction)pytricia_get_many, PYTRICIA_METH_FASTCALL, "get_many(prefixes, [default, [out]]) -> list\nReturn a list of values associated with each prefix in an iterable (longest matching prefix).\nIf out is given, it must be a list of the same length, and is filled in and returned."},
+    {"contains_many", (PyCFunction)pytricia_contains_many, PYTRICIA_METH_FASTCALL, "contains_many(prefixes, [out]) -> list\nReturn a list of booleans indicating whether each prefix in an iterable is contained in the tree (like the 'in' operator).\nIf out is given, it must be a list of the same length, and is filled in and returned."},
+    {"lookup_array", (PyCFunction)pytricia_lookup_array, METH_VARARGS | METH_KEYWORDS, "lookup_array(addrs, out, [addrlen], threads=1, interleave=16) -> int\nLook up each address in a buffer (e.g., an array of 4-byte integer IPv4 addresses, an (N,16) byte array of IPv6 addresses, or packed bytes, or a (hi, lo) tuple of uint64 buffers of IPv6 address halves) and write the index of the longest matching prefix in keys() order, or -1 if there is none, to the int32/int64 buffer out.\nThe GIL is released during lookups, which are split across the given number of threads.\nEach thread keeps up to interleave (at most 32) lookups in flight to overlap cache misses; 1 looks up one address at a time.\nReturns the number of addresses that matched."},
+    {"delete", (PyCFunction)pytricia_delitem, PYTRICIA_METH_FASTCALL, "delete(prefix) -> \nDelete mapping associated with prefix.\n"},
+    {"insert", (PyCFunction)pytricia_insert, PYTRICIA_METH_FASTCALL, "insert(prefix, data) -> data\nCreate mapping between prefix and data in tree."},
+    {"children", (PyCFunction)pytricia_children, PYTRICIA_METH_FASTCALL, "children(prefix) -> list\nReturn a list of all prefixes that are more specific than the given prefix (the prefix must be present as an exact match)."},
+    {"iter_children", (PyCFunction)pytricia_iter_children, PYTRICIA_METH_FASTCALL, "iter_children(prefix) -> iterator\nIterate over all prefixes that are more specific than the given prefix (the prefix must be present as an exact match), without building a list."},
+    {"iter_supernets", (PyCFunction)pytricia_iter_supernets, PYTRICIA_METH_FASTCALL, "iter_supernets(prefix) -> iterator\nIterate over all prefixes that contain the given address or prefix (including the prefix itself, if present), from the longest to the shortest.\nThe first one is what get_key returns."},
+    {"iter_range", (PyCFunction)pytricia_iter_range, PYTRICIA_METH_FASTCALL, "iter_range(start, end, [after]) -> iterator\nIterate in keys() order over all prefixes that overlap the addresses from the first address of start to the last address of end.\nIf after is given, iteration resumes with the first such prefix that follows it in keys() order, so passing the last prefix of one page starts the next."},
+    {"parent", (PyCFunction)pytricia_parent, PYTRICIA_METH_FASTCALL, "parent(prefix) -> prefix\nReturn the immediate parent of the given prefix (the prefix must be present as an exact match)."},
+    {"freeze", (PyCFunction)pytricia_freeze, METH_VARARGS | METH_KEYWORDS, "freeze(engine='trie', layout='preorder') -> \nCompacts pytricia object for efficient access, but disallows updates.\nlayout='bfs' or 'veb' orders the nodes breadth-first or in van Emde Boas order instead of preorder.\nengine='dir24' additionally compiles a 32-bit tree into a DIR-24-8 table, and\nengine='poptrie' into a multibit trie (any maximum bits), for faster address lookups."},
     {"thaw", (PyCFunction)pytricia_thaw, METH_NOARGS, "thaw() -> \nreverses a frozen pytricia object to allow updates"},
+    {"snapshot", (PyCFunction)pytricia_snapshot, METH_NOARGS, "snapshot() -> pytricia\nReturn a read-only view of the tree as it is now, without copying it.  Later changes to the tree copy only the nodes they touch, so the view stays the same.\nA snapshot can not be modified; freeze() and lookup_array() on one copy its nodes first."},
+    {"swap_contents", (PyCFunction)pytricia_swap_contents, PYTRICIA_METH_FASTCALL, "swap_contents(other) -> \nExchange the prefixes, values, frozen state and lookup engine of this tree and another one with the same maximum bits, in constant time.\nLookups already running finish on the contents they started with.  Neither tree may have snapshots."},
+    {"build_async", (PyCFunction)pytricia_build_async, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "build_async(source, *args, engine='trie', layout='preorder') -> build\nBuild a frozen tree, made with the given constructor arguments, from a mapping or an iterable of (prefix, value) pairs on a background thread.\nThe pairs are collected before it returns; build.done() tells whether the tree is ready and build.result() waits for it and returns it.\nString prefixes are parsed on the background thread, and an invalid one is raised by result()."},
+    {"from_sorted", (PyCFunction)pytricia_from_sorted, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "from_sorted(source, *args, engine='trie', layout='preorder') -> pytricia\nBuild a frozen tree, made with the given constructor arguments, from a mapping or an iterable of (prefix, value) pairs, laying out the nodes in one pass.\nThe pairs should be in keys() order (by address, each prefix before the ones it contains); others are sorted first.  The last value given for a prefix wins."},
+    {"load_pfx2as", (PyCFunction)pytricia_load_pfx2as, PYTRICIA_METH_FASTCALL, "load_pfx2as(source) -> int\nInsert the prefixes of a routeviews prefix-to-AS file, gzipped or not, given as a path or a file object opened in binary mode, and return how many were loaded.\nThe value of each is its origin AS as an int, or the AS field as a str for multiple origins or AS sets."},
+    {"enable_key_cache", (PyCFunction)pytricia_enable_key_cache, PYTRICIA_METH_FASTCALL, "enable_key_cache(size) -> \nRemember the parsed form of up to size (rounded up to a power of two) string or ipaddress keys used for lookups, so that repeated keys skip parsing.  A size of 0 disables the cache."},
+    {"enable_result_cache", (PyCFunction)pytricia_enable_result_cache, PYTRICIA_METH_FASTCALL, "enable_result_cache(size) -> \nRemember the longest matching prefix for up to size (rounded up to a power of two) recently looked up addresses.  Any change to the tree invalidates the cache.  A size of 0 disables the cache."},
+    {"enable_node_keys", (PyCFunction)pytricia_enable_node_keys, PYTRICIA_METH_FASTCALL, "enable_node_keys([enabled]) -> \nKeep the key object for each prefix once it has been made (by keys(), iteration, get_key, children or parent), so that later calls return the same object instead of formatting a new one.  enable_node_keys(False) drops the kept keys.\n"},
+    {"stats", (PyCFunction)pytricia_stats, METH_NOARGS, "stats() -> dict\nReturn sizes, hit and miss counters, and hit rates for the key and result caches."},
     {"__reduce__", (PyCFunction)pytricia_reduce, METH_NOARGS, "Return state information for pickling"},
-    {"__setstate__", (PyCFunction)pytricia_setstate, METH_VARARGS, "Set state information for unpickling"},
+    {"__setstate__", (PyCFunction)pytricia_setstate, PYTRICIA_METH_FASTCALL, "Set state information for unpickling"},
     {NULL,              NULL}           /* sentinel */
 };
 
@@ -1027,28 +5198,177 @@ pytriciaiter_iter(PyTricia *self)
     return (PyObject*)self;
 }
 
+#define PYTRICIA_BIT(addr, bit) (((addr)[(bit) >> 3] >> (7 - ((bit) & 7))) & 1)
+
+// whether the subtree under a node at bit, whose keys all start with the
+// first bit bits of addr, may hold a prefix that overlaps the range and
+// comes after m_after in keys() order.
+static int
+_pytriciaiter_range_subtree(PyTriciaIter *iter, u_int bit, const u_char *addr) {
+    u_int d = patricia_differ_bit(addr, iter->m_hi, bit);
+    if (d < bit && PYTRICIA_BIT(addr, d)) {
+        return 0;  // starts above the last address
+    }
+    d = patricia_differ_bit(addr, iter->m_lo, bit);
+    if (d < bit && !PYTRICIA_BIT(addr, d)) {
+        return 0;  // ends below the first address
+    }
+    if (iter->m_has_after) {
+        u_int limit = bit < iter->m_after.bitlen ? bit : iter->m_after.bitlen;
+        d = patricia_differ_bit(addr, prefix_touchar(&iter->m_after), limit);
+        if (d < limit && !PYTRICIA_BIT(addr, d)) {
+            return 0;  // every key in it sorts before m_after
+        }
+    }
+    return 1;
+}
+
+// whether the prefix of a node holding data comes after m_after
+static int
+_pytriciaiter_range_after(PyTriciaIter *iter, patricia_node_t *node) {
+    if (!iter->m_has_after) {
+        return 1;
+    }
+    u_int bitlen = node->prefix.bitlen;
+    u_int limit = bitlen < iter->m_after.bitlen ? bitlen : iter->m_after.bitlen;
+    const u_char *addr = prefix_touchar(&node->prefix);
+    u_int d = patricia_differ_bit(addr, prefix_touchar(&iter->m_after), limit);
+    if (d < limit) {
+        return PYTRICIA_BIT(addr, d);
+    }
+    return bitlen > iter->m_after.bitlen;  // a prefix sorts before its extensions
+}
+
+// the iter_range walk over the hot nodes of a frozen tree's block
 static PyObject*
-pytriciaiter_next(PyTriciaIter *iter)
+_pytriciaiter_next_range_frozen(PyTriciaIter *iter)
+{
+    patricia_hot_t *hot = iter->m_block->nodes;
+    uint32_t *stack = (uint32_t *)iter->m_Xstack;
+    while (iter->m_pos) {
+        uint32_t i = iter->m_pos - 1;
+        // glue nodes always have two children, and no entry
+        uint32_t rep = i;
+        while (!hot[rep].entry) {
+            rep = (hot[rep].l ? hot[rep].l : hot[rep].r) - 1;
+        }
+        patricia_node_t *entry = PATRICIA_ENTRY(iter->m_block, hot[rep].entry - 1);
+        int keep = _pytriciaiter_range_subtree(iter, hot[i].bit, prefix_touchar(&entry->prefix));
+        uint32_t l = hot[i].l, r = hot[i].r;
+
+        if (keep && l) {
+            if (r) {
+                stack[iter->m_end++] = r;
+            }
+            iter->m_pos = l;
+        } else if (keep && r) {
+            iter->m_pos = r;
+        } else if (iter->m_end > 0) {
+            iter->m_pos = stack[--iter->m_end];
+        } else {
+            iter->m_pos = 0;
+        }
+
+        if (keep && hot[i].entry) {
+            entry = PATRICIA_ENTRY(iter->m_block, hot[i].entry - 1);
+            if (_pytriciaiter_range_after(iter, entry)) {
+                return _pytricia_node_item(iter->m_parent, entry, iter->m_mode);
+            }
+        }
+    }
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+// the iter_range walk: like pytriciaiter_next, but subtrees that can't
+// hold anything wanted are skipped without being entered
+static PyObject*
+_pytriciaiter_next_range(PyTriciaIter *iter)
+{
+    if (iter->m_block) {
+        return _pytriciaiter_next_range_frozen(iter);
+    }
+    while (iter->m_Xrn) {
+        patricia_node_t *node = iter->m_Xrn;
+        // glue nodes have no prefix, but all keys below them share the
+        // node's leading bits, so any node below with data stands in
+        patricia_node_t *rep = node;
+        while (rep && !PATRICIA_LOAD(rep->data) && rep->prefix.family == 0) {
+            patricia_node_t *l = PATRICIA_LOAD(rep->l);
+            rep = l ? l : PATRICIA_LOAD(rep->r);
+        }
+        // (no rep only if the subtree was emptied while we got here)
+        int keep = rep && _pytriciaiter_range_subtree(iter, node->bit, prefix_touchar(&rep->prefix));
+        patricia_node_t *l = PATRICIA_LOAD(node->l);
+        patricia_node_t *r = PATRICIA_LOAD(node->r);
+
+        if (keep && l) {
+            if (r) {
+                *(iter->m_Xsp)++ = r;
+            }
+            iter->m_Xrn = l;
+        } else if (keep && r) {
+            iter->m_Xrn = r;
+        } else if (iter->m_Xsp != iter->m_Xstack) {
+            iter->m_Xrn = *(--iter->m_Xsp);
+        } else {
+            iter->m_Xrn = NULL;
+        }
+
+        if (keep && PATRICIA_LOAD(node->data) && _pytriciaiter_range_after(iter, node)) {
+            return _pytricia_node_item(iter->m_parent, node, iter->m_mode);
+        }
+    }
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+static PyObject*
+_pytriciaiter_next(PyTriciaIter *iter)
 {
+    if (iter->m_range) {
+        return _pytriciaiter_next_range(iter);
+    }
+    // a frozen tree's entries are already in walk order; iter_children
+    // stops at the first one its base doesn't cover
+    if (iter->m_block) {
+        if (iter->m_pos < iter->m_end) {
+            patricia_node_t *entry = PATRICIA_ENTRY(iter->m_block, iter->m_pos);
+            if (!iter->m_skip || _pytricia_covers(iter->m_skip, entry)) {
+                iter->m_pos++;
+                return _pytricia_node_item(iter->m_parent, entry, iter->m_mode);
+            }
+            iter->m_pos = iter->m_end;
+        }
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+    // iter_supernets leaves no walk to do, only its matches on the stack
+    if (!iter->m_Xrn && iter->m_Xsp != iter->m_Xstack) {
+        patricia_node_t *node = *(--iter->m_Xsp);
+        return _pytricia_node_item(iter->m_parent, node, iter->m_mode);
+    }
     while (1) {
         iter->m_Xnode = iter->m_Xrn;
         if (iter->m_Xnode) {
             // advance the iterator; copied from patricia.h macros
-            if (iter->m_Xrn->l) { 
-                if (iter->m_Xrn->r) { 
-                    *(iter->m_Xsp)++ = iter->m_Xrn->r; 
+            patricia_node_t *l = PATRICIA_LOAD(iter->m_Xrn->l);
+            patricia_node_t *r = PATRICIA_LOAD(iter->m_Xrn->r);
+            if (l) { 
+                if (r) { 
+                    *(iter->m_Xsp)++ = r; 
                 } 
-                iter->m_Xrn = iter->m_Xrn->l; 
-            } else if (iter->m_Xrn->r) { 
-                iter->m_Xrn = iter->m_Xrn->r; 
+                iter->m_Xrn = l; 
+            } else if (r) { 
+                iter->m_Xrn = r; 
             } else if (iter->m_Xsp != iter->m_Xstack) { 
                 iter->m_Xrn = *(--iter->m_Xsp); 
             } else { 
                 iter->m_Xrn = (patricia_node_t *) 0; 
             } 
 
-            if (iter->m_Xnode->data) {
-                return _prefix_to_key_object(&iter->m_Xnode->prefix, iter->m_parent->m_raw_output);
+            if (PATRICIA_LOAD(iter->m_Xnode->data) && iter->m_Xnode != iter->m_skip) {
+                return _pytricia_node_item(iter->m_parent, iter->m_Xnode, iter->m_mode);
             } 
         } else {
             PyErr_SetNone(PyExc_StopIteration);
@@ -1060,9 +5380,53 @@ pytriciaiter_next(PyTriciaIter *iter)
     return NULL;
 }
 
+// an iterator counts as a lookup (see _pytricia_read_begin) from its
+// creation until it is exhausted or freed, as it holds on to nodes
+static void
+_pytriciaiter_hold(PyTriciaIter *iter) {
+    iter->m_reader = _pytricia_read_begin(iter->m_parent);
+    iter->m_holding = 1;
+    PYTRICIA_ATOMIC_ADD(iter->m_parent->m_iterators, 1);
+}
+
+static void
+_pytriciaiter_release(PyTriciaIter *iter) {
+    if (iter->m_holding) {
+        _pytricia_read_end(iter->m_reader);
+        iter->m_reader = NULL;
+        iter->m_holding = 0;
+        PYTRICIA_ATOMIC_ADD(iter->m_parent->m_iterators, -1);
+    }
+}
+
+static int
+_pytriciaiter_done(PyTriciaIter *iter) {
+    if (iter->m_block && iter->m_range) {
+        return iter->m_pos == 0;
+    }
+    if (iter->m_block) {
+        return iter->m_pos >= iter->m_end;
+    }
+    return !iter->m_Xrn && iter->m_Xsp == iter->m_Xstack;
+}
+
+static PyObject*
+pytriciaiter_next(PyTriciaIter *iter)
+{
+    PyObject *item;
+    PYTRICIA_BEGIN_LOCKED(iter)
+    item = _pytriciaiter_next(iter);
+    if (_pytriciaiter_done(iter)) {
+        _pytriciaiter_release(iter);
+    }
+    PYTRICIA_END_LOCKED
+    return item;
+}
+
 static void
 pytriciaiter_dealloc(PyTriciaIter *iterobj)
 {
+    _pytriciaiter_release(iterobj);
     if (iterobj->m_Xstack) {
         free(iterobj->m_Xstack);
     }
@@ -1148,7 +5512,7 @@ static PyTypeObject PyTriciaIterType = {
 };
 
 static PyObject*
-pytricia_iter(register PyTricia *self, PyObject *unused)
+_pytricia_new_iter(PyTricia *self, int mode)
 {
     PyTriciaIter *iterobj = PyObject_New(PyTriciaIter, &PyTriciaIterType);
     if (!iterobj) {
@@ -1165,16 +5529,153 @@ pytricia_iter(register PyTricia *self, PyObject *unused)
 
     iterobj->m_tree = self->m_tree;
     iterobj->m_Xnode = NULL;
-    iterobj->m_Xhead = iterobj->m_tree->head;
     iterobj->m_Xstack = (patricia_node_t**) malloc(sizeof(patricia_node_t*)*(PATRICIA_MAXBITS+1));
     if (!iterobj->m_Xstack) {
         Py_DECREF(iterobj->m_parent);
         Py_TYPE(iterobj)->tp_free((PyObject*)iterobj);
         return PyErr_NoMemory();
     }
+    _pytriciaiter_hold(iterobj);
+    PATRICIA_ROOT (iterobj->m_tree, iterobj->m_Xhead, iterobj->m_block);
+    iterobj->m_pos = 0;
+    iterobj->m_end = iterobj->m_block ? iterobj->m_block->num_entries : 0;
  
     iterobj->m_Xsp = iterobj->m_Xstack;
     iterobj->m_Xrn = iterobj->m_Xhead;
+    iterobj->m_mode = mode;
+    iterobj->m_skip = NULL;
+    iterobj->m_range = 0;
+    iterobj->m_has_after = 0;
+    return (PyObject*)iterobj;
+}
+
+static PyObject*
+pytricia_iter(register PyTricia *self, PyObject *unused)
+{
+    return _pytricia_new_iter(self, PYTRICIA_ITER_KEYS);
+}
+
+static PyObject*
+pytricia_itervalues(register PyTricia *self, PyObject *unused)
+{
+    return _pytricia_new_iter(self, PYTRICIA_ITER_VALUES);
+}
+
+static PyObject*
+pytricia_iteritems(register PyTricia *self, PyObject *unused)
+{
+    return _pytricia_new_iter(self, PYTRICIA_ITER_ITEMS);
+}
+
+static PyObject*
+pytricia_iter_children(register PyTricia *self, PYTRICIA_ARGS)
+{
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+    if (!_pytricia_unpack("iter_children", args, nargs, 1, 1, &key)) {
+        return NULL;
+    }
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    if (!_pytricia_key_to_prefix(self, key, &prefix)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    // walk just the subtree under the base node, leaving out the base
+    PyTriciaIter *iterobj = (PyTriciaIter*)_pytricia_new_iter(self, PYTRICIA_ITER_KEYS);
+    if (!iterobj) {
+        return NULL;
+    }
+    // searched from the root the iterator walks, which a frozen tree may
+    // have swapped for another since
+    patricia_tree_t view; memset(&view, 0, sizeof(view));
+    view.maxbits = self->m_tree->maxbits;
+    view.head = iterobj->m_Xhead;
+    view.block = iterobj->m_block;
+    patricia_node_t* base_node = patricia_search_exact(&view, &prefix);
+    if (!base_node) {
+       Py_DECREF(iterobj);
+       PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+       return NULL;
+    }
+    iterobj->m_Xhead = iterobj->m_Xrn = base_node;
+    iterobj->m_skip = base_node;
+    if (iterobj->m_block) {
+        iterobj->m_pos = PATRICIA_ENTRY_INDEX(iterobj->m_block, base_node) + 1;
+    }
+    return (PyObject*)iterobj;
+}
+
+static PyObject*
+pytricia_iter_range(register PyTricia *self, PYTRICIA_ARGS)
+{
+    PYTRICIA_UNPACK_ARGS
+    PyObject *start = NULL;
+    PyObject *end = NULL;
+    PyObject *after = Py_None;
+    if (!_pytricia_unpack("iter_range", args, nargs, 2, 3, &start, &end, &after)) {
+        return NULL;
+    }
+    prefix_t lo, hi, after_prefix;
+    memset(&lo, 0, sizeof(lo));
+    memset(&hi, 0, sizeof(hi));
+    memset(&after_prefix, 0, sizeof(after_prefix));
+    if (!_pytricia_key_to_prefix(self, start, &lo) || !_pytricia_key_to_prefix(self, end, &hi) ||
+        (after != Py_None && !_pytricia_key_to_prefix(self, after, &after_prefix))) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+
+    PyTriciaIter *iterobj = (PyTriciaIter*)_pytricia_new_iter(self, PYTRICIA_ITER_KEYS);
+    if (!iterobj) {
+        return NULL;
+    }
+    // the range runs from the first address of start to the last of end
+    iterobj->m_range = 1;
+    u_char *loaddr = prefix_touchar(&lo);
+    u_char *hiaddr = prefix_touchar(&hi);
+    for (u_int i = 0; i < 16; i++) {
+        u_int bits = lo.bitlen > i * 8 ? lo.bitlen - i * 8 : 0;
+        iterobj->m_lo[i] = bits >= 8 ? loaddr[i] : loaddr[i] & (u_char)(0xff00 >> bits);
+        bits = hi.bitlen > i * 8 ? hi.bitlen - i * 8 : 0;
+        iterobj->m_hi[i] = bits >= 8 ? hiaddr[i] : hiaddr[i] | (u_char)(0xff >> bits);
+    }
+    if (after != Py_None) {
+        iterobj->m_after = after_prefix;
+        iterobj->m_has_after = 1;
+    }
+    // the frozen walk keeps its stack depth in m_end
+    iterobj->m_pos = iterobj->m_block ? 1 : 0;
+    iterobj->m_end = 0;
+    if (memcmp(iterobj->m_lo, iterobj->m_hi, 16) > 0) {
+        iterobj->m_Xrn = NULL;  // an empty range
+        iterobj->m_pos = 0;
+    }
+    return (PyObject*)iterobj;
+}
+
+static PyObject*
+pytricia_iter_supernets(register PyTricia *self, PYTRICIA_ARGS)
+{
+    PYTRICIA_UNPACK_ARGS
+    PyObject *key = NULL;
+    if (!_pytricia_unpack("iter_supernets", args, nargs, 1, 1, &key)) {
+        return NULL;
+    }
+    prefix_t prefix; memset(&prefix, 0, sizeof(prefix));
+    if (!_pytricia_key_to_prefix(self, key, &prefix)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    PyTriciaIter *iterobj = (PyTriciaIter*)_pytricia_new_iter(self, PYTRICIA_ITER_KEYS);
+    if (!iterobj) {
+        return NULL;
+    }
+
+    // all matches come from a single walk down the tree, and are handed
+    // out most specific first from the iterator's stack
+    iterobj->m_Xhead = iterobj->m_Xrn = NULL;
+    iterobj->m_block = NULL;
+    iterobj->m_Xsp += patricia_search_all(self->m_tree, &prefix, 1, iterobj->m_Xstack);
     return (PyObject*)iterobj;
 }
 
@@ -1226,6 +5727,13 @@ initpytricia(void)
         return;
 #endif
 
+    if (PyType_Ready(&PyTriciaBuildType) < 0)
+#if PY_MAJOR_VERSION == 3
+        return NULL;
+#else
+        return;
+#endif
+
 #if PY_MAJOR_VERSION == 3
     m = PyModule_Create(&pytricia_moduledef);
 #else
@@ -1242,6 +5750,42 @@ initpytricia(void)
     Py_INCREF(&PyTriciaIterType);
     PyModule_AddObject(m, "PyTricia", (PyObject *)&PyTriciaType);
 
+#ifdef Py_GIL_DISABLED
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
+#if defined(PATRICIA_ATOMIC) && PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 4
+    // looked up now rather than on first use, which lookups in several
+    // threads could race to do
+    _set_ipaddr_refs();
+#endif
+
+    // trees still being freed in the background are waited for at exit;
+    // without the hook, they are all freed in the foreground
+    PyObject *atexit = PyImport_ImportModule("atexit");
+    PyObject *join = atexit ? PyCFunction_New(&_pytricia_join_reapers_def, NULL) : NULL;
+    PyObject *registered = join ? PyObject_CallMethod(atexit, "register", "O", join) : NULL;
+    if (!registered) {
+        PyErr_Clear();
+        _pytricia_reapers_closed = 1;
+    }
+    Py_XDECREF(registered);
+    Py_XDECREF(join);
+    Py_XDECREF(atexit);
+
+    // pick the widest batch lookup kernels this CPU supports; the
+    // PYTRICIA_SIMD environment variable can cap the choice
+    static const char *simd_names[] = {"scalar", "avx2", "avx512"};
+    int simd_max = PATRICIA_SIMD_AVX512;
+    const char *simd_env = getenv("PYTRICIA_SIMD");
+    if (simd_env) {
+        for (int i = PATRICIA_SIMD_SCALAR; i <= PATRICIA_SIMD_AVX512; i++) {
+            if (strcmp(simd_env, simd_names[i]) == 0) {
+                simd_max = i;
+            }
+        }
+    }
+    PyModule_AddStringConstant(m, "simd", simd_names[patricia_simd_init(simd_max)]);
+
     // JS: don't add the PyTriciaIter object to the public interface.  users shouldn't be
     // able to create iterator objects w/o calling __iter__ on a pytricia object.
 
@@ -16,7 +16,43 @@
 # along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
 #
 
+import os
+import shutil
+import sysconfig
+import tempfile
 from setuptools import setup, Extension, find_packages
+from distutils.ccompiler import new_compiler
+from distutils.sysconfig import customize_compiler
+
+# free-threaded interpreters (PEP 703) run lookups in parallel; the tree
+# code then publishes and reads its links atomically
+define_macros = []
+if sysconfig.get_config_var("Py_GIL_DISABLED"):
+    define_macros.append(("PATRICIA_ATOMIC", "1"))
+
+# load_pfx2as decompresses with zlib when it can be compiled and linked
+# against; without it (e.g., MSVC), gzip data goes through Python's gzip
+def have_zlib():
+    tmpdir = tempfile.mkdtemp()
+    try:
+        src = os.path.join(tmpdir, "zlibtest.c")
+        with open(src, "w") as outf:
+            outf.write("#include <zlib.h>\nint main(void) { return zlibVersion() == 0; }\n")
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        objects = compiler.compile([src], output_dir=tmpdir)
+        compiler.link_executable(objects, os.path.join(tmpdir, "zlibtest"), libraries=["z"])
+        return True
+    except Exception:
+        return False
+    finally:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+
+libraries = []
+if have_zlib():
+    define_macros.append(("PYTRICIA_HAVE_ZLIB", "1"))
+    libraries.append("z")
+
 setup(name="pytricia", 
       version="1.2.0",
       description="An efficient IP address storage and lookup module for Python.",
@@ -30,6 +66,7 @@ setup(name="pytricia",
       classifiers=[
               "Programming Language :: Python :: 2",
               "Programming Language :: Python :: 3",
+              "Programming Language :: Python :: Free Threading :: 2 - Beta",
               "Intended Audience :: Developers",
               "Operating System :: OS Independent",
               "Topic :: Software Development :: Libraries :: Python Modules",
@@ -38,6 +75,8 @@ setup(name="pytricia",
       ],
       ext_modules=[
          Extension("pytricia", ["pytricia.c","patricia.c"],
+                   define_macros=define_macros,
+                   libraries=libraries,
                         # extra_compile_args = ["-g", "-O0"]  # Enable debug info, disable optimization
                    ),
          ],
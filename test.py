@@ -24,6 +24,8 @@ import socket
 import struct
 import sys
 import pickle
+import sysconfig
+import threading
 import multiprocessing
 from multiprocessing import Process, Queue
 
@@ -32,6 +34,9 @@ def dumppyt(t):
     print ("\nDumping Pytricia")
     for x in t.keys():
         print ("\t",x,t[x])
+
+# free-threaded builds leave the key/result caches and node keys off
+FREE_THREADED = bool(sysconfig.get_config_var("Py_GIL_DISABLED"))
     
 class PyTriciaTests(unittest.TestCase):
     def testInit(self):
@@ -247,6 +252,35 @@ class PyTriciaTests(unittest.TestCase):
         self.assertRaises(StopIteration, next, x)
         self.assertRaises(StopIteration, next, x)
 
+    def testItemsValues(self):
+        pyt = pytricia.PyTricia(128)
+        self.assertListEqual(pyt.items(), [])
+        self.assertListEqual(list(pyt.itervalues()), [])
+        pyt["10.1.0.0/16"] = 'b'
+        pyt["10.0.0.0/8"] = 'a'
+        pyt["10.0.1.0/24"] = None
+        pyt["fe80::/64"] = 'd'
+        pyt["0.0.0.0/0"] = 'default route'
+        del pyt["0.0.0.0/0"]  # leaves a glue node behind
+        keys = pyt.keys()
+        self.assertListEqual(pyt.values(), [pyt[k] for k in keys])
+        self.assertListEqual(pyt.items(), [(k, pyt[k]) for k in keys])
+        self.assertListEqual(list(pyt.itervalues()), pyt.values())
+        self.assertListEqual(list(pyt.iteritems()), pyt.items())
+        self.assertIn(("10.0.1.0/24", None), pyt.items())
+
+        x = pyt.iteritems()
+        self.assertIs(iter(x), x)
+        for i in range(len(keys)):
+            next(x)
+        self.assertRaises(StopIteration, next, x)
+
+        pyt.freeze()
+        self.assertListEqual(list(pyt.iteritems()), [(k, pyt[k]) for k in keys])
+        raw = pytricia.PyTricia(32, socket.AF_INET, True)
+        raw["10.0.0.0/8"] = 'a'
+        self.assertListEqual(raw.items(), [((b'\x0a\x00\x00\x00', 8), 'a')])
+
     def testMultipleIter(self):
         pyt = pytricia.PyTricia()
         pyt["10.0.0.0/8"] = 0
@@ -335,6 +369,1120 @@ class PyTriciaTests(unittest.TestCase):
         pyt.insert("2001:db8:10:42::/64", "b")
         self.assertEqual(pyt.get_key("2001:db8:10:42::1"), "2001:db8:10:42::/64")
 
+    def testGetMany(self):
+        pyt = pytricia.PyTricia(128)
+        pyt.insert("10.0.0.0/8", "a")
+        pyt.insert("10.1.0.0/16", "b")
+        pyt.insert("2001:db8::/32", "c")
+        keys = ["10.1.2.3", "10.2.3.4", "11.0.0.1", "2001:db8::1", socket.inet_aton("10.1.0.1")]
+        self.assertListEqual(pyt.get_many(keys), ["b", "a", None, "c", "b"])
+        self.assertListEqual(pyt.get_many(iter(keys), "X"), ["b", "a", "X", "c", "b"])
+        self.assertListEqual(pyt.get_many([]), [])
+
+        out = [0] * len(keys)
+        rv = pyt.get_many(keys, None, out)
+        self.assertIs(rv, out)
+        self.assertListEqual(out, [pyt.get(k) for k in keys])
+
+        with self.assertRaises(ValueError):
+            pyt.get_many(keys, None, [0])
+        with self.assertRaises(ValueError):
+            pyt.get_many(["10.0.0.1", "apple"])
+        with self.assertRaises(TypeError):
+            pyt.get_many(42)
+
+    def testContainsMany(self):
+        pyt = pytricia.PyTricia()
+        pyt.insert("10.0.0.0/8", "a")
+        keys = ["10.1.2.3", "11.0.0.1", "10.0.0.0/8", "9.0.0.0/8"]
+        self.assertListEqual(pyt.contains_many(keys), [True, False, True, False])
+        self.assertListEqual(pyt.contains_many(keys), [k in pyt for k in keys])
+
+        out = [None] * len(keys)
+        self.assertIs(pyt.contains_many(keys, out), out)
+        self.assertListEqual(out, [True, False, True, False])
+
+        with self.assertRaises(ValueError):
+            pyt.contains_many(["1.2.3/24"])
+
+    def testLookupArray(self):
+        import array
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = 'a'
+        pyt["10.1.0.0/16"] = 'b'
+        pyt["192.168.0.0/16"] = 'c'
+        keys = pyt.keys()
+
+        addrs = ["10.1.2.3", "10.2.3.4", "192.168.1.1", "11.0.0.1"]
+        expected = [keys.index(pyt.get_key(a)) if a in pyt else -1 for a in addrs]
+
+        ints = array.array('I', [struct.unpack('!I', socket.inet_aton(a))[0] for a in addrs])
+        out = array.array('q', [0] * len(addrs))
+        self.assertEqual(pyt.lookup_array(ints, out), 3)
+        self.assertListEqual(list(out), expected)
+
+        packed = b''.join(socket.inet_aton(a) for a in addrs)
+        out = array.array('i', [0] * len(addrs))
+        self.assertEqual(pyt.lookup_array(packed, out), 3)
+        self.assertListEqual(list(out), expected)
+
+        # indexes follow modifications to the tree
+        pyt["10.2.0.0/16"] = 'd'
+        keys = pyt.keys()
+        pyt.lookup_array(packed, out)
+        self.assertEqual(keys[out[1]], "10.2.0.0/16")
+
+        with self.assertRaises(ValueError):
+            pyt.lookup_array(packed[:-1], out)
+        with self.assertRaises(ValueError):
+            pyt.lookup_array(packed, array.array('i', [0]))
+        with self.assertRaises(ValueError):
+            pyt.lookup_array(packed, array.array('d', [0] * len(addrs)))
+        with self.assertRaises(BufferError):
+            pyt.lookup_array(packed, b'\x00' * 16)
+
+    def testLookupArrayIP6(self):
+        import array
+        pyt = pytricia.PyTricia(128)
+        pyt["2001:db8::/32"] = 'a'
+        pyt["2001:db8:10::/48"] = 'b'
+        keys = pyt.keys()
+        addrs = ["2001:db8:10::1", "2001:db8:11::1", "fe80::1"]
+        packed = b''.join(socket.inet_pton(socket.AF_INET6, a) for a in addrs)
+        out = array.array('q', [0] * len(addrs))
+        self.assertEqual(pyt.lookup_array(packed, out), 2)
+        self.assertListEqual(list(out), [keys.index("2001:db8:10::/48"), keys.index("2001:db8::/32"), -1])
+
+        # a 2-d (N,16) byte buffer
+        view = memoryview(packed).cast('B', (len(addrs), 16))
+        out = array.array('q', [0] * len(addrs))
+        self.assertEqual(pyt.lookup_array(view, out), 2)
+
+        # a (hi, lo) pair of uint64 halves
+        ints = [int.from_bytes(socket.inet_pton(socket.AF_INET6, a), 'big') for a in addrs]
+        hi = array.array('Q', [a >> 64 for a in ints])
+        lo = array.array('Q', [a & (2**64 - 1) for a in ints])
+        out = array.array('q', [0] * len(addrs))
+        self.assertEqual(pyt.lookup_array((hi, lo), out), 2)
+        self.assertListEqual(list(out), [keys.index("2001:db8:10::/48"), keys.index("2001:db8::/32"), -1])
+        with self.assertRaises(ValueError):
+            pyt.lookup_array((hi, lo[:2]), out)
+        with self.assertRaises(ValueError):
+            pyt.lookup_array((hi, array.array('i', [0] * 6)), out)
+
+    def testIntKeysIP6(self):
+        pyt = pytricia.PyTricia(128)
+        pyt["2001:db8::/32"] = 'a'
+        pyt["10.0.0.0/8"] = 'b'
+        pyt["::/0"] = 'c'
+        v6 = int.from_bytes(socket.inet_pton(socket.AF_INET6, "2001:db8::1"), 'big')
+        self.assertEqual(pyt[v6], 'a')
+        self.assertEqual(pyt.get_key(v6), "2001:db8::/32")
+        self.assertEqual(pyt[2**128 - 1], 'c')
+        self.assertEqual(pyt[2**32], 'c')
+        # ints below 2**32 are still IPv4 addresses
+        self.assertEqual(pyt[0x0a010203], 'b')
+        pyt.insert(v6, 'd')
+        self.assertEqual(pyt.get_key(v6), "2001:db8::1/128")
+        with self.assertRaises(ValueError):
+            pyt[-1]
+        with self.assertRaises(ValueError):
+            pyt[2**128]
+
+        # in an AF_INET6 tree, every int is an IPv6 address
+        pyt = pytricia.PyTricia(128, socket.AF_INET6)
+        pyt["::1/128"] = 'a'
+        self.assertEqual(pyt.get(1), 'a')
+        pyt[1] = 'b'
+        self.assertEqual(list(pyt.items()), [("::1/128", 'b')])
+        pyt = pytricia.PyTricia.from_sorted([(1, 'a'), (2**32, 'b')], 128, socket.AF_INET6)
+        self.assertEqual(pyt.keys(), ["::1/128", "::1:0:0/128"])
+
+    def testLookupArrayThreads(self):
+        import array
+        import random
+        rng = random.Random(42)
+        pyt = pytricia.PyTricia()
+        for i in range(2000):
+            pyt.insert(rng.getrandbits(32), rng.randint(8, 32), i)
+        addrs = array.array('I', [rng.getrandbits(32) for i in range(10007)])
+
+        single = array.array('q', [0] * len(addrs))
+        nmatch = pyt.lookup_array(addrs, single)
+        for threads in (2, 3, 8, len(addrs) + 1):
+            out = array.array('q', [0] * len(addrs))
+            self.assertEqual(pyt.lookup_array(addrs, out, threads=threads), nmatch)
+            self.assertEqual(out, single)
+
+        pyt.freeze()
+        out = array.array('q', [0] * len(addrs))
+        self.assertEqual(pyt.lookup_array(addrs, out, threads=4), nmatch)
+        self.assertEqual(out, single)
+
+        self.assertEqual(pyt.lookup_array(array.array('I'), array.array('q'), threads=4), 0)
+        with self.assertRaises(ValueError):
+            pyt.lookup_array(addrs, out, threads=0)
+
+    def testConcurrentReaders(self):
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = "stable"
+        churn = ["20.{}.{}.0/24".format(i // 256, i % 256) for i in range(512)]
+        stop = threading.Event()
+        errors = []
+
+        def reader():
+            try:
+                while not stop.is_set():
+                    if pyt.get("10.1.2.3") != "stable":
+                        errors.append("lost 10.0.0.0/8")
+                    for p in churn[::37]:
+                        v = pyt.get(p)
+                        if v is not None and v != p:
+                            errors.append("{} -> {}".format(p, v))
+                    for k in pyt.keys():
+                        if k != "10.0.0.0/8" and k not in churn:
+                            errors.append("bad key " + k)
+            except Exception as e:
+                errors.append(repr(e))
+
+        threads = [threading.Thread(target=reader) for i in range(4)]
+        for t in threads:
+            t.start()
+        try:
+            for rnd in range(20):
+                for p in churn:
+                    pyt[p] = p
+                if rnd % 5 == 0:
+                    pyt.freeze()
+                    pyt.thaw()
+                for p in churn:
+                    del pyt[p]
+        finally:
+            stop.set()
+            for t in threads:
+                t.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(list(pyt), ["10.0.0.0/8"])
+
+    def testSnapshot(self):
+        import random
+        rng = random.Random(22)
+        pyt = pytricia.PyTricia()
+        prefixes = ["10.{}.{}.0/24".format(i // 64, i % 64 * 4) for i in range(256)]
+        prefixes += ["10.0.0.0/8", "10.1.0.0/16", "10.2.0.0/15"]
+        for p in prefixes[::2]:
+            pyt[p] = p
+        snaps = []
+        for rnd in range(40):
+            snaps.append((pyt.snapshot(), dict(pyt.items())))
+            for p in rng.sample(prefixes, 20):
+                if p in pyt.keys() and rng.random() < 0.5:
+                    del pyt[p]
+                else:
+                    pyt[p] = (p, rnd)
+            if rnd % 10 == 9:
+                snaps = snaps[::2]  # drop some while others still share nodes
+        for snap, expected in snaps:
+            self.assertEqual(dict(snap.items()), expected)
+            self.assertEqual(len(snap), len(expected))
+            ref = pytricia.PyTricia()
+            for p, v in expected.items():
+                ref[p] = v
+            for p in prefixes:
+                self.assertEqual(snap.has_key(p), p in expected)
+                self.assertEqual(snap.get_key(p), ref.get_key(p))
+        self.assertEqual(dict(snaps[-1][0].items()), snaps[-1][1])
+
+        snap = pyt.snapshot()
+        self.assertIs(snap.snapshot(), snap)
+        with self.assertRaises(ValueError):
+            snap["1.0.0.0/8"] = 1
+        with self.assertRaises(ValueError):
+            del snap["10.0.0.0/8"]
+        with self.assertRaises(ValueError):
+            snap.insert("1.0.0.0/8", 1)
+
+        # the snapshot outlives its tree
+        pyt["10.1.2.0/24"] = "x"
+        snap = pyt.snapshot()
+        pyt["10.1.2.0/24"] = "y"
+        del pyt
+        self.assertEqual(snap["10.1.2.3"], "x")
+        self.assertEqual(snap.get_key("10.1.2.3"), "10.1.2.0/24")
+
+    def testSnapshotParentAndIteration(self):
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = 1
+        pyt["10.1.0.0/16"] = 2
+        pyt["10.1.1.0/24"] = 3
+        snap = pyt.snapshot()
+        del pyt["10.1.0.0/16"]
+        pyt["10.1.1.128/25"] = 4
+        self.assertEqual(snap.parent("10.1.1.0/24"), "10.1.0.0/16")
+        self.assertEqual(pyt.parent("10.1.1.0/24"), "10.0.0.0/8")
+        self.assertEqual(snap.children("10.0.0.0/8"), ["10.1.0.0/16", "10.1.1.0/24"])
+        self.assertEqual(list(snap.iter_supernets("10.1.1.200")),
+                         ["10.1.1.0/24", "10.1.0.0/16", "10.0.0.0/8"])
+
+        # iterating over a snapshot while its tree changes
+        it = iter(snap)
+        first = next(it)
+        for i in range(100):
+            pyt["10.2.{}.0/24".format(i)] = i
+        del pyt["10.0.0.0/8"]
+        self.assertEqual([first] + list(it), ["10.0.0.0/8", "10.1.0.0/16", "10.1.1.0/24"])
+
+    def testSnapshotFreeze(self):
+        import array
+        pyt = pytricia.PyTricia()
+        for i in range(64):
+            pyt["10.{}.0.0/16".format(i)] = i
+        pyt.freeze()
+        snap = pyt.snapshot()
+        pyt.thaw()
+        for i in range(64):
+            pyt["10.{}.0.0/16".format(i)] = -i
+        pyt.freeze()
+        pyt.thaw()
+        self.assertEqual(snap["10.5.1.1"], 5)
+        self.assertEqual(pyt["10.5.1.1"], -5)
+
+        snap = pyt.snapshot()
+        addrs = array.array('I', [0x0a050101, 0x0b000000])
+        out = array.array('i', [0, 0])
+        self.assertEqual(snap.lookup_array(addrs, out), 1)
+        self.assertEqual(list(out), [snap.keys().index("10.5.0.0/16"), -1])
+        del pyt["10.5.0.0/16"]
+        snap.freeze()
+        self.assertEqual(snap["10.5.1.1"], -5)
+        snap.thaw()
+        with self.assertRaises(ValueError):
+            snap["1.0.0.0/8"] = 1
+        self.assertNotIn("10.5.0.0/16", pyt.keys())
+
+    def testConcurrentSnapshots(self):
+        pyt = pytricia.PyTricia()
+        churn = ["20.{}.{}.0/24".format(i // 256, i % 256) for i in range(512)]
+        stop = threading.Event()
+        errors = []
+
+        # prefixes go in and out in order, so a snapshot holds a run of them
+        def reader():
+            try:
+                while not stop.is_set():
+                    snap = pyt.snapshot()
+                    keys = snap.keys()
+                    if keys:
+                        first = churn.index(keys[0])
+                        if keys != churn[first:first + len(keys)]:
+                            errors.append("torn snapshot at " + keys[0])
+                    for k in keys[::17]:
+                        if snap[k] != k:
+                            errors.append("{} -> {}".format(k, snap[k]))
+            except Exception as e:
+                errors.append(repr(e))
+
+        threads = [threading.Thread(target=reader) for i in range(4)]
+        for t in threads:
+            t.start()
+        try:
+            for rnd in range(20):
+                for p in churn:
+                    pyt[p] = p
+                for p in churn:
+                    del pyt[p]
+        finally:
+            stop.set()
+            for t in threads:
+                t.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(len(pyt), 0)
+
+    def testSnapshotVersions(self):
+        # enough snapshot and write rounds to run out of node versions,
+        # with some snapshots kept across the renumbering
+        pyt = pytricia.PyTricia()
+        kept = []
+        for i in range(70000):
+            snap = pyt.snapshot()
+            pyt["10.{}.{}.0/24".format(i // 256 % 256, i % 256)] = i
+            if i % 10000 == 0:
+                kept.append((snap, i))
+        for snap, i in kept:
+            self.assertEqual(len(snap), i)
+            if i:
+                self.assertEqual(snap["10.{}.{}.1".format((i - 1) // 256, (i - 1) % 256)], i - 1)
+            self.assertIsNone(snap.get("10.{}.{}.1".format(i // 256, i % 256)))
+        self.assertEqual(pyt["10.0.0.1"], 65536)
+
+    def testBuildAsync(self):
+        src = {"10.{}.{}.0/24".format(i // 256, i % 256): i for i in range(3000)}
+        build = pytricia.PyTricia.build_async(src)
+        pyt = build.result()
+        self.assertTrue(build.done())
+        self.assertIs(build.result(), pyt)
+        self.assertEqual(len(pyt), 3000)
+        self.assertEqual(pyt["10.11.5.1"], 11 * 256 + 5)
+        with self.assertRaises(ValueError):
+            pyt["10.0.0.0/8"] = 1  # frozen
+
+        # pairs, with the last of a duplicate winning, constructor
+        # arguments and any key type
+        pairs = [("fe80::/64", 1), (socket.inet_pton(socket.AF_INET6, "2001:db8::"), 2), ("fe80::/64", 3)]
+        pyt = pytricia.PyTricia.build_async(pairs, 128, engine="poptrie").result()
+        self.assertEqual(pyt.keys(), ["2001:db8::/128", "fe80::/64"])
+        self.assertEqual(pyt["fe80::1"], 3)
+
+        # a pytricia as the source, and layouts
+        for layout in ("preorder", "bfs", "veb"):
+            other = pytricia.PyTricia.build_async(pyt, 128, layout=layout).result()
+            self.assertEqual(other.items(), pyt.items())
+
+        build = pytricia.PyTricia.build_async([("1.2.3.0/24", 1), ("1.2.3.4.5/24", 2)])
+        with self.assertRaises(ValueError):
+            build.result()
+        with self.assertRaises(TypeError):
+            pytricia.PyTricia.build_async([("1.2.3.0/24",)])
+        with self.assertRaises(ValueError):
+            pytricia.PyTricia.build_async([], 64, engine="dir24")
+        self.assertEqual(len(pytricia.PyTricia.build_async([]).result()), 0)
+
+    def testFromSorted(self):
+        import random
+        pairs = [("0.0.0.0/0", 0), ("10.0.0.0/8", 1), ("10.1.0.0/16", 2), ("10.1.2.0/24", 3),
+                 ("10.2.0.0/16", 4), ("192.168.0.0/16", 5), ("192.168.1.0/24", 6)]
+        ref = pytricia.PyTricia()
+        for prefix, value in pairs:
+            ref[prefix] = value
+        pyt = pytricia.PyTricia.from_sorted(pairs)
+        self.assertEqual(pyt.items(), ref.items())
+        self.assertEqual(pyt["10.1.2.3"], 3)
+        self.assertEqual(pyt.get_key("10.3.0.1"), "10.0.0.0/8")
+        self.assertEqual(pyt.parent("10.1.2.0/24"), "10.1.0.0/16")
+        self.assertEqual(sorted(pyt.children("10.0.0.0/8")), ["10.1.0.0/16", "10.1.2.0/24", "10.2.0.0/16"])
+        with self.assertRaises(ValueError):
+            pyt["11.0.0.0/8"] = 1  # frozen
+
+        # unsorted input is sorted first, and the last duplicate wins
+        shuffled = pairs + [("10.1.0.0/16", 7)]
+        random.Random(1).shuffle(shuffled)
+        shuffled.remove(("10.1.0.0/16", 7))
+        shuffled.append(("10.1.0.0/16", 7))
+        ref["10.1.0.0/16"] = 7
+        for layout in ("preorder", "bfs", "veb"):
+            for engine in ("trie", "poptrie"):
+                pyt = pytricia.PyTricia.from_sorted(shuffled, engine=engine, layout=layout)
+                self.assertEqual(pyt.items(), ref.items())
+                self.assertEqual(pyt["10.1.200.1"], 7)
+
+        pyt = pytricia.PyTricia.from_sorted({"2001:db8::/32": 1, "2001:db8:1::/48": 2}, 128, socket.AF_INET6)
+        self.assertEqual(pyt.get_key("2001:db8:1::1"), "2001:db8:1::/48")
+        self.assertEqual(len(pytricia.PyTricia.from_sorted([])), 0)
+        with self.assertRaises(ValueError):
+            pytricia.PyTricia.from_sorted([("1.2.3.0/24", 1), ("1.2.3.4.5/24", 2)])
+        with self.assertRaises(ValueError):
+            pytricia.PyTricia.from_sorted([("1.2.3.0/24", 1)], 16)
+        with self.assertRaises(TypeError):
+            pytricia.PyTricia.from_sorted([("1.2.3.0/24",)])
+
+    def testLoadPfx2as(self):
+        import gzip, io
+        text = b"# comment\n1.0.0.0\t24\t15169\n1.0.4.0\t22\t56203\r\n\n10.0.0.0 8 24151_24409\n2001:db8::\t32\t3333,4444"
+        pyt = pytricia.PyTricia(128)
+        self.assertEqual(pyt.load_pfx2as(io.BytesIO(text)), 4)
+        self.assertEqual(pyt.items(), [("1.0.0.0/24", 15169), ("1.0.4.0/22", 56203),
+                                       ("10.0.0.0/8", "24151_24409"), ("2001:db8::/32", "3333,4444")])
+
+        # gzipped, in more than one member, and reloading replaces values
+        data = gzip.compress(text[:40]) + gzip.compress(text[40:].replace(b"15169", b"1"))
+        self.assertEqual(pyt.load_pfx2as(io.BytesIO(data)), 4)
+        self.assertEqual(len(pyt), 4)
+
+        for bad in (b"1.0.0.0\t24\n", b"1.0.0.0\t33\t1\n", b"1.0.0\t24\t1\n", gzip.compress(text)[:-10]):
+            with self.assertRaises(ValueError):
+                pytricia.PyTricia(128).load_pfx2as(io.BytesIO(bad))
+        with self.assertRaises(ValueError):
+            pytricia.PyTricia().load_pfx2as(io.BytesIO(b"2001:db8::\t48\t1\n"))  # longer than maxbits
+        pyt.freeze()
+        with self.assertRaises(ValueError):
+            pyt.load_pfx2as(io.BytesIO(text))
+        with self.assertRaises(IOError):
+            pyt.load_pfx2as("/nonexistent/routeviews.pfx2as.gz")
+
+    def testSwapContents(self):
+        import weakref
+
+        class Value(object):
+            pass
+
+        live = pytricia.PyTricia()
+        for i in range(512):
+            live["20.{}.{}.0/24".format(i // 256, i % 256)] = Value()
+        values = [weakref.ref(v) for v in live.values()]
+        fresh = pytricia.PyTricia.build_async({"10.0.0.0/8": "ten"}, engine="dir24").result()
+        it = iter(live)
+        next(it)
+        if not FREE_THREADED:
+            # nothing would keep the nodes the iterator is at
+            with self.assertRaises(RuntimeError):
+                live.swap_contents(fresh)
+        self.assertEqual(len(list(it)), 511)
+        live.swap_contents(fresh)
+        self.assertEqual(live.items(), [("10.0.0.0/8", "ten")])
+        self.assertEqual(live["10.1.2.3"], "ten")
+        self.assertEqual(len(fresh), 512)
+        with self.assertRaises(ValueError):
+            live["11.0.0.0/8"] = 1  # the frozen state goes with the contents
+        fresh["21.0.0.0/8"] = 1
+        fresh.swap_contents(fresh)
+        del fresh
+        self.assertTrue(all(v() is None for v in values))
+
+        with self.assertRaises(TypeError):
+            live.swap_contents({})
+        with self.assertRaises(ValueError):
+            live.swap_contents(pytricia.PyTricia(128))
+        snap = live.snapshot()
+        with self.assertRaises(ValueError):
+            live.swap_contents(pytricia.PyTricia())
+        with self.assertRaises(ValueError):
+            snap.swap_contents(pytricia.PyTricia())
+        del snap
+        other = pytricia.PyTricia()
+        live.swap_contents(other)
+        self.assertEqual(len(live), 0)
+        self.assertEqual(other["10.1.2.3"], "ten")
+
+    def testSwapContentsFreesLater(self):
+        # a large tree is freed on a background thread once dropped
+        import time
+        import weakref
+
+        class Value(object):
+            pass
+
+        live = pytricia.PyTricia()
+        for i in range(70000):
+            live.insert(0x0a000000 + i, 32, Value())
+        first = weakref.ref(live[0x0a000000])
+        last = weakref.ref(live[0x0a000000 + 69999])
+        fresh = pytricia.PyTricia.build_async({"10.0.0.0/8": 1}).result()
+        live.swap_contents(fresh)
+        del fresh
+        for i in range(1000):
+            if first() is None and last() is None:
+                break
+            time.sleep(0.01)
+        self.assertIsNone(first())
+        self.assertIsNone(last())
+        self.assertEqual(live["10.0.0.1"], 1)
+
+    def testConcurrentSwaps(self):
+        sources = [{"10.{}.{}.0/24".format(i // 256, i % 256): n for i in range(1024)} for n in range(3)]
+        engines = ("trie", "dir24", "poptrie")
+        tables = [pytricia.PyTricia.build_async(sources[n], engine=engines[n]).result() for n in range(3)]
+        live = pytricia.PyTricia()
+        stop = threading.Event()
+        errors = []
+
+        # every lookup sees one whole table or another, never a mix
+        def reader():
+            try:
+                while not stop.is_set():
+                    n = live.get("10.3.7.1")
+                    if n is not None and n not in (0, 1, 2):
+                        errors.append(n)
+                    values = set(live.get_many(["10.0.0.1", "10.3.255.1"]))
+                    values.discard(None)
+                    for n in values:
+                        if n not in (0, 1, 2):
+                            errors.append(n)
+            except Exception as e:
+                errors.append(repr(e))
+
+        threads = [threading.Thread(target=reader) for i in range(4)]
+        for t in threads:
+            t.start()
+        try:
+            for rnd in range(60):
+                n = rnd % 3
+                live.swap_contents(tables[n])
+                tables[n] = pytricia.PyTricia.build_async(sources[n], engine=engines[n]).result()
+        finally:
+            stop.set()
+            for t in threads:
+                t.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(len(live), 1024)
+
+    def testLookupArrayInterleave(self):
+        import array
+        import random
+        rng = random.Random(13)
+        ref = pytricia.PyTricia()
+        for i in range(3000):
+            ref.insert(rng.getrandbits(32), rng.randint(0, 32), i)
+        addrs = [rng.getrandbits(32) for i in range(3000)]
+        addrs += [struct.unpack("!I", socket.inet_aton(p.split('/')[0]))[0] for p in ref]
+        keys = [socket.inet_ntoa(struct.pack("!I", a)) for a in addrs]
+        expect = [ref.get(k) for k in keys]
+
+        for freeze in (None, "trie", "dir24"):
+            pyt = pytricia.PyTricia()
+            for prefix in ref:
+                pyt[prefix] = ref[prefix]
+            if freeze:
+                pyt.freeze(engine=freeze)
+            single = array.array('q', [0] * len(addrs))
+            nmatch = pyt.lookup_array(array.array('I', addrs), single, interleave=1)
+            for interleave in (2, 7, 16, 32):
+                out = array.array('q', [0] * len(addrs))
+                self.assertEqual(pyt.lookup_array(array.array('I', addrs), out, interleave=interleave), nmatch)
+                self.assertEqual(out, single)
+            self.assertEqual(pyt.get_many(keys), expect)
+            self.assertEqual(pyt.contains_many(keys), [v is not None for v in expect])
+
+        with self.assertRaises(ValueError):
+            pyt.lookup_array(array.array('I', addrs), out, interleave=0)
+        with self.assertRaises(ValueError):
+            pyt.lookup_array(array.array('I', addrs), out, interleave=33)
+
+    def testLookupArraySimd(self):
+        import os
+        import subprocess
+        script = """
+import array, random, pytricia
+rng = random.Random(17)
+pyt = pytricia.PyTricia()
+for i in range(5000):
+    pyt.insert(rng.getrandbits(32), rng.randint(8, 32), i)
+addrs = array.array('I', [rng.getrandbits(32) for i in range(4099)])
+expect = array.array('q', [0] * len(addrs))
+pyt.lookup_array(addrs, expect)
+pyt.freeze(engine='dir24')
+out = array.array('q', [0] * len(addrs))
+pyt.lookup_array(addrs, out)
+print(pytricia.simd, out == expect, sum(expect))
+"""
+        env = dict(os.environ)
+        env['PYTHONPATH'] = os.path.dirname(os.path.abspath(pytricia.__file__))
+        results = set()
+        for simd in ('scalar', 'avx2', 'avx512'):
+            env['PYTRICIA_SIMD'] = simd
+            output = subprocess.check_output([sys.executable, '-c', script], env=env).decode().split()
+            self.assertIn(output[0], ('scalar', 'avx2', 'avx512'))
+            self.assertEqual(output[1], 'True')
+            results.add(output[2])
+        self.assertEqual(len(results), 1)
+
+    def testBitBoundaries(self):
+        # prefixes that first differ on either side of byte and 64-bit word
+        # boundaries
+        pyt = pytricia.PyTricia(128)
+        base = 0x20010db8 << 96
+        bits = (7, 8, 9, 31, 32, 33, 63, 64, 65, 127)
+        for bit in bits:
+            addr = base | (1 << (127 - bit))
+            pyt.insert(addr.to_bytes(16, 'big'), bit + 1, bit)
+        pyt.insert(base.to_bytes(16, 'big'), 32, "base")
+        for bit in bits:
+            addr = base | (1 << (127 - bit))
+            self.assertEqual(pyt.get(addr.to_bytes(16, 'big')), bit)
+            if bit < 127:
+                self.assertEqual(pyt.get((addr | 1).to_bytes(16, 'big')), bit)
+            if bit >= 32:
+                self.assertEqual(pyt.get((base | 2).to_bytes(16, 'big')), "base")
+        self.assertEqual(pyt.parent("2001:db8:0:0:8000::/65"), "2001:db8::/32")
+        self.assertEqual(pyt.parent("2001:db8::1/128"), "2001:db8::/32")
+        self.assertIn("2001:db8::1/128", pyt.children("2001:db8::/32"))
+
+        pyt = pytricia.PyTricia(32)
+        pyt["10.0.0.0/8"] = 8
+        pyt["10.128.0.0/9"] = 9
+        pyt["10.0.0.0/7"] = 7
+        pyt["11.0.0.0/8"] = 11
+        self.assertEqual(pyt["10.127.255.255"], 8)
+        self.assertEqual(pyt["10.128.0.0"], 9)
+        self.assertEqual(pyt["11.0.0.1"], 11)
+        self.assertEqual(pyt.parent("10.128.0.0/9"), "10.0.0.0/8")
+        self.assertEqual(pyt.parent("10.0.0.0/8"), "10.0.0.0/7")
+
+    def testStringParsing(self):
+        import random
+        import re
+        rng = random.Random(23)
+
+        def expected(s):
+            # what inet_pton and strtol make of s
+            if '.' not in s and ':' not in s:
+                return None
+            addr, sep, plen = s.partition('/')
+            family, maxbits = (socket.AF_INET6, 128) if ':' in addr else (socket.AF_INET, 32)
+            try:
+                packed = socket.inet_pton(family, addr)
+            except (OSError, socket.error, ValueError):
+                return None
+            bitlen = maxbits
+            if plen:
+                m = re.match(r'\s*([+-]?\d+)', plen)
+                bitlen = int(m.group(1)) if m else 0
+                if bitlen < 0 or bitlen > maxbits:
+                    bitlen = maxbits
+            return "{}/{}".format(socket.inet_ntop(family, packed), bitlen)
+
+        def random_v4():
+            s = '.'.join(str(rng.randint(0, 255)) for i in range(4))
+            return s if rng.random() < 0.3 else s + '/' + str(rng.randint(0, 40))
+
+        def random_v6():
+            groups = [format(rng.getrandbits(16) if rng.random() < 0.6 else 0, 'x') for i in range(8)]
+            if rng.random() < 0.3:
+                groups = [g.upper() for g in groups]
+            if rng.random() < 0.2:
+                groups = [g.zfill(4) for g in groups]
+            s = ':'.join(groups)
+            if rng.random() < 0.5:
+                start = rng.randint(0, 7)
+                end = rng.randint(start + 1, 8)
+                s = ':'.join(groups[:start]) + '::' + ':'.join(groups[end:])
+            if rng.random() < 0.1:
+                s = '::ffff:' + random_v4().split('/')[0]
+            return s if rng.random() < 0.3 else s + '/' + str(rng.randint(0, 140))
+
+        def mutate(s):
+            i = rng.randrange(len(s) + 1)
+            op = rng.randint(0, 2)
+            c = rng.choice('0123456789abcdefABCDEF:./xg ')
+            if op == 0:
+                return s[:i] + c + s[i:]
+            if op == 1:
+                return s[:i] + s[i + 1:]
+            return s[:i] + c + s[i + 1:]
+
+        strings = ["1.2.3.4", "01.2.3.4", "1.2.3.04", "256.1.1.1", "1.2.3", "1.2.3.4.5",
+                   "1.2.3.4/", "1.2.3.4/32", "1.2.3.4/33", "1.2.3.4/08", "1.2.3.4/8x",
+                   "::1", "1::", "::/0", "1::2::3", "1:::2", ":1::", "1:2:3:4:5:6:7:8",
+                   "1:2:3:4:5:6:7:8:9", "1:2:3:4:5:6:7::", "::2:3:4:5:6:7:8", "::12345",
+                   "fe80::1/64", "FE80::ABCD/10", "::ffff:1.2.3.4", "2001:db8::/129"]
+        for i in range(3000):
+            s = random_v4() if i % 2 else random_v6()
+            strings.append(s)
+            strings.append(mutate(s))
+            strings.append(mutate(mutate(s)))
+
+        for s in strings:
+            if len(s) < 4:
+                continue
+            expect = expected(s)
+            pyt = pytricia.PyTricia(128)
+            if expect is None:
+                with self.assertRaises(ValueError, msg=s):
+                    pyt.insert(s, 1)
+            else:
+                pyt.insert(s, 1)
+                self.assertEqual(list(pyt), [expect], msg=s)
+                self.assertEqual(pyt.get_many([s]), [1])
+
+    def testIpaddressKeys(self):
+        import ipaddress
+        import random
+        rng = random.Random(29)
+        pyt = pytricia.PyTricia(128)
+        pyt[ipaddress.ip_network("10.0.0.0/8")] = "v4"
+        pyt[ipaddress.IPv4Network("10.1.2.3/24", strict=False)] = "v4/24"
+        pyt[ipaddress.ip_network("2001:db8::/32")] = "v6"
+        pyt[ipaddress.ip_network("::/0")] = "default"
+        self.assertEqual(sorted(pyt), ["10.0.0.0/8", "10.1.2.0/24", "2001:db8::/32", "::/0"])
+
+        self.assertEqual(pyt[ipaddress.ip_address("10.1.2.255")], "v4/24")
+        self.assertEqual(pyt[ipaddress.ip_address("10.1.3.0")], "v4")
+        self.assertEqual(pyt[ipaddress.ip_address("2001:db8:ffff:ffff:ffff:ffff:ffff:ffff")], "v6")
+        self.assertEqual(pyt[ipaddress.ip_address("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff")], "default")
+        self.assertEqual(pyt.get_key(ipaddress.ip_network("2001:db8:1::/48")), "2001:db8::/32")
+        self.assertEqual(pyt.get_key(ipaddress.ip_network("10.1.2.128/25")), "10.1.2.0/24")
+        self.assertTrue(ipaddress.ip_network("10.0.0.0/8") in pyt)
+        self.assertFalse(pyt.has_key(ipaddress.ip_network("10.0.0.0/9")))
+
+        # subclasses, like the Interface types, take the general path
+        class MyAddress(ipaddress.IPv4Address):
+            pass
+        self.assertEqual(pyt[ipaddress.ip_interface("10.1.2.3/16")], "v4/24")
+        self.assertEqual(pyt[MyAddress("10.9.9.9")], "v4")
+
+        for i in range(200):
+            v4 = ipaddress.IPv4Address(rng.getrandbits(32))
+            v6 = ipaddress.IPv6Address(rng.getrandbits(128))
+            self.assertEqual(pyt.get_key(v4), pyt.get_key(str(v4)))
+            self.assertEqual(pyt.get_key(v6), pyt.get_key(str(v6)))
+
+    @unittest.skipIf(FREE_THREADED, "caches are off in free-threaded builds")
+    def testNodeKeys(self):
+        import random
+        rng = random.Random(31)
+        pyt = pytricia.PyTricia(128)
+        expected = set()
+        for i in range(500):
+            if i % 2:
+                packed = struct.pack('>I', rng.getrandbits(32))
+                plen = rng.randint(0, 32)
+                family = socket.AF_INET
+            else:
+                packed = rng.getrandbits(128).to_bytes(16, 'big')
+                if i % 3 == 0:
+                    packed = bytes(10) + b'\xff\xff' + packed[12:]
+                plen = rng.randint(0, 128)
+                family = socket.AF_INET6
+            pyt.insert(packed, plen, i)
+            expected.add(pyt.get_key((packed, plen)))
+        # keys are formatted like inet_ntop, with the prefix length appended
+        for key in pyt:
+            net, plen = key.split('/')
+            family = socket.AF_INET6 if ':' in net else socket.AF_INET
+            self.assertEqual(socket.inet_ntop(family, socket.inet_pton(family, net)), net)
+        self.assertEqual(set(pyt.keys()), expected)
+
+        pyt.enable_node_keys()
+        keys = pyt.keys()
+        self.assertEqual(set(keys), expected)
+        self.assertTrue(all(a is b for a, b in zip(keys, pyt.keys())))
+        self.assertTrue(all(a is b for a, b in zip(keys, pyt)))
+        self.assertIs(pyt.get_key(keys[0]), keys[0])
+
+        # a deleted and reinserted prefix gets a new key object
+        value = pyt[keys[0]]
+        del pyt[keys[0]]
+        pyt[keys[0]] = value
+        self.assertIsNot(pyt.get_key(keys[0]), keys[0])
+        self.assertEqual(pyt.get_key(keys[0]), keys[0])
+
+        pyt.freeze()
+        self.assertTrue(all(a is b for a, b in zip(pyt.keys(), pyt)))
+        clone = pickle.loads(pickle.dumps(pyt))
+        self.assertEqual(clone.keys(), pyt.keys())
+        pyt.thaw()
+        pyt.enable_node_keys(False)
+        self.assertIsNot(pyt.keys()[1], keys[1])
+        self.assertEqual(pyt.keys()[1], keys[1])
+
+    @unittest.skipIf(FREE_THREADED, "caches are off in free-threaded builds")
+    def testKeyCache(self):
+        import ipaddress
+        import random
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = "a"
+        pyt["10.1.0.0/16"] = "b"
+        self.assertEqual(pyt.stats()["key_cache_size"], 0)
+
+        pyt.enable_key_cache(1000)
+        stats = pyt.stats()
+        self.assertEqual(stats["key_cache_size"], 1024)
+        self.assertEqual(stats["key_cache_hits"], 0)
+
+        key = "10.1.2.3"
+        self.assertEqual(pyt[key], "b")
+        self.assertEqual(pyt.get(key), "b")
+        # an equal string that is a different object hits as well
+        self.assertEqual(pyt.get_key(''.join(["10.1.", "2.3"])), "10.1.0.0/16")
+        self.assertTrue(key in pyt)
+        stats = pyt.stats()
+        self.assertEqual(stats["key_cache_misses"], 1)
+        self.assertEqual(stats["key_cache_hits"], 3)
+
+        addr = ipaddress.ip_address("10.2.3.4")
+        self.assertEqual(pyt.get_many([addr, addr, addr]), ["a", "a", "a"])
+        self.assertEqual(pyt.stats()["key_cache_hits"], 5)
+
+        # ints and bytes don't go through the cache
+        self.assertEqual(pyt.get(struct.unpack("!I", socket.inet_aton("10.1.2.3"))[0]), "b")
+        self.assertEqual(pyt.stats()["key_cache_misses"], 2)
+
+        with self.assertRaises(ValueError):
+            pyt["10.1.2.x"]
+        with self.assertRaises(ValueError):
+            pyt["10.1.2.x"]
+
+        # a tiny cache with lots of collisions still answers correctly
+        pyt.enable_key_cache(2)
+        rng = random.Random(3)
+        keys = ["10.%d.%d.%d" % (rng.randint(0, 2), rng.randint(0, 255), rng.randint(0, 255)) for i in range(200)]
+        for k in keys * 3:
+            self.assertEqual(pyt.get(k), "b" if k.startswith("10.1.") else "a")
+        stats = pyt.stats()
+        self.assertEqual(stats["key_cache_hits"] + stats["key_cache_misses"], 600)
+
+        pyt.enable_key_cache(0)
+        self.assertEqual(pyt.stats()["key_cache_size"], 0)
+        self.assertEqual(pyt[key], "b")
+        self.assertEqual(pyt.stats()["key_cache_hits"], 0)
+        with self.assertRaises(ValueError):
+            pyt.enable_key_cache(-1)
+
+    @unittest.skipIf(FREE_THREADED, "caches are off in free-threaded builds")
+    def testResultCache(self):
+        pyt = pytricia.PyTricia(128)
+        pyt["10.0.0.0/8"] = "a"
+        pyt["a01:203::/64"] = "v6"
+        pyt.enable_result_cache(100)
+        stats = pyt.stats()
+        self.assertEqual(stats["result_cache_size"], 128)
+        self.assertEqual(stats["result_cache_hit_rate"], 0.0)
+
+        self.assertEqual(pyt["10.1.2.3"], "a")
+        self.assertEqual(pyt.get("10.1.2.3"), "a")
+        self.assertEqual(pyt.get_key("10.1.2.3"), "10.0.0.0/8")
+        self.assertIsNone(pyt.get("11.1.2.3"))
+        self.assertFalse("11.1.2.3" in pyt)
+        stats = pyt.stats()
+        self.assertEqual((stats["result_cache_hits"], stats["result_cache_misses"]), (3, 2))
+        self.assertEqual(stats["result_cache_hit_rate"], 0.6)
+
+        # inserts and deletes invalidate cached results
+        pyt["10.1.0.0/16"] = "b"
+        self.assertEqual(pyt["10.1.2.3"], "b")
+        pyt["11.0.0.0/8"] = "c"
+        self.assertEqual(pyt.get("11.1.2.3"), "c")
+        del pyt["10.1.0.0/16"]
+        self.assertEqual(pyt["10.1.2.3"], "a")
+        # the same bytes as an IPv6 address are a different key
+        self.assertEqual(pyt.get("a01:203::"), "v6")
+        self.assertEqual(pyt.get_many(["10.1.2.3", "10.1.2.3/16", "a01:203::"]), ["a", "a", "v6"])
+
+        # freezing and thawing move the nodes
+        pyt.freeze()
+        self.assertEqual(pyt["10.1.2.3"], "a")
+        hits = pyt.stats()["result_cache_hits"]
+        self.assertEqual(pyt["10.1.2.3"], "a")
+        self.assertEqual(pyt.stats()["result_cache_hits"], hits + 1)
+        pyt.thaw()
+        self.assertEqual(pyt["10.1.2.3"], "a")
+        pyt.freeze(layout="veb")
+        self.assertEqual(pyt.get_key("11.1.2.3"), "11.0.0.0/8")
+
+        pyt.enable_result_cache(0)
+        self.assertEqual(pyt.stats()["result_cache_size"], 0)
+        self.assertEqual(pyt["10.1.2.3"], "a")
+        self.assertEqual(pyt.stats()["result_cache_hits"], 0)
+
+    def testFrozenSearch(self):
+        import random
+        rng = random.Random(5)
+        for maxbits, nbytes in ((32, 4), (128, 16)):
+            ref = pytricia.PyTricia(maxbits)
+            for i in range(2000):
+                ref.insert(rng.getrandbits(maxbits).to_bytes(nbytes, 'big'), rng.randint(0, maxbits), i)
+            pyt = pytricia.PyTricia(maxbits)
+            for prefix in ref:
+                pyt[prefix] = ref[prefix]
+            pyt.freeze()
+
+            probes = list(ref)
+            for prefix in list(ref)[:500]:
+                net, plen = prefix.split('/')
+                probes.append("%s/%d" % (net, max(0, int(plen) - 1)))
+                probes.append("%s/%d" % (net, min(maxbits, int(plen) + 1)))
+            for i in range(500):
+                probes.append((rng.getrandbits(maxbits).to_bytes(nbytes, 'big'), rng.randint(0, maxbits)))
+            for p in probes:
+                self.assertEqual(pyt.has_key(p), ref.has_key(p))
+                self.assertEqual(pyt.get(p), ref.get(p))
+                self.assertEqual(pyt.get_key(p), ref.get_key(p))
+            for prefix in ref:
+                self.assertEqual(pyt.parent(prefix), ref.parent(prefix))
+            # the walks go over the frozen block's entries
+            self.assertEqual(list(pyt.items()), list(ref.items()))
+            for prefix in list(ref)[:200]:
+                self.assertEqual(pyt.children(prefix), ref.children(prefix))
+                self.assertEqual(list(pyt.iter_children(prefix)), list(ref.iter_children(prefix)))
+            keys = sorted(rng.sample(list(ref), 2), key=lambda k: list(ref).index(k))
+            self.assertEqual(list(pyt.iter_range(*keys)), list(ref.iter_range(*keys)))
+            self.assertEqual(list(pyt.iter_range(keys[0], keys[1], keys[0])),
+                             list(ref.iter_range(keys[0], keys[1], keys[0])))
+
+    def testFreezeLayout(self):
+        import random
+        rng = random.Random(9)
+        ref = pytricia.PyTricia(128)
+        for i in range(2000):
+            ref.insert(rng.getrandbits(128).to_bytes(16, 'big'), rng.randint(0, 64), i)
+        probes = [rng.getrandbits(128).to_bytes(16, 'big') for i in range(2000)] + list(ref)
+
+        for layout in ("bfs", "veb", "preorder"):
+            pyt = pytricia.PyTricia(128)
+            for prefix in ref:
+                pyt[prefix] = ref[prefix]
+            pyt.freeze(layout=layout)
+            self.assertEqual(list(pyt), list(ref))
+            for p in probes:
+                self.assertEqual(pyt.get_key(p), ref.get_key(p))
+                self.assertEqual(pyt.get(p), ref.get(p))
+            for prefix in list(ref)[:200]:
+                self.assertEqual(pyt.parent(prefix), ref.parent(prefix))
+                self.assertEqual(pyt.children(prefix), ref.children(prefix))
+
+            # a frozen tree can be moved to another layout, and keeps its engine
+            pyt.freeze(engine="poptrie", layout="veb")
+            pyt2 = pickle.loads(pickle.dumps(pyt))
+            for p in probes[:500]:
+                self.assertEqual(pyt.get(p), ref.get(p))
+                self.assertEqual(pyt2.get(p), ref.get(p))
+            pyt.thaw()
+            pyt["::/0"] = "default"
+            self.assertEqual(pyt.get(b"\xff" * 16), ref.get(b"\xff" * 16) or "default")
+
+        empty = pytricia.PyTricia()
+        empty.freeze(layout="veb")
+        empty.freeze(layout="bfs")
+        self.assertEqual(len(empty), 0)
+        with self.assertRaises(ValueError):
+            empty.freeze(layout="bogus")
+
+    def testFreezeWhileIterating(self):
+        pyt = pytricia.PyTricia()
+        for i in range(100):
+            pyt["10.%d.0.0/16" % i] = i
+        pyt.freeze()
+        it = iter(pyt)
+        next(it)
+        if FREE_THREADED:
+            # the nodes the iterator is at are freed once it is done
+            pyt.freeze(layout="bfs")
+            pyt.thaw()
+            self.assertEqual(len(list(it)), 99)
+            return
+        with self.assertRaises(RuntimeError):
+            pyt.freeze(layout="bfs")
+        with self.assertRaises(RuntimeError):
+            pyt.thaw()
+        pyt.freeze(engine="poptrie")  # the nodes stay where they are
+        self.assertEqual(len(list(it)), 99)
+        # an exhausted or dropped iterator holds nothing back
+        pyt.freeze(layout="bfs")
+        pyt.thaw()
+        it = iter(pyt)
+        next(it)
+        with self.assertRaises(RuntimeError):
+            pyt.freeze()
+        del it
+        pyt.freeze()
+        self.assertEqual(len(pyt), 100)
+
+    def testFreezeDir24(self):
+        import array
+        import random
+        rng = random.Random(7)
+        ref = pytricia.PyTricia()
+        ref.insert("0.0.0.0/0", "default")
+        for i in range(3000):
+            ref.insert(rng.getrandbits(32), rng.randint(1, 32), i)
+        ref.insert("10.1.2.0/24", "c24")
+        ref.insert("10.1.2.128/25", "c25")
+        ref.insert("10.1.2.129/32", "host")
+        ref.insert("10.1.0.0/16", "b16")
+
+        pyt = pytricia.PyTricia()
+        for prefix in ref:
+            pyt[prefix] = ref[prefix]
+        pyt.freeze(engine="dir24")
+
+        self.assertEqual(pyt["10.1.2.129"], "host")
+        self.assertEqual(pyt["10.1.2.130"], "c25")
+        self.assertEqual(pyt["10.1.2.1"], "c24")
+        self.assertEqual(pyt["10.1.3.1"], "b16")
+        self.assertEqual(pyt.get_key("10.1.2.130"), "10.1.2.128/25")
+        self.assertEqual(pyt["10.1.2.0/24"], "c24")
+        self.assertEqual(pyt["10.1.2.0/23"], "b16")
+
+        addrs = [rng.getrandbits(32) for i in range(20000)]
+        addrs += [struct.unpack("!I", socket.inet_aton("10.1.2.%d" % i))[0] for i in range(256)]
+        for a in addrs:
+            self.assertEqual(pyt.get(a), ref.get(a))
+        expect = array.array('q', [0] * len(addrs))
+        out = array.array('q', [0] * len(addrs))
+        ref.lookup_array(array.array('I', addrs), expect)
+        pyt.lookup_array(array.array('I', addrs), out)
+        self.assertEqual(out, expect)
+
+        # engine survives pickling, and thawing drops back to the trie
+        pyt2 = pickle.loads(pickle.dumps(pyt))
+        for a in addrs[:2000]:
+            self.assertEqual(pyt2.get(a), ref.get(a))
+        pyt.thaw()
+        pyt["10.1.2.130/32"] = "new"
+        self.assertEqual(pyt["10.1.2.130"], "new")
+        pyt.freeze(engine="dir24")
+        self.assertEqual(pyt["10.1.2.130"], "new")
+        pyt.freeze()
+        self.assertEqual(pyt["10.1.2.131"], "c25")
+
+        empty = pytricia.PyTricia()
+        empty.freeze(engine="dir24")
+        self.assertIsNone(empty.get("1.2.3.4"))
+
+        with self.assertRaises(ValueError):
+            pytricia.PyTricia().freeze(engine="bogus")
+        with self.assertRaises(ValueError):
+            pytricia.PyTricia(128).freeze(engine="dir24")
+
+    @unittest.skipUnless(sys.platform.startswith("linux"), "needs RLIMIT_AS and /proc")
+    def testFreezeOutOfMemory(self):
+        # in a process of its own, as it caps the memory it may map
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = 'a'
+        pyt.freeze(engine="dir24")
+        q = Queue()
+        p = Process(target=engineOutOfMemory, args=(q, pickle.dumps(pyt)))
+        p.start()
+        p.join()
+        self.assertFalse(q.empty(), "No result received from subprocess")
+        status, msg = q.get()
+        self.assertEqual(status, "success", msg)
+
+    def testFreezePoptrie(self):
+        import random
+        rng = random.Random(11)
+        for maxbits, nbytes in ((128, 16), (64, 16), (32, 4)):
+            ref = pytricia.PyTricia(maxbits)
+            prefixes = []
+            for i in range(3000):
+                plen = rng.randint(0, maxbits)
+                addr = rng.getrandbits(maxbits) << (nbytes * 8 - maxbits)
+                prefixes.append((addr, plen))
+                # nest a longer prefix under some of them
+                if i % 4 == 0 and plen < maxbits:
+                    prefixes.append((addr, rng.randint(plen + 1, min(maxbits, plen + 12))))
+            for addr, plen in prefixes:
+                ref.insert(addr.to_bytes(nbytes, 'big'), plen, (addr, plen))
+
+            pyt = pytricia.PyTricia(maxbits)
+            for prefix in ref:
+                pyt[prefix] = ref[prefix]
+            pyt.freeze(engine="poptrie")
+
+            addrs = [rng.getrandbits(nbytes * 8) for i in range(3000)]
+            for addr, plen in prefixes:
+                addrs.append(addr | rng.getrandbits(nbytes * 8 - plen))
+            for a in addrs:
+                key = a.to_bytes(nbytes, 'big')
+                self.assertEqual(pyt.get(key), ref.get(key))
+                self.assertEqual(pyt.get_key(key), ref.get_key(key))
+
+            pyt2 = pickle.loads(pickle.dumps(pyt))
+            for a in addrs[:500]:
+                key = a.to_bytes(nbytes, 'big')
+                self.assertEqual(pyt2.get(key), ref.get(key))
+
+        pyt = pytricia.PyTricia(128)
+        pyt["::/0"] = "default"
+        pyt["2001:db8::/32"] = "doc"
+        pyt.freeze(engine="poptrie")
+        self.assertEqual(pyt["2001:db8::1"], "doc")
+        self.assertEqual(pyt["2001:db9::1"], "default")
+        pyt.thaw()
+        del pyt["::/0"]
+        pyt.freeze(engine="poptrie")
+        self.assertIsNone(pyt.get("2001:db9::1"))
+        self.assertEqual(pyt.get("2001:db8:ffff::1"), "doc")
+
     def testChildren(self):
         pyt = pytricia.PyTricia()
         pyt.insert("42.0.0.0/8", "0")
@@ -389,6 +1537,94 @@ class PyTriciaTests(unittest.TestCase):
             pyt.parent("2001:db8:42:42::/64")
         self.assertIsInstance(cm.exception, KeyError)
 
+    def testIterChildrenSupernets(self):
+        import ipaddress
+        import random
+        rng = random.Random(37)
+        pyt = pytricia.PyTricia()
+        nets = set()
+        for i in range(400):
+            plen = rng.randint(0, 20)
+            net = ipaddress.ip_network((rng.getrandbits(plen) << (32 - plen), plen))
+            nets.add(net)
+            pyt[str(net)] = i
+        for i in range(50):
+            del pyt[str(nets.pop())]
+
+        for net in nets:
+            key = str(net)
+            self.assertListEqual(list(pyt.iter_children(key)), pyt.children(key))
+            supers = sorted((n for n in nets if net.subnet_of(n)), key=lambda n: -n.prefixlen)
+            self.assertListEqual(list(pyt.iter_supernets(key)), [str(n) for n in supers])
+            self.assertEqual(pyt.parent(key), str(supers[1]) if len(supers) > 1 else None)
+        for i in range(200):
+            addr = str(ipaddress.ip_address(rng.getrandbits(32)))
+            supers = list(pyt.iter_supernets(addr))
+            self.assertEqual(supers[0] if supers else None, pyt.get_key(addr))
+            self.assertListEqual(supers, [str(n) for n in sorted(nets, key=lambda n: -n.prefixlen) 
+                                          if ipaddress.ip_address(addr) in n])
+
+        pyt.freeze(engine='dir24')
+        self.assertListEqual(list(pyt.iter_supernets("255.255.255.255")), 
+                             [str(n) for n in sorted(nets, key=lambda n: -n.prefixlen) if n.broadcast_address == ipaddress.ip_address("255.255.255.255")])
+        with self.assertRaises(KeyError):
+            pyt.iter_children("10.42.42.0/24")
+        self.assertListEqual(list(pytricia.PyTricia().iter_supernets("1.2.3.4")), [])
+
+    def testIterRange(self):
+        import ipaddress
+        import itertools
+        import random
+        rng = random.Random(41)
+        for maxbits in (32, 128):
+            pyt = pytricia.PyTricia(maxbits)
+            nets = set()
+            for i in range(300):
+                plen = rng.randint(0, 24 if maxbits == 32 else 72)
+                value = rng.getrandbits(plen) << (maxbits - plen)
+                if maxbits == 128:
+                    value |= 0x20010db8 << 96
+                    plen = max(plen, 32)
+                nets.add(ipaddress.ip_network((value, plen)))
+            for net in nets:
+                pyt[str(net)] = 1
+            for net in rng.sample(sorted(nets), 30):
+                del pyt[str(net)]
+            keys = pyt.keys()
+            nets = [ipaddress.ip_network(k) for k in keys]
+
+            for i in range(100):
+                a, b = sorted(n.network_address + rng.randrange(n.num_addresses) for n in rng.sample(nets, 2))
+                expect = [str(n) for n in nets if n.network_address <= b and n.broadcast_address >= a]
+                self.assertListEqual(list(pyt.iter_range(str(a), str(b))), expect)
+
+                # page through the same range three prefixes at a time
+                pages, after = [], None
+                while True:
+                    args = (str(a), str(b)) if after is None else (str(a), str(b), after)
+                    page = list(itertools.islice(pyt.iter_range(*args), 3))
+                    if not page:
+                        break
+                    pages.extend(page)
+                    after = page[-1]
+                self.assertListEqual(pages, expect)
+
+            # the range may be given by prefixes, and the cursor need not be in the tree
+            some = nets[len(nets) // 2]
+            expect = [str(n) for n in nets if n.overlaps(some)]
+            self.assertListEqual(list(pyt.iter_range(str(some), str(some))), expect)
+            self.assertListEqual(list(pyt.iter_range(keys[0], keys[-1], keys[-1])), [])
+            self.assertListEqual(list(pyt.iter_range(str(nets[-1].broadcast_address), str(nets[0].network_address))), [])
+
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = 'a'
+        pyt["10.1.0.0/16"] = 'b'
+        pyt["10.2.0.0/16"] = 'c'
+        self.assertListEqual(list(pyt.iter_range("10.1.0.0", "10.1.255.255")), ["10.0.0.0/8", "10.1.0.0/16"])
+        self.assertListEqual(list(pyt.iter_range("10.0.0.0/8", "10.0.0.0/8", "10.1.128.0/17")), ["10.2.0.0/16"])
+        with self.assertRaises(ValueError):
+            pyt.iter_range("10.0.0.0", "bogus")
+
     def testExceptions(self):
         pyt = pytricia.PyTricia(32)
         with self.assertRaises(ValueError) as cm:
@@ -643,6 +1879,43 @@ def basicAsserts(q, pickled_data):
         return
     q.put(('success',None))
 
+def engineOutOfMemory(q, pickled_data):
+    # a failed engine build leaves the tree as it was
+    try:
+        import resource
+        state = pickle.loads(pickled_data).__reduce__()[2]
+        frozen = pytricia.PyTricia()
+        thawed = pytricia.PyTricia()
+        for i in range(256):
+            frozen["10.%d.0.0/16" % i] = i
+            thawed["10.%d.0.0/16" % i] = i
+        frozen.freeze()
+        fresh = pytricia.PyTricia()
+        with open("/proc/self/status") as f:
+            vmsize = [int(l.split()[1]) * 1024 for l in f if l.startswith("VmSize")][0]
+        # too little for the 64MB dir24 table
+        resource.setrlimit(resource.RLIMIT_AS, (vmsize + 32 * 2**20, resource.RLIM_INFINITY))
+        for pyt, layout in ((frozen, None), (frozen, "veb"), (thawed, None)):
+            try:
+                pyt.freeze(engine="dir24", layout=layout)
+                raise AssertionError("dir24 table built")
+            except MemoryError:
+                pass
+            assert(pyt["10.5.1.1"] == 5)
+            assert(list(pyt)[:2] == ["10.0.0.0/16", "10.1.0.0/16"])
+        thawed["10.0.0.0/8"] = 'a'  # not frozen
+        try:
+            fresh.__setstate__(state)
+            raise AssertionError("dir24 table built")
+        except MemoryError:
+            pass
+        fresh["10.0.0.0/8"] = 'a'
+        assert(len(fresh) == 1)
+    except Exception as e:
+        q.put(('error', repr(e)))
+        return
+    q.put(('success',None))
+
 
 if __name__ == '__main__':
     # Set this way specifically for the multiprocess test above
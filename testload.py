@@ -69,6 +69,29 @@ class PyTriciaLoadTest(unittest.TestCase):
 
         self.assertEqual(len(pyt), 0)
 
+    def testLoadPfx2as(self):
+        pyt = pytricia.PyTricia(128)
+        for f in PyTriciaLoadTest._files:
+            print ("loading routeviews data from {} with load_pfx2as".format(f))
+            self.assertGreater(pyt.load_pfx2as(f), 0)
+
+        # the same as inserting what the Python code above parses
+        expected = pytricia.PyTricia(128)
+        for f in PyTriciaLoadTest._files:
+            with gzip.GzipFile(f, 'r') as inf:
+                for line in inf:
+                    ipnet,prefix,asn = line.split()
+                    asn = asn.decode()
+                    expected['{}/{}'.format(ipnet.decode(), prefix.decode())] = int(asn) if asn.isdigit() else asn
+        self.assertEqual(pyt.items(), expected.items())
+
+        # and from file objects
+        other = pytricia.PyTricia(128)
+        for f in PyTriciaLoadTest._files:
+            with open(f, 'rb') as inf:
+                other.load_pfx2as(inf)
+        self.assertEqual(other.items(), expected.items())
+
 
 if __name__ == '__main__':
     unittest.main()